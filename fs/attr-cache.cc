@@ -0,0 +1,193 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "attr-cache.h"
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+using namespace std;
+
+AttrCache::Shard::Shard()
+  : generation(0)
+{
+}
+
+AttrCache::NameShard::NameShard()
+  : generation(0)
+{
+}
+
+AttrCache::AttrCache(size_t capacity)
+  : shardCapacity_(max<size_t>(capacity / shardCount_, 1)), hits_(0), negativeHits_(0), misses_(0)
+{
+}
+
+AttrCache::Shard &AttrCache::shard(sqlite3_int64 ino) const
+{
+  return shards_[(size_t)ino % shardCount_];
+}
+
+unsigned long AttrCache::stamp(sqlite3_int64 ino) const
+{
+  Shard &s = shard(ino);
+  lock_guard<mutex> lock(s.mutex);
+  return s.generation;
+}
+
+bool AttrCache::find(sqlite3_int64 ino, struct stat *stbuf)
+{
+  Shard &s = shard(ino);
+  lock_guard<mutex> lock(s.mutex);
+  unordered_map<sqlite3_int64, Lru::iterator>::iterator it = s.index.find(ino);
+  if (it == s.index.end())
+  {
+    misses_++;
+    return false;
+  }
+
+  s.lru.splice(s.lru.begin(), s.lru, it->second);
+  hits_++;
+  *stbuf = it->second->attr;
+  return true;
+}
+
+void AttrCache::fill(sqlite3_int64 ino, const struct stat *stbuf, unsigned long stamp)
+{
+  Shard &s = shard(ino);
+  lock_guard<mutex> lock(s.mutex);
+  if (stamp != s.generation)
+    return;
+
+  unordered_map<sqlite3_int64, Lru::iterator>::iterator it = s.index.find(ino);
+  if (it != s.index.end())
+  {
+    it->second->attr = *stbuf;
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    return;
+  }
+
+  while (s.lru.size() >= shardCapacity_)
+  {
+    s.index.erase(s.lru.back().ino);
+    s.lru.pop_back();
+  }
+  Entry entry;
+  entry.ino = ino;
+  entry.attr = *stbuf;
+  s.lru.push_front(entry);
+  s.index[ino] = s.lru.begin();
+}
+
+unsigned long AttrCache::invalidate(sqlite3_int64 ino)
+{
+  Shard &s = shard(ino);
+  lock_guard<mutex> lock(s.mutex);
+  unordered_map<sqlite3_int64, Lru::iterator>::iterator it = s.index.find(ino);
+  if (it != s.index.end())
+  {
+    s.lru.erase(it->second);
+    s.index.erase(it);
+  }
+  return ++s.generation;
+}
+
+// Names hold no '/', so the key of a name is unique to its parent
+string AttrCache::nameKey(sqlite3_int64 parent, const string &name)
+{
+  return to_string(parent) + "/" + name;
+}
+
+AttrCache::NameShard &AttrCache::nameShard(const string &key) const
+{
+  return nameShards_[hash<string>()(key) % shardCount_];
+}
+
+unsigned long AttrCache::nameStamp(sqlite3_int64 parent, const string &name) const
+{
+  NameShard &s = nameShard(nameKey(parent, name));
+  lock_guard<mutex> lock(s.mutex);
+  return s.generation;
+}
+
+bool AttrCache::absent(sqlite3_int64 parent, const string &name)
+{
+  string key = nameKey(parent, name);
+  NameShard &s = nameShard(key);
+  lock_guard<mutex> lock(s.mutex);
+  unordered_map<string, NameLru::iterator>::iterator it = s.index.find(key);
+  if (it == s.index.end())
+    return false;
+
+  s.lru.splice(s.lru.begin(), s.lru, it->second);
+  negativeHits_++;
+  return true;
+}
+
+void AttrCache::fillAbsent(sqlite3_int64 parent, const string &name, unsigned long stamp)
+{
+  string key = nameKey(parent, name);
+  NameShard &s = nameShard(key);
+  lock_guard<mutex> lock(s.mutex);
+  if (stamp != s.generation || s.index.count(key) != 0)
+    return;
+
+  while (s.lru.size() >= shardCapacity_)
+  {
+    s.index.erase(s.lru.back());
+    s.lru.pop_back();
+  }
+  s.lru.push_front(key);
+  s.index[key] = s.lru.begin();
+}
+
+void AttrCache::invalidateName(sqlite3_int64 parent, const string &name)
+{
+  string key = nameKey(parent, name);
+  NameShard &s = nameShard(key);
+  lock_guard<mutex> lock(s.mutex);
+  unordered_map<string, NameLru::iterator>::iterator it = s.index.find(key);
+  if (it != s.index.end())
+  {
+    s.lru.erase(it->second);
+    s.index.erase(it);
+  }
+  ++s.generation;
+}
+
+void AttrCache::report(ostream &os) const
+{
+  size_t entries = 0;
+  size_t negative = 0;
+  for (size_t i = 0; i < shardCount_; i++)
+  {
+    lock_guard<mutex> lock(shards_[i].mutex);
+    entries += shards_[i].lru.size();
+  }
+  for (size_t i = 0; i < shardCount_; i++)
+  {
+    lock_guard<mutex> lock(nameShards_[i].mutex);
+    negative += nameShards_[i].lru.size();
+  }
+  os << "hits " << hits_ << endl
+     << "negative_hits " << negativeHits_ << endl
+     << "misses " << misses_ << endl
+     << "entries " << entries << endl
+     << "negative_entries " << negative << endl
+     << "capacity " << shardCapacity_ * shardCount_ << endl;
+}
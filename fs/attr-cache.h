@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_ATTR_CACHE_H
+#define NDNFS_ATTR_CACHE_H
+
+#include <sys/stat.h>
+#include <sqlite3.h>
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <ostream>
+
+/**
+ * AttrCache keeps the attributes of recently used inodes in memory, so that getattr
+ * and lookup answer without a query. Entries are keyed by inode, which a rename does not
+ * change, so moving a file or a whole directory leaves them all valid. Every operation that
+ * adds, changes or removes a row of file_system goes through invalidate once it has
+ * committed, then refills the entry from the row it just wrote.
+ *
+ * Names looked up and found not to exist are kept too, by parent and name, so that probing
+ * for files that are not there (PATH searches, include paths) costs no query either, even
+ * once the kernel has let go of its own negative entry. Every operation that adds a name
+ * goes through invalidateName once it has committed.
+ *
+ * Entries are split over shards by inode, each with its own lock and least-recently-used
+ * order, so FUSE threads working on different files rarely wait for each other.
+ */
+class AttrCache
+{
+public:
+  AttrCache(size_t capacity);
+
+  /**
+   * Take before reading the attributes of ino from the database, and hand to fill.
+   */
+  unsigned long
+  stamp(sqlite3_int64 ino) const;
+
+  /**
+   * @return true, with the attributes in stbuf, if ino is cached
+   */
+  bool
+  find(sqlite3_int64 ino, struct stat *stbuf);
+
+  /**
+   * Cache the attributes of ino read from the database, unless the entry was invalidated
+   * after stamp was taken, in which case what was read may be older than the row.
+   */
+  void
+  fill(sqlite3_int64 ino, const struct stat *stbuf, unsigned long stamp);
+
+  /**
+   * Drop the entry of ino, and refuse the fills of attributes read before.
+   * @return the stamp to refill the entry with
+   */
+  unsigned long
+  invalidate(sqlite3_int64 ino);
+
+  /**
+   * Take before looking name up in the directory at parent, and hand to fillAbsent.
+   */
+  unsigned long
+  nameStamp(sqlite3_int64 parent, const std::string &name) const;
+
+  /**
+   * @return true if name is known not to exist in the directory at parent
+   */
+  bool
+  absent(sqlite3_int64 parent, const std::string &name);
+
+  /**
+   * Cache that name does not exist in the directory at parent, unless the name was
+   * invalidated after stamp was taken, in which case it may have been added since.
+   */
+  void
+  fillAbsent(sqlite3_int64 parent, const std::string &name, unsigned long stamp);
+
+  /**
+   * Drop the negative entry of name in the directory at parent, which was just added,
+   * and refuse the fills of lookups made before.
+   */
+  void
+  invalidateName(sqlite3_int64 parent, const std::string &name);
+
+  /**
+   * Write the hit and miss counters, and how many entries are cached.
+   */
+  void
+  report(std::ostream &os) const;
+
+private:
+  struct Entry
+  {
+    sqlite3_int64 ino;
+    struct stat attr;
+  };
+
+  typedef std::list<Entry> Lru;
+
+  struct Shard
+  {
+    Shard();
+
+    mutable std::mutex mutex;
+    // most recently used first
+    Lru lru;
+    std::unordered_map<sqlite3_int64, Lru::iterator> index;
+    // Bumped by every invalidate in the shard
+    unsigned long generation;
+  };
+
+  typedef std::list<std::string> NameLru;
+
+  // Negative entries, keyed by parent inode and name
+  struct NameShard
+  {
+    NameShard();
+
+    mutable std::mutex mutex;
+    // most recently used first
+    NameLru lru;
+    std::unordered_map<std::string, NameLru::iterator> index;
+    // Bumped by every invalidateName in the shard
+    unsigned long generation;
+  };
+
+  Shard &
+  shard(sqlite3_int64 ino) const;
+
+  static std::string
+  nameKey(sqlite3_int64 parent, const std::string &name);
+
+  NameShard &
+  nameShard(const std::string &key) const;
+
+  static const size_t shardCount_ = 16;
+  mutable Shard shards_[shardCount_];
+  mutable NameShard nameShards_[shardCount_];
+  size_t shardCapacity_;
+
+  std::atomic<unsigned long> hits_;
+  std::atomic<unsigned long> negativeHits_;
+  std::atomic<unsigned long> misses_;
+};
+
+namespace ndnfs {
+    extern size_t attr_cache_cap;
+    extern AttrCache *attr_cache;
+}
+
+#endif
@@ -21,53 +21,88 @@
 
 #include "attribute.h"
 #include "file-type.h"
+#include "segment-cache.h"
+#include "attr-cache.h"
+#include "dentry.h"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
 
 using namespace std;
 
-int ndnfs_getattr(const char *path, struct stat *stbuf)
+// Segment size of a file, or the one handed down by a directory; see set_seg_size
+static const char *seg_size_xattr = "user.ndnfs.seg_size";
+// Counters of the segment cache, readable on any path
+static const char *read_cache_xattr = "user.ndnfs.read_cache";
+
+int stat_from_row(sqlite3_stmt *stmt, int col, struct stat *stbuf)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_getattr: path=" << path << endl;
+  int type = sqlite3_column_int(stmt, col + 5);
+  if (type == DIRECTORY)
+  {
+    stbuf->st_mode = S_IFDIR | sqlite3_column_int(stmt, col);
+  }
+  else if (type == REGULAR)
+  {
+    stbuf->st_mode = S_IFREG | sqlite3_column_int(stmt, col);
+    // Lets cp and friends do I/O in whole segments
+    stbuf->st_blksize = sqlite3_column_int(stmt, col + 6);
+  }
+  else
+    return -ENOENT;
+  // The inode number, which the kernel addresses the file by
+  stbuf->st_ino = sqlite3_column_int64(stmt, col + 7);
+  stbuf->st_atime = sqlite3_column_int(stmt, col + 1);
+  stbuf->st_mtime = sqlite3_column_int(stmt, col + 2);
+  stbuf->st_size = sqlite3_column_int64(stmt, col + 3);
+  // The root dir has no entry; a file unlinked while open has none left either
+  stbuf->st_nlink = stbuf->st_ino == root_ino ? 1 : sqlite3_column_int(stmt, col + 4);
+  stbuf->st_uid = ndnfs::user_id;
+  stbuf->st_gid = ndnfs::group_id;
+  return 0;
+}
 
-  // It's hard to implement stat *
-  // string  pre;
-  // string name;
-  // split_last_component(path, pre, name);
-  // if (strcmp(name.c_str(), "*") == 0)
-  // {
-  //   return 0;
-  // }
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT mode, atime, current_version, size, nlink, type FROM file_system WHERE path = ?", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+// Read the attributes of ino from file_system into the attribute cache, as of stamp
+static int read_attr(sqlite3_int64 ino, struct stat *stbuf, unsigned long stamp)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT " STAT_COLUMNS " FROM file_system WHERE ino = ?");
+  sqlite3_bind_int64(stmt, 1, ino);
   int res = sqlite3_step(stmt);
-  if (res == SQLITE_ROW)
+  if (res != SQLITE_ROW)
   {
-    int type = sqlite3_column_int(stmt, 5);
-    if (type == DIRECTORY)
-    {
-      stbuf->st_mode = S_IFDIR | sqlite3_column_int(stmt, 0);
-    }
-    else if (type == REGULAR)
-    {
-      stbuf->st_mode = S_IFREG | sqlite3_column_int(stmt, 0);
-    }
-    else
-      return -errno;
-    stbuf->st_atime = sqlite3_column_int(stmt, 1);
-    stbuf->st_mtime = sqlite3_column_int(stmt, 2);
-    stbuf->st_size = sqlite3_column_int(stmt, 3);
-    stbuf->st_nlink = sqlite3_column_int(stmt, 4);
-    stbuf->st_uid = ndnfs::user_id;
-    stbuf->st_gid = ndnfs::group_id;
-    sqlite3_finalize(stmt);
-    return 0;
+    stmt.finalize();
+    return -ENOENT;
   }
-  else
+  res = stat_from_row(stmt, 0, stbuf);
+  stmt.finalize();
+  // Rows of other types have no attributes, and are not cached either way
+  if (res == 0)
+    ndnfs::attr_cache->fill(ino, stbuf, stamp);
+  return res;
+}
+
+void refresh_attr(sqlite3_int64 ino)
+{
+  unsigned long stamp = ndnfs::attr_cache->invalidate(ino);
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  read_attr(ino, &st, stamp);
+}
+
+int ndnfs_getattr(sqlite3_int64 ino, struct stat *stbuf)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_getattr: ino=" << ino << endl;
+  if (ndnfs::attr_cache->find(ino, stbuf))
+    return 0;
+
+  int res = read_attr(ino, stbuf, ndnfs::attr_cache->stamp(ino));
+  if (res < 0)
   {
-    sqlite3_finalize(stmt);
-    FILE_LOG(LOG_ERROR) << "ndnfs_getattr: get_attr failed. path:" << path << ". Errno " << errno << endl;
-    return -errno;
+    FILE_LOG(LOG_DEBUG) << "ndnfs_getattr: no such file. ino:" << ino << endl;
   }
+  return res;
 
   // char fullPath[PATH_MAX];
   // abs_path(fullPath, path);
@@ -83,61 +118,122 @@ int ndnfs_getattr(const char *path, struct stat *stbuf)
   // return ret;
 }
 
-int ndnfs_chmod(const char *path, mode_t mode)
+int ndnfs_chmod(sqlite3_int64 ino, mode_t mode)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_chmod: path=" << path << ", change mode to " << std::oct << mode << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_chmod: ino=" << ino << ", change mode to " << std::oct << mode << endl;
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "UPDATE file_system SET mode = ? WHERE path = ?", -1, &stmt, 0);
+  CachedStatement stmt;
+  stmt.prepare(db, "UPDATE file_system SET mode = ? WHERE ino = ?");
   sqlite3_bind_int(stmt, 1, mode);
-  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 2, ino);
   int res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-
-  char fullPath[PATH_MAX];
-  abs_path(fullPath, path);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+    return -EIO;
+  if (sqlite3_changes(db) == 0)
+    return -ENOENT;
+  refresh_attr(ino);
+
+  // Files have no counterpart under the actual folder to chmod
+  // char fullPath[PATH_MAX];
+  // abs_path(fullPath, path);
 
-  res = chmod(fullPath, mode);
-  if (res == -1)
-  {
-    FILE_LOG(LOG_ERROR) << "ndnfs_chmod: chmod failed. Errno: " << -errno << endl;
-    return -errno;
-  }
+  // res = chmod(fullPath, mode);
+  // if (res == -1)
+  // {
+  //   FILE_LOG(LOG_ERROR) << "ndnfs_chmod: chmod failed. Errno: " << -errno << endl;
+  //   return -errno;
+  // }
   return 0;
 }
 
-int ndnfs_updateattr(const char *path, int ver)
+// Set the size of ino to that of version ver; returns 0, or negative errno on failure
+int ndnfs_updateattr(sqlite3_int64 ino, int ver)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_updateattr path:" << path << endl;
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT length(content), segment FROM file_segments WHERE path = ? AND version = ? AND segment = (SELECT MAX(segment) FROM file_segments WHERE path = ? AND version = ?);", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver);
-  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 4, ver);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_updateattr ino:" << ino << endl;
+  CachedStatement stmt;
+  // The last segment ends the file, wherever it starts
+  stmt.prepare(db, "SELECT COALESCE(seg_offset, segment * ?) + size FROM segment_content WHERE ino = ? AND version = ? AND segment = (SELECT MAX(segment) FROM file_segments WHERE ino = ? AND version = ?);");
+  sqlite3_bind_int(stmt, 1, file_seg_size(db, ino));
+  sqlite3_bind_int64(stmt, 2, ino);
+  sqlite3_bind_int(stmt, 3, ver);
+  sqlite3_bind_int64(stmt, 4, ino);
+  sqlite3_bind_int(stmt, 5, ver);
   // sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
   int res = sqlite3_step(stmt);
-  int size = sqlite3_column_int(stmt, 0);
-  int seg = sqlite3_column_int(stmt, 1);
-  sqlite3_finalize(stmt);
-
-  size += seg * ndnfs::seg_size;
+  // An empty version has no segments
+  sqlite3_int64 size = res == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+  stmt.finalize();
+  if (res != SQLITE_ROW && res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_updateattr: select size error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
+  }
 
-  sqlite3_prepare_v2(db, "UPDATE file_system SET size = ? WHERE path = ?", -1, &stmt, 0);
-  sqlite3_bind_int(stmt, 1, size);
-  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
+  stmt.prepare(db, "UPDATE file_system SET size = ? WHERE ino = ?");
+  sqlite3_bind_int64(stmt, 1, size);
+  sqlite3_bind_int64(stmt, 2, ino);
   res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_updateattr: update size error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
+  }
+  if (sqlite3_changes(db) == 0)
+    return -ENOENT;
+  return 0;
 }
 
 // Dummy function to stop commands such as 'cp' from complaining
 
 #ifdef NDNFS_OSXFUSE
-int ndnfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position)
+int ndnfs_setxattr(sqlite3_int64 ino, const char *name, const char *value, size_t size, int flags, uint32_t position)
 #elif NDNFS_FUSE
-int ndnfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags)
+int ndnfs_setxattr(sqlite3_int64 ino, const char *name, const char *value, size_t size, int flags)
 #endif
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_setxattr path:" << path << " name:" << name << " size:" << size << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_setxattr ino:" << ino << " name:" << name << " size:" << size << endl;
+  if (strcmp(name, seg_size_xattr) == 0)
+  {
+    string text(value, size);
+    char *end;
+    long seg_size = strtol(text.c_str(), &end, 10);
+    if (text.empty() || *end != '\0' || seg_size <= 0)
+      return -EINVAL;
+    return set_seg_size(ino, (int)seg_size);
+  }
   return 0;
 }
+
+#ifdef NDNFS_OSXFUSE
+int ndnfs_getxattr(sqlite3_int64 ino, const char *name, char *value, size_t size, uint32_t position)
+#elif NDNFS_FUSE
+int ndnfs_getxattr(sqlite3_int64 ino, const char *name, char *value, size_t size)
+#endif
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_getxattr ino:" << ino << " name:" << name << " size:" << size << endl;
+  ostringstream text;
+  if (strcmp(name, seg_size_xattr) == 0)
+    text << file_seg_size(db, ino);
+  else if (strcmp(name, read_cache_xattr) == 0)
+    ndnfs::segment_cache->report(text);
+  else
+    return -ENOATTR;
+
+  string str = text.str();
+  if (size == 0)
+    return str.size();
+  if (size < str.size())
+    return -ERANGE;
+  memcpy(value, str.data(), str.size());
+  return str.size();
+}
+
+int ndnfs_removexattr(sqlite3_int64 ino, const char *name)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_removexattr ino:" << ino << " name:" << name << endl;
+  if (strcmp(name, seg_size_xattr) != 0)
+    return -ENOATTR;
+  return set_seg_size(ino, 0);
+}
@@ -24,16 +24,40 @@
 #include "ndnfs.h"
 #include "version.h"
 
-int ndnfs_getattr(const char *path, struct stat *stbuf);
+// Columns of file_system that stat_from_row reads, in its order; the link count is the number
+// of names the inode has in file_entries
+#define STAT_COLUMNS "mode, atime, COALESCE(mtime, current_version), size, (SELECT COUNT(*) FROM file_entries WHERE file_entries.ino = file_system.ino), type, seg_size, file_system.ino"
 
-int ndnfs_chmod(const char *path, mode_t mode);
+/**
+ * Fill stbuf from a row of file_system whose STAT_COLUMNS start at column col.
+ * @return 0, or -ENOENT if the row is neither a directory nor a regular file
+ */
+int stat_from_row(sqlite3_stmt *stmt, int col, struct stat *stbuf);
+
+/**
+ * Bring the cached attributes of ino in line with its row in file_system, after
+ * the row was changed (and the change committed), added or removed.
+ */
+void refresh_attr(sqlite3_int64 ino);
+
+int ndnfs_getattr(sqlite3_int64 ino, struct stat *stbuf);
+
+int ndnfs_chmod(sqlite3_int64 ino, mode_t mode);
 
-int ndnfs_updateattr(const char *path, int ver);
+int ndnfs_updateattr(sqlite3_int64 ino, int ver);
 
 #ifdef NDNFS_OSXFUSE
-int ndnfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags, uint32_t position);
+int ndnfs_setxattr(sqlite3_int64 ino, const char *name, const char *value, size_t size, int flags, uint32_t position);
 #elif NDNFS_FUSE
-int ndnfs_setxattr(const char *path, const char *name, const char *value, size_t size, int flags);
+int ndnfs_setxattr(sqlite3_int64 ino, const char *name, const char *value, size_t size, int flags);
 #endif
 
+#ifdef NDNFS_OSXFUSE
+int ndnfs_getxattr(sqlite3_int64 ino, const char *name, char *value, size_t size, uint32_t position);
+#elif NDNFS_FUSE
+int ndnfs_getxattr(sqlite3_int64 ino, const char *name, char *value, size_t size);
+#endif
+
+int ndnfs_removexattr(sqlite3_int64 ino, const char *name);
+
 #endif
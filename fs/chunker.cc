@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "chunker.h"
+
+// Gear table, the same on every mount so that chunks of the same content are cut alike
+static uint64_t gear[256];
+
+static bool init_gear()
+{
+  // splitmix64
+  uint64_t state = 0x6e646e6673ULL;
+  for (int i = 0; i < 256; i++)
+  {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    gear[i] = z ^ (z >> 31);
+  }
+  return true;
+}
+
+static const bool gear_ready = init_gear();
+
+// Mask of the top bits of the hash, which depend on the last 64 bytes
+static uint64_t top_bits(int bits)
+{
+  return bits <= 0 ? 0 : ~0ULL << (64 - bits);
+}
+
+Chunker::Chunker(size_t max_size)
+  : min_(max_size / 8), avg_(max_size / 2), max_(max_size)
+{
+  int bits = 0;
+  while (((size_t)1 << (bits + 1)) <= avg_)
+    bits++;
+  maskS_ = top_bits(bits + 2);
+  maskL_ = top_bits(bits - 2);
+}
+
+size_t Chunker::cut(const char *data, size_t len) const
+{
+  if (len <= min_)
+    return len;
+  size_t normal = len < avg_ ? len : avg_;
+  size_t barrier = len < max_ ? len : max_;
+
+  const unsigned char *p = (const unsigned char *)data;
+  uint64_t hash = 0;
+  size_t i = min_;
+  for (; i < normal; i++)
+  {
+    hash = (hash << 1) + gear[p[i]];
+    if ((hash & maskS_) == 0)
+      return i + 1;
+  }
+  for (; i < barrier; i++)
+  {
+    hash = (hash << 1) + gear[p[i]];
+    if ((hash & maskL_) == 0)
+      return i + 1;
+  }
+  return barrier;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_CHUNKER_H
+#define NDNFS_CHUNKER_H
+
+#include <cstddef>
+#include <stdint.h>
+
+/**
+ * Chunker cuts content into content-defined chunks, following FastCDC: a gear hash rolls
+ * over the bytes, and a chunk ends where the high bits of the hash picked by a mask are
+ * all zero. Cut points depend only on the bytes just before them, so an insertion or a
+ * deletion moves the chunk boundaries around it and leaves the rest of the chunks, and
+ * their digests, as they were.
+ * Chunks are no shorter than max/8 and no longer than max, and max/2 long on average.
+ * Past max/2 bytes, a mask with fewer bits makes a cut more likely (normalized chunking),
+ * which keeps chunk sizes close to the average.
+ */
+class Chunker
+{
+public:
+  Chunker(size_t max_size);
+
+  /**
+   * Length of the first chunk of data. A chunk shorter than max, without a cut point,
+   * is returned only when len is shorter than max, at the end of the content.
+   */
+  size_t
+  cut(const char *data, size_t len) const;
+
+  size_t
+  maxSize() const { return max_; }
+
+private:
+  size_t min_;
+  size_t avg_;
+  size_t max_;
+  uint64_t maskS_;
+  uint64_t maskL_;
+};
+
+#endif
@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <zstd.h>
+
+#include "compression.h"
+#include "logger.h"
+
+using namespace std;
+
+// zstd's default level compresses a segment in far less time than it takes to sign one
+static const int compression_level = ZSTD_CLEVEL_DEFAULT;
+
+// Types whose content is compressed already, besides audio/* and video/*
+static const char *compressed_types[] = {
+  "image/gif",
+  "image/jpeg",
+  "image/pjpeg",
+  "image/png",
+  "application/pdf",
+  "application/zip",
+  "application/x-zip-compressed",
+  "application/x-compressed",
+  "application/x-compress",
+  "application/x-gzip",
+  "application/x-bzip",
+  "application/x-bzip2",
+  "application/arj",
+  "application/lha",
+  "application/x-lha",
+  "application/x-lzh",
+  "application/lzx",
+  "application/x-lzx",
+  "application/x-stuffit",
+  "application/x-sit",
+  "application/mac-compactpro",
+  "application/x-compactpro",
+  "application/x-cpt",
+  "application/x-shockwave-flash",
+  "multipart/x-gzip",
+  "multipart/x-zip",
+  NULL
+};
+
+const char *encoding_name(int encoding)
+{
+  return encoding == ZSTD_SEGMENT ? "zstd" : "";
+}
+
+bool mime_compressible(const char *mime_type)
+{
+  if (mime_type == NULL)
+    return true;
+  if (strncmp(mime_type, "audio/", 6) == 0 || strncmp(mime_type, "video/", 6) == 0)
+    return false;
+  for (const char **type = compressed_types; *type != NULL; type++)
+  {
+    if (strcmp(mime_type, *type) == 0)
+      return false;
+  }
+  return true;
+}
+
+int compress_segment(const char *data, size_t len, string &out)
+{
+  out.resize(ZSTD_compressBound(len));
+  size_t res = ZSTD_compress(&out[0], out.size(), data, len, compression_level);
+  if (ZSTD_isError(res))
+  {
+    FILE_LOG(LOG_ERROR) << "compress_segment: " << ZSTD_getErrorName(res) << endl;
+    return -EIO;
+  }
+  out.resize(res);
+  return 0;
+}
+
+int decode_segment(int encoding, const char *data, size_t len, size_t length, string &out)
+{
+  if (encoding == PLAIN_SEGMENT)
+  {
+    out.assign(data, len);
+    return 0;
+  }
+  if (encoding != ZSTD_SEGMENT)
+  {
+    FILE_LOG(LOG_ERROR) << "decode_segment: unknown encoding " << encoding << endl;
+    return -EIO;
+  }
+
+  out.resize(length);
+  size_t res = ZSTD_decompress(&out[0], length, data, len);
+  if (ZSTD_isError(res) || res != length)
+  {
+    FILE_LOG(LOG_ERROR) << "decode_segment: " << (ZSTD_isError(res) ? ZSTD_getErrorName(res) : "length mismatch") << endl;
+    return -EIO;
+  }
+  return 0;
+}
+
+int read_content(ExtentStore *store, sqlite3_stmt *stmt, int col, string &content, bool decode)
+{
+  int encoding = sqlite3_column_int(stmt, col + 4);
+  if (!decode || encoding == PLAIN_SEGMENT)
+    return read_payload(store, stmt, col, content);
+
+  string stored;
+  int ret = read_payload(store, stmt, col, stored);
+  if (ret < 0)
+    return ret;
+  return decode_segment(encoding, stored.data(), stored.size(), sqlite3_column_int(stmt, col + 5), content);
+}
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_COMPRESSION_H
+#define NDNFS_COMPRESSION_H
+
+#include <string>
+
+#include <sqlite3.h>
+
+#include "extent-store.h"
+
+/**
+ * Segment content is compressed with zstd as a version is committed (dedup_version), one
+ * segment at a time, so that each one still decodes on its own. The segment_blobs row holding
+ * the content records how it is stored in encoding; reads decode it, and see the content as
+ * it was written. Content of files whose MIME type is compressed already is left as it is.
+ * With ndnfs::wire_compression, a version whose segments are all stored compressed is also
+ * published that way: segments are signed and sent as stored, and the file info of the
+ * version names the encoding, for consumers to decode them.
+ */
+enum SegmentEncoding
+{
+  PLAIN_SEGMENT = 0,
+  ZSTD_SEGMENT = 1
+};
+
+// Name of an encoding in Ndnfs::FileInfo
+const char *encoding_name(int encoding);
+
+/**
+ * Whether content of a MIME type is worth compressing: not if it is compressed already,
+ * as most images, audio, video and archives are. Content of no known type is.
+ */
+bool mime_compressible(const char *mime_type);
+
+/**
+ * Compress len bytes of data into out, as one zstd frame.
+ * @return 0, or -EIO on failure
+ */
+int compress_segment(const char *data, size_t len, std::string &out);
+
+/**
+ * Decode len bytes of data stored with encoding into out, which comes to length bytes.
+ * @return 0, or -EIO on failure
+ */
+int decode_segment(int encoding, const char *data, size_t len, size_t length, std::string &out);
+
+/**
+ * Content of a segment_content row whose columns col to col + 5 are content, extent,
+ * extent_offset, stored_size, encoding and size; decoded, or as stored unless decode.
+ * @return 0, or negative errno on failure
+ */
+int read_content(ExtentStore *store, sqlite3_stmt *stmt, int col, std::string &content, bool decode = true);
+
+namespace ndnfs {
+    extern bool compress_segments;
+    extern bool wire_compression;
+}
+
+#endif
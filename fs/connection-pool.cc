@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sstream>
+#include <algorithm>
+
+#include "connection-pool.h"
+#include "statement-cache.h"
+#include "logger.h"
+
+using namespace std;
+
+ConnectionPool::ConnectionPool(const string &db_path)
+  : dbPath_(db_path)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+  lock_guard<mutex> lock(mutex_);
+  if (all_.size() != idle_.size())
+  {
+    FILE_LOG(LOG_ERROR) << "~ConnectionPool: " << all_.size() - idle_.size() << " connections still in use" << endl;
+  }
+  for (size_t i = 0; i < all_.size(); i++)
+    close(all_[i]);
+}
+
+sqlite3 *ConnectionPool::acquire()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (!idle_.empty())
+    {
+      sqlite3 *conn = idle_.back();
+      idle_.pop_back();
+      return conn;
+    }
+  }
+
+  sqlite3 *conn = NULL;
+  if (sqlite3_open(dbPath_.c_str(), &conn) != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "ConnectionPool::acquire: cannot connect to sqlite db " << dbPath_ << endl;
+    sqlite3_close(conn);
+    return NULL;
+  }
+  // Other threads, the sign queue and the server write through their own connections
+  sqlite3_busy_timeout(conn, 10000);
+  sqlite3_exec(conn, "PRAGMA journal_mode = WAL;", NULL, NULL, NULL);
+
+  lock_guard<mutex> lock(mutex_);
+  all_.push_back(conn);
+  FILE_LOG(LOG_DEBUG) << "ConnectionPool::acquire: " << all_.size() << " connections open" << endl;
+  return conn;
+}
+
+void ConnectionPool::release(sqlite3 *conn)
+{
+  lock_guard<mutex> lock(mutex_);
+  idle_.push_back(conn);
+}
+
+void ConnectionPool::closeIdle()
+{
+  lock_guard<mutex> lock(mutex_);
+  for (size_t i = 0; i < idle_.size(); i++)
+  {
+    all_.erase(find(all_.begin(), all_.end(), idle_[i]));
+    close(idle_[i]);
+  }
+  idle_.clear();
+}
+
+void ConnectionPool::report(ostream &os) const
+{
+  lock_guard<mutex> lock(mutex_);
+  for (size_t i = 0; i < all_.size(); i++)
+  {
+    os << "connection " << i << ":" << endl;
+    statement_cache(all_[i])->report(os);
+  }
+}
+
+void ConnectionPool::close(sqlite3 *conn)
+{
+  drop_statement_cache(conn);
+  sqlite3_close(conn);
+}
+
+ThreadConnection::operator sqlite3 *()
+{
+  if (conn_ == NULL && ndnfs::connection_pool != NULL)
+    conn_ = ndnfs::connection_pool->acquire();
+  return conn_;
+}
+
+void ThreadConnection::release()
+{
+  if (conn_ == NULL)
+    return;
+  if (ndnfs::connection_pool != NULL)
+  {
+    ndnfs::connection_pool->release(conn_);
+  }
+  else
+  {
+    drop_statement_cache(conn_);
+    sqlite3_close(conn_);
+  }
+  conn_ = NULL;
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_CONNECTION_POOL_H
+#define NDNFS_CONNECTION_POOL_H
+
+#include <sqlite3.h>
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <ostream>
+
+/**
+ * ConnectionPool keeps the db connections of the FUSE threads. With the multithreaded
+ * FUSE loop every worker thread gets a connection of its own, in WAL mode, so readers
+ * do not block each other or the writer; a thread returns its connection when it exits,
+ * and the next thread reuses it rather than opening a new one.
+ */
+class ConnectionPool
+{
+public:
+  ConnectionPool(const std::string &db_path);
+
+  /**
+   * Closes every connection; all threads have to be done with theirs.
+   */
+  ~ConnectionPool();
+
+  /**
+   * @return an idle connection, or a new one; NULL if the db cannot be opened
+   */
+  sqlite3 *
+  acquire();
+
+  void
+  release(sqlite3 *conn);
+
+  /**
+   * Close the idle connections, e.g. before FUSE forks to daemonize.
+   */
+  void
+  closeIdle();
+
+  /**
+   * Write the statement execution counts of every connection.
+   */
+  void
+  report(std::ostream &os) const;
+
+private:
+  void
+  close(sqlite3 *conn);
+
+  std::string dbPath_;
+  mutable std::mutex mutex_;
+  std::vector<sqlite3 *> all_;
+  std::vector<sqlite3 *> idle_;
+};
+
+/**
+ * ThreadConnection stands in for the sqlite3 connection of the calling thread: the first
+ * use checks a connection out of ndnfs::connection_pool, and the thread returns it when
+ * it exits.
+ */
+class ThreadConnection
+{
+public:
+  ThreadConnection() : conn_(NULL) {}
+
+  ~ThreadConnection() { release(); }
+
+  operator sqlite3 *();
+
+  void
+  release();
+
+private:
+  ThreadConnection(const ThreadConnection &);
+  ThreadConnection &operator=(const ThreadConnection &);
+
+  sqlite3 *conn_;
+};
+
+namespace ndnfs {
+    extern ConnectionPool *connection_pool;
+}
+
+#endif
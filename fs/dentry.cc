@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "dentry.h"
+#include "statement-cache.h"
+
+#include <cerrno>
+
+using namespace std;
+
+sqlite3_int64 lookup_entry(sqlite3 *conn, sqlite3_int64 parent, const string &name)
+{
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT ino FROM file_entries WHERE parent = ? AND name = ?;");
+  sqlite3_bind_int64(stmt, 1, parent);
+  sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_STATIC);
+  sqlite3_int64 ino = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    ino = sqlite3_column_int64(stmt, 0);
+  stmt.finalize();
+  return ino;
+}
+
+int inode_type(sqlite3 *conn, sqlite3_int64 ino)
+{
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT type FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  int type = -ENOENT;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    type = sqlite3_column_int(stmt, 0);
+  stmt.finalize();
+  return type;
+}
+
+sqlite3_int64 path_to_ino(sqlite3 *conn, const string &path)
+{
+  sqlite3_int64 ino = root_ino;
+  size_t begin = 0;
+  while (ino != 0 && begin < path.size())
+  {
+    size_t end = path.find('/', begin);
+    if (end == string::npos)
+      end = path.size();
+    // Empty components, as in "/" or "a//b", stay where they are
+    if (end > begin)
+      ino = lookup_entry(conn, ino, path.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return ino;
+}
+
+int ino_to_path(sqlite3 *conn, sqlite3_int64 ino, string &path)
+{
+  path.clear();
+  CachedStatement stmt;
+  while (ino != root_ino)
+  {
+    stmt.prepare(conn, "SELECT parent, name FROM file_entries WHERE ino = ?;");
+    sqlite3_bind_int64(stmt, 1, ino);
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+    {
+      stmt.finalize();
+      return -ENOENT;
+    }
+    ino = sqlite3_column_int64(stmt, 0);
+    path.insert(0, "/" + string((const char *)sqlite3_column_text(stmt, 1)));
+    stmt.finalize();
+  }
+  if (path.empty())
+    path = "/";
+  return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_DENTRY_H
+#define NDNFS_DENTRY_H
+
+#include <sqlite3.h>
+
+#include <string>
+
+/**
+ * Files and directories are rows of file_system, keyed by inode number, and get their
+ * names from file_entries, which maps (inode of the directory, name) to the inode named.
+ * Versions, segments and manifests belong to the inode, so a rename only touches the
+ * one entry, whatever is below it. These resolve paths and inodes on a connection;
+ * they are shared with the server.
+ */
+
+// Inode number of the root directory, which has no entry of its own
+const sqlite3_int64 root_ino = 1;
+
+/**
+ * @return the inode named name in the directory parent, or 0 if there is none
+ */
+sqlite3_int64
+lookup_entry(sqlite3 *conn, sqlite3_int64 parent, const std::string &name);
+
+/**
+ * @return the type of the inode ino, see file-type.h, or -ENOENT if there is none
+ */
+int
+inode_type(sqlite3 *conn, sqlite3_int64 ino);
+
+/**
+ * Walk path from the root, one entry per component.
+ * @return the inode at path, or 0 if there is none
+ */
+sqlite3_int64
+path_to_ino(sqlite3 *conn, const std::string &path);
+
+/**
+ * Walk from ino up to the root, one entry per component.
+ * @return 0, or -ENOENT if ino is not linked into the tree
+ */
+int
+ino_to_path(sqlite3 *conn, sqlite3_int64 ino, std::string &path);
+
+#endif
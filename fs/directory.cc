@@ -20,58 +20,46 @@
  */
 
 #include "directory.h"
+#include "attribute.h"
 #include "signature-states.h"
+#include "dentry.h"
+#include "file.h"
+#include "file-lock.h"
+#include "attr-cache.h"
 
 using namespace std;
 
-int ndnfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+int ndnfs_readdir(sqlite3_int64 dir_ino, const char *after, void *buf, ndnfs_fill_dir_t filler)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_readdir: path=" << path << endl;
-  // read from db
-  sqlite3_stmt *stmt;
-
-  int level = 0; // director's level
-
-  // Get father dir's level
-  sqlite3_prepare_v2(db, "SELECT level FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
+  FILE_LOG(LOG_DEBUG) << "ndnfs_readdir: ino=" << dir_ino << ", after=" << (after != NULL ? after : "") << endl;
+
+  // Entries of a dir are keyed by name, so the listing comes in name order, and resumes
+  // from the name it stopped at without rescanning what came before.
+  // Attributes come in the same scan, so that listing them does not cost a getattr per entry.
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT e.name, " STAT_COLUMNS " FROM file_entries e JOIN file_system ON file_system.ino = e.ino \
+                      WHERE e.parent = ? AND e.name > ? ORDER BY e.name;");
+  sqlite3_bind_int64(stmt, 1, dir_ino);
+  sqlite3_bind_text(stmt, 2, after != NULL ? after : "", -1, SQLITE_STATIC);
+
+  if (after == NULL)
   {
-    sqlite3_finalize(stmt);
-    return -ENOENT;
+    if (filler(buf, ".", NULL, 0) != 0 || filler(buf, "..", NULL, 0) != 0)
+    {
+      stmt.finalize();
+      return 0;
+    }
   }
-  level = sqlite3_column_int(stmt, 0);
-  level += 1;
-  sqlite3_finalize(stmt);
-
-  sqlite3_prepare_v2(db, "SELECT path FROM file_system WHERE path LIKE ? AND level = ?;", -1, &stmt, 0);
-  char path_notexact[100];
-  strcpy(path_notexact, path);
-  if (level == 1)
-    strcat(path_notexact, "%");
-  else
-    strcat(path_notexact, "/%");
-  sqlite3_bind_text(stmt, 1, path_notexact, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, level);
-  // Means no such dir
-  // if (res != SQLITE_ROW)
-
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
   while (sqlite3_step(stmt) == SQLITE_ROW)
   {
-    // FILE_LOG(LOG_DEBUG)<<"path: "<< sqlite3_column_text(stmt, 0)<< endl;
-    char child_dir[sqlite3_column_bytes(stmt, 0)];
-    strcpy(child_dir, (char *)sqlite3_column_text(stmt, 0));
-    string prefix;
-    string name;
-    split_last_component(child_dir, prefix, name);
-    // FILE_LOG(LOG_DEBUG)<<"path: "<< name<< endl;
-    filler(buf, name.c_str(), NULL, 0);
+    const char *name = (const char *)sqlite3_column_text(stmt, 0);
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    if (filler(buf, name, stat_from_row(stmt, 1, &st) == 0 ? &st : NULL, 0) != 0)
+      break;
   }
 
-  sqlite3_finalize(stmt);
+  stmt.finalize();
   return 0;
 
   // Read the actual dir
@@ -110,80 +98,84 @@ int ndnfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t off
 * But every dir have to have a parent dir;
 * So I insert a root dir named "/" into file_system.
 */
-int ndnfs_mkdir(const char *path, mode_t mode)
+int ndnfs_mkdir(sqlite3_int64 parent, const char *dir_name, mode_t mode)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_mkdir: path=" << path << ", mode=0" << std::oct << mode << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_mkdir: parent=" << parent << ", name=" << dir_name << ", mode=0" << std::oct << mode << endl;
   // cout<< "Step to  ndnfs_mkdir\n";
 
-  string dir_path, dir_name;
-  split_last_component(path, dir_path, dir_name);
-  int level = 0;
-
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res == SQLITE_ROW)
+  if (lookup_entry(db, parent, dir_name) != 0)
   {
     // Cannot create file that has conflicting file name
-    sqlite3_finalize(stmt);
-    return -ENOENT;
+    return -EEXIST;
   }
-  sqlite3_finalize(stmt);
 
-  // Cannot create file without creationg necessary folders
-  sqlite3_prepare_v2(db, "SELECT level FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, dir_path.c_str(), -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
-  {
-    sqlite3_finalize(stmt);
+  // The actual folder mirrors the tree of directories; it is made first, so that a directory
+  // is only added once it exists. One left behind by an earlier rmdir is taken over.
+  string path;
+  if (ino_to_path(db, parent, path) < 0)
     return -ENOENT;
+  if (path != "/")
+    path += "/";
+  path += dir_name;
+  char fullPath[PATH_MAX];
+  abs_path(fullPath, path.c_str());
+  if (mkdir(fullPath, mode) == -1 && errno != EEXIST)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_mkdir: mkdir failed. Errno: " << errno << endl;
+    return -errno;
   }
-  level = sqlite3_column_int(stmt, 0);
-  level += 1;
-  sqlite3_finalize(stmt);
-
-  // Generate first version entry for the new file
-  int ver = time(0);
-  sqlite3_prepare_v2(db, "INSERT INTO file_versions (path, version) VALUES (?, ?);", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
 
   // Add the file(dir is a kind of file) entry to database
-  // For directory, I use ready_signed to indicate the level
-  // of which dir.
-  sqlite3_prepare_v2(db,
-                     "INSERT INTO file_system \
-                      (path, current_version, mime_type, ready_signed, type, size, level) \
-                      VALUES (?, ?, ?, ?, ?, 4096, ?);",
-                     -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver); // current version
-  char *mime_type = "";
-  sqlite3_bind_text(stmt, 3, mime_type, -1, SQLITE_STATIC); // mime_type based on ext
+  // The segment size of the parent dir, if any, is handed down.
+  int ver = time(0);
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  CachedStatement stmt;
+  stmt.prepare(db, "INSERT INTO file_system \
+                      (current_version, mime_type, ready_signed, type, size, seg_size) \
+                      VALUES (?, ?, ?, ?, 4096, (SELECT seg_size FROM file_system WHERE ino = ?));");
+  sqlite3_bind_int(stmt, 1, ver); // current version
+  const char *mime_type = "";
+  sqlite3_bind_text(stmt, 2, mime_type, -1, SQLITE_STATIC); // mime_type based on ext
   enum SignatureState signatureState = NOT_READY;
-  sqlite3_bind_int(stmt, 4, signatureState);
+  sqlite3_bind_int(stmt, 3, signatureState);
   enum FileType fileType = DIRECTORY;
-  sqlite3_bind_int(stmt, 5, fileType);
-  sqlite3_bind_int(stmt, 6, level);
+  sqlite3_bind_int(stmt, 4, fileType);
+  sqlite3_bind_int64(stmt, 5, parent);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  sqlite3_int64 ino = sqlite3_last_insert_rowid(db);
 
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  FILE_LOG(LOG_DEBUG) << "ndnfs_mkdir: Insert to database sucessful\n";
+  // Generate first version entry for the new file
+  if (res == SQLITE_DONE)
+  {
+    stmt.prepare(db, "INSERT INTO file_versions (ino, version) VALUES (?, ?);");
+    sqlite3_bind_int64(stmt, 1, ino);
+    sqlite3_bind_int(stmt, 2, ver);
+    res = sqlite3_step(stmt);
+    stmt.finalize();
+  }
 
-  // This is actual make directory
-  char fullPath[PATH_MAX];
-  abs_path(fullPath, path);
-  int ret = mkdir(fullPath, mode);
+  // The name goes in last, which is what makes the dir visible; it fails if the name was taken meanwhile
+  if (res == SQLITE_DONE)
+  {
+    stmt.prepare(db, "INSERT INTO file_entries (parent, name, ino) VALUES (?, ?, ?);");
+    sqlite3_bind_int64(stmt, 1, parent);
+    sqlite3_bind_text(stmt, 2, dir_name, -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 3, ino);
+    res = sqlite3_step(stmt);
+    stmt.finalize();
+  }
 
-  if (ret == -1)
+  if (res != SQLITE_DONE)
   {
-    FILE_LOG(LOG_ERROR) << "ndnfs_mkdir: mkdir failed. Errno: " << errno << endl;
-    return -errno;
+    FILE_LOG(LOG_ERROR) << "ndnfs_mkdir: insert error. " << res << endl;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return res == SQLITE_CONSTRAINT ? -EEXIST : -EIO;
   }
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  refresh_attr(ino);
+  ndnfs::attr_cache->invalidateName(parent, dir_name);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_mkdir: Insert to database sucessful\n";
 
   return 0;
 }
@@ -193,65 +185,59 @@ int ndnfs_mkdir(const char *path, mode_t mode)
  * because 'rm -r' will iterate all the sub-entries (dirs or
  * files) for us and remove them one-by-one.   ---SWT
  */
-int ndnfs_rmdir(const char *path)
+int ndnfs_rmdir(sqlite3_int64 parent, const char *name)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_rmdir: path=" << path << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_rmdir: parent=" << parent << ", name=" << name << endl;
 
-  if (strcmp(path, "/") == 0)
+  // The root dir has no entry, and cannot be removed
+  sqlite3_int64 ino = lookup_entry(db, parent, name);
+  if (ino == 0)
   {
-    // Cannot remove root dir.
-    return -EINVAL;
+    FILE_LOG(LOG_DEBUG) << "rmdir error, no such directory!" << endl;
+    return -ENOENT;
   }
-
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "select level FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  if (inode_type(db, ino) != DIRECTORY)
+    return -ENOTDIR;
+  FileLock lock(ino);
+
+  // The sub-entries have been removed one-by-one by now, if this is 'rm -r'
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT 1 FROM file_entries WHERE parent = ? LIMIT 1;");
+  sqlite3_bind_int64(stmt, 1, ino);
   int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
+  stmt.finalize();
+  if (res == SQLITE_ROW)
   {
-    sqlite3_finalize(stmt);
-    FILE_LOG(LOG_DEBUG) << "rmdir error, no such directory!" << endl;
-    return -errno;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -ENOTEMPTY;
   }
-  sqlite3_finalize(stmt);
 
-  char path_noexact[100];
-  strcpy(path_noexact, path);
-  strcat(path_noexact, "/%");
-
-  // Delete file in this directory
-  sqlite3_prepare_v2(db, "DELETE FROM file_system WHERE path LIKE ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path_noexact, -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  string path;
+  ino_to_path(db, ino, path);
 
-  sqlite3_prepare_v2(db, "DELETE FROM file_version WHERE path LIKE ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path_noexact, -1, SQLITE_STATIC);
+  // Delete the name; the directory itself goes once the kernel forgets it, see unlink_inode
+  stmt.prepare(db, "DELETE FROM file_entries WHERE parent = ? AND name = ?;");
+  sqlite3_bind_int64(stmt, 1, parent);
+  sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
   res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-
-  sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path LIKE ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path_noexact, -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -EIO;
+  }
+  unlink_inode(ino);
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  refresh_attr(ino);
 
-  // Delete the directory
-  sqlite3_prepare_v2(db, "DELETE FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  // The actual folder goes too; one left behind is taken over by the next mkdir of the name
+  char fullPath[PATH_MAX];
+  abs_path(fullPath, path.c_str());
+  if (rmdir(fullPath) == -1)
+  {
+    FILE_LOG(LOG_DEBUG) << "ndnfs_rmdir: rmdir of actual folder failed. Errno: " << errno << endl;
+  }
 
   return 0;
-
-  // char fullPath[PATH_MAX];
-  // abs_path(fullPath, path);
-  // int ret = rmdir(fullPath);
-
-  // if (ret == -1)
-  // {
-  //   FILE_LOG(LOG_ERROR) << "ndnfs_rmdir: rmdir failed. Errno: " << errno << endl;
-  //   return -errno;
-  // }
-
-  // return 0;
 }
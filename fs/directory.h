@@ -24,11 +24,15 @@
 #include "ndnfs.h"
 #include "file-type.h"
 
-int ndnfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-                  off_t offset, struct fuse_file_info *fi);
+// Adds an entry to buf; stbuf may be NULL. Returns nonzero when buf is full.
+typedef int (*ndnfs_fill_dir_t)(void *buf, const char *name, const struct stat *stbuf, off_t off);
 
-int ndnfs_mkdir(const char *path, mode_t mode);
+// Lists the entries of the directory ino in name order, starting after the entry named after,
+// or from ".", ".." and the first one if after is NULL, until filler is full.
+int ndnfs_readdir(sqlite3_int64 ino, const char *after, void *buf, ndnfs_fill_dir_t filler);
 
-int ndnfs_rmdir(const char *path);
+int ndnfs_mkdir(sqlite3_int64 parent, const char *name, mode_t mode);
+
+int ndnfs_rmdir(sqlite3_int64 parent, const char *name);
 
 #endif
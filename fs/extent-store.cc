@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sstream>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "extent-store.h"
+#include "logger.h"
+
+using namespace std;
+
+const off_t ExtentStore::extent_cap = 256 * 1024 * 1024;
+
+ExtentStore::ExtentStore(const string &dir, bool writable)
+  : dir_(dir), writable_(writable), current_(-1), tail_(0),
+    appends_(0), appendBytes_(0), reads_(0), readBytes_(0)
+{
+  if (writable_ && mkdir(dir_.c_str(), 0755) < 0 && errno != EEXIST)
+  {
+    FILE_LOG(LOG_ERROR) << "ExtentStore: cannot create " << dir_ << ", errno " << errno << endl;
+  }
+
+  // Appends carry on at the end of the highest numbered extent
+  DIR *dp = opendir(dir_.c_str());
+  if (dp == NULL)
+    return;
+  struct dirent *de;
+  while ((de = readdir(dp)) != NULL)
+  {
+    char *end;
+    long extent = strtol(de->d_name, &end, 10);
+    if (end == de->d_name || *end != '\0' || extent <= current_)
+      continue;
+    struct stat st;
+    if (stat(extentPath(extent).c_str(), &st) < 0)
+      continue;
+    current_ = extent;
+    tail_ = st.st_size;
+  }
+  closedir(dp);
+  FILE_LOG(LOG_DEBUG) << "ExtentStore: " << dir_ << ", current extent " << current_ << ", tail " << tail_ << endl;
+}
+
+ExtentStore::~ExtentStore()
+{
+  sync();
+  for (map<int, int>::iterator it = fds_.begin(); it != fds_.end(); ++it)
+    close(it->second);
+}
+
+string ExtentStore::extentPath(int extent) const
+{
+  char name[16];
+  snprintf(name, sizeof(name), "%08d", extent);
+  return dir_ + "/" + name;
+}
+
+int ExtentStore::extentFd(int extent)
+{
+  map<int, int>::iterator it = fds_.find(extent);
+  if (it != fds_.end())
+    return it->second;
+
+  int fd = open(extentPath(extent).c_str(), writable_ ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+  if (fd < 0)
+  {
+    FILE_LOG(LOG_ERROR) << "ExtentStore::extentFd: cannot open extent " << extent << ", errno " << errno << endl;
+    return -errno;
+  }
+  fds_[extent] = fd;
+  return fd;
+}
+
+int ExtentStore::append(const char *data, size_t len, int &extent, off_t &offset)
+{
+  int fd;
+  {
+    // Only the space is reserved under the lock; appends to different places write in parallel
+    lock_guard<mutex> lock(mutex_);
+    if (!writable_)
+      return -EROFS;
+    if (current_ < 0 || (tail_ > 0 && tail_ + (off_t)len > extent_cap))
+    {
+      current_++;
+      tail_ = 0;
+    }
+    fd = extentFd(current_);
+    if (fd < 0)
+      return fd;
+    extent = current_;
+    offset = tail_;
+    tail_ += len;
+    unsynced_.insert(current_);
+    appends_++;
+    appendBytes_ += len;
+  }
+
+  size_t done = 0;
+  while (done < len)
+  {
+    ssize_t res = pwrite(fd, data + done, len - done, offset + done);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0)
+    {
+      FILE_LOG(LOG_ERROR) << "ExtentStore::append: write error in extent " << extent << ", errno " << errno << endl;
+      return -errno;
+    }
+    done += res;
+  }
+  return 0;
+}
+
+int ExtentStore::read(int extent, off_t offset, size_t len, char *buf)
+{
+  int fd;
+  {
+    lock_guard<mutex> lock(mutex_);
+    fd = extentFd(extent);
+    if (fd < 0)
+      return fd;
+    reads_++;
+    readBytes_ += len;
+  }
+
+  size_t done = 0;
+  while (done < len)
+  {
+    ssize_t res = pread(fd, buf + done, len - done, offset + done);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res <= 0)
+    {
+      FILE_LOG(LOG_ERROR) << "ExtentStore::read: short read in extent " << extent << " at " << offset << ", errno " << errno << endl;
+      return res < 0 ? -errno : -EIO;
+    }
+    done += res;
+  }
+  return 0;
+}
+
+int ExtentStore::sync()
+{
+  vector<int> fds;
+  {
+    lock_guard<mutex> lock(mutex_);
+    for (set<int>::iterator it = unsynced_.begin(); it != unsynced_.end(); ++it)
+      fds.push_back(fds_[*it]);
+    unsynced_.clear();
+  }
+
+  int ret = 0;
+  for (size_t i = 0; i < fds.size(); i++)
+  {
+    if (fdatasync(fds[i]) < 0)
+    {
+      FILE_LOG(LOG_ERROR) << "ExtentStore::sync: fdatasync error, errno " << errno << endl;
+      ret = -errno;
+    }
+  }
+  return ret;
+}
+
+void ExtentStore::report(ostream &os) const
+{
+  lock_guard<mutex> lock(mutex_);
+  os << "appends " << appends_ << endl
+     << "appended bytes " << appendBytes_ << endl
+     << "reads " << reads_ << endl
+     << "read bytes " << readBytes_ << endl
+     << "current extent " << current_ << endl
+     << "extent tail " << tail_ << endl;
+}
+
+int read_payload(ExtentStore *store, sqlite3_stmt *stmt, int col, string &content)
+{
+  if (sqlite3_column_type(stmt, col) != SQLITE_NULL || sqlite3_column_type(stmt, col + 1) == SQLITE_NULL)
+  {
+    const char *data = (const char *)sqlite3_column_blob(stmt, col);
+    content.assign(data != NULL ? data : "", sqlite3_column_bytes(stmt, col));
+    return 0;
+  }
+
+  content.resize(sqlite3_column_int(stmt, col + 3));
+  if (content.empty())
+    return 0;
+  return store->read(sqlite3_column_int(stmt, col + 1), sqlite3_column_int64(stmt, col + 2), content.size(), &content[0]);
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_EXTENT_STORE_H
+#define NDNFS_EXTENT_STORE_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <string>
+#include <ostream>
+
+#include <sys/types.h>
+#include <sqlite3.h>
+
+/**
+ * ExtentStore keeps segment content out of the database, in append-only extent files
+ * under one directory (named 00000000, 00000001, ...). A segment is appended once and
+ * never rewritten; its row in file_segments records the extent, offset and length, and
+ * reads go straight to the file with pread. A new extent is started once the current
+ * one reaches extent_cap bytes.
+ * Appends are not durable until sync(), which has to run before the rows pointing at
+ * them are committed. Space of segments no longer referenced is not reclaimed.
+ */
+class ExtentStore
+{
+public:
+  ExtentStore(const std::string &dir, bool writable);
+
+  ~ExtentStore();
+
+  /**
+   * Append len bytes at the end of the current extent.
+   * @return 0, or negative errno on failure
+   */
+  int
+  append(const char *data, size_t len, int &extent, off_t &offset);
+
+  /**
+   * Read len bytes at offset of an extent into buf.
+   * @return 0, or negative errno on failure
+   */
+  int
+  read(int extent, off_t offset, size_t len, char *buf);
+
+  /**
+   * Flush every extent appended to since the last call to disk.
+   * @return 0, or negative errno on failure
+   */
+  int
+  sync();
+
+  /**
+   * Write the append and read counters.
+   */
+  void
+  report(std::ostream &os) const;
+
+  static const off_t extent_cap;
+
+private:
+  std::string
+  extentPath(int extent) const;
+
+  // mutex_ is held by the caller
+  int
+  extentFd(int extent);
+
+  mutable std::mutex mutex_;
+  std::string dir_;
+  bool writable_;
+  int current_;
+  off_t tail_;
+  std::map<int, int> fds_;
+  std::set<int> unsynced_;
+
+  unsigned long appends_;
+  unsigned long appendBytes_;
+  unsigned long reads_;
+  unsigned long readBytes_;
+};
+
+/**
+ * Content of a segment row whose columns col, col + 1, col + 2 and col + 3 are content,
+ * extent, extent_offset and the bytes stored (extent_length, or stored_size in segment_content).
+ * Content kept in the row is returned as is, and content kept in an extent is read from store;
+ * either way as stored, compressed or not (see read_content in compression.h).
+ * @return 0, or negative errno on failure
+ */
+int read_payload(ExtentStore *store, sqlite3_stmt *stmt, int col, std::string &content);
+
+namespace ndnfs {
+    extern bool extent_segments;
+    extern ExtentStore *extent_store;
+}
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_FILE_HANDLE_H
+#define NDNFS_FILE_HANDLE_H
+
+#include "write-buffer.h"
+
+#include <mutex>
+
+/**
+ * FileHandle is hung off fuse_file_info::fh by ndnfs_open, and keeps what open looked up,
+ * so that read, write and release work from it rather than querying file_system again.
+ * The file is identified by its inode, which its versions and segments are stored under
+ * and which stays the same across renames. Reads see the version pinned at open. A handle opened for writing
+ * also owns the WriteBuffer whose segments become a new version on release.
+ * FUSE threads may work on the same handle at once; mutex guards the write buffer
+ * and the readahead state.
+ */
+struct FileHandle
+{
+  FileHandle(sqlite3_int64 ino, int ver, off_t size, int seg_size)
+    : ino(ino), version(ver), size(size), segSize(seg_size), chunked(false), writeBuffer(NULL),
+      nextOffset(0), readaheadWindow(0), readaheadEnd(0)
+  {
+  }
+
+  ~FileHandle() { delete writeBuffer; }
+
+  sqlite3_int64 ino;
+  // version pinned at open, or -1 if the open truncated the file
+  int version;
+  off_t size;
+  int segSize;
+  // whether the pinned version was cut by content, so its segments are found by offset
+  bool chunked;
+  WriteBuffer *writeBuffer;
+
+  // readahead state, see read_ahead in file.cc
+  // offset right after the last read, where a sequential read continues
+  off_t nextOffset;
+  // segments to prefetch past each read; 0 until reads turn out sequential
+  int readaheadWindow;
+  // first segment not queued for prefetching yet
+  int readaheadEnd;
+
+  std::mutex mutex;
+
+private:
+  FileHandle(const FileHandle &);
+  FileHandle &operator=(const FileHandle &);
+};
+
+#endif
@@ -0,0 +1,73 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <set>
+#include <mutex>
+#include <condition_variable>
+
+#include "file-lock.h"
+
+using namespace std;
+
+// Inodes locked right now; a thread wanting one of them waits on locks_changed
+static set<sqlite3_int64> locked;
+static mutex locks_mutex;
+static condition_variable locks_changed;
+
+FileLock::FileLock(sqlite3_int64 ino)
+  : first_(ino), second_(0)
+{
+  lock(first_);
+}
+
+FileLock::FileLock(sqlite3_int64 ino, sqlite3_int64 other)
+  : first_(min(ino, other)), second_(max(ino, other))
+{
+  // An inode of 0 is no file, as for a rename that replaces nothing
+  if (first_ == 0 || first_ == second_)
+  {
+    first_ = second_;
+    second_ = 0;
+  }
+  lock(first_);
+  if (second_ != 0)
+    lock(second_);
+}
+
+FileLock::~FileLock()
+{
+  if (second_ != 0)
+    unlock(second_);
+  unlock(first_);
+}
+
+void FileLock::lock(sqlite3_int64 ino)
+{
+  unique_lock<mutex> lock(locks_mutex);
+  while (locked.count(ino) != 0)
+    locks_changed.wait(lock);
+  locked.insert(ino);
+}
+
+void FileLock::unlock(sqlite3_int64 ino)
+{
+  {
+    lock_guard<mutex> lock(locks_mutex);
+    locked.erase(ino);
+  }
+  locks_changed.notify_all();
+}
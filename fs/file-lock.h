@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_FILE_LOCK_H
+#define NDNFS_FILE_LOCK_H
+
+#include <sqlite3.h>
+
+/**
+ * FileLock serializes the operations that change one file, for as long as it lives,
+ * once FUSE runs requests on several threads: a release committing a version, a truncate
+ * or an unlink of the same file wait for each other, while other files go ahead. Files are
+ * locked by inode, which stays the same across renames, so a release still holds off a
+ * truncate of its file after the file was renamed. A rename locks the file it moves and the
+ * one it replaces, always in the same order, so that two renames cannot deadlock.
+ */
+class FileLock
+{
+public:
+  FileLock(sqlite3_int64 ino);
+
+  FileLock(sqlite3_int64 ino, sqlite3_int64 other);
+
+  ~FileLock();
+
+private:
+  FileLock(const FileLock &);
+  FileLock &operator=(const FileLock &);
+
+  void
+  lock(sqlite3_int64 ino);
+
+  void
+  unlock(sqlite3_int64 ino);
+
+  sqlite3_int64 first_;
+  // 0 if only one file is locked
+  sqlite3_int64 second_;
+};
+
+#endif
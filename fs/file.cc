@@ -22,20 +22,81 @@
 #include "file.h"
 
 #include "signature-states.h"
+#include "sign-queue.h"
+#include "segment-cache.h"
+#include "readahead.h"
+#include "file-lock.h"
+#include "attr-cache.h"
+#include "dentry.h"
+#include "extent-store.h"
+#include "compression.h"
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 using namespace std;
 
-int ndnfs_open(const char *path, struct fuse_file_info *fi)
+// Handles open for writing, by inode, so that a truncation of the file reaches the writes they hold
+static mutex writers_mutex;
+static multimap<sqlite3_int64, FileHandle *> open_writers;
+
+static void add_writer(FileHandle *handle)
 {
+  lock_guard<mutex> lock(writers_mutex);
+  open_writers.insert(make_pair(handle->ino, handle));
+}
+
+static void remove_writer(FileHandle *handle)
+{
+  lock_guard<mutex> lock(writers_mutex);
+  pair<multimap<sqlite3_int64, FileHandle *>::iterator, multimap<sqlite3_int64, FileHandle *>::iterator> range = open_writers.equal_range(handle->ino);
+  for (multimap<sqlite3_int64, FileHandle *>::iterator it = range.first; it != range.second; ++it)
+  {
+    if (it->second == handle)
+    {
+      open_writers.erase(it);
+      return;
+    }
+  }
+}
 
-  FILE_LOG(LOG_DEBUG)<< "THIS IS A TEST!!!!!!!"<< endl;
-  char test_buf[1024];
-  memset(test_buf, '\0', 1024);
-  ndnfs_read("/hi.txt", test_buf, 10, 2, fi);
-  FILE_LOG(LOG_DEBUG)<< test_buf<< endl;
-  FILE_LOG(LOG_DEBUG)<< "THIS IS A TEST!!!!!!!"<< endl;
+bool writer_open(sqlite3_int64 ino)
+{
+  lock_guard<mutex> lock(writers_mutex);
+  return open_writers.count(ino) != 0;
+}
+
+// Cut the writes the handles of ino hold at length. Handles that build on a committed version
+// move over to ver, the one the truncation left; those that truncated the file at open build on none.
+static int truncate_writers(sqlite3_int64 ino, off_t length, int ver)
+{
+  lock_guard<mutex> lock(writers_mutex);
+  pair<multimap<sqlite3_int64, FileHandle *>::iterator, multimap<sqlite3_int64, FileHandle *>::iterator> range = open_writers.equal_range(ino);
+  for (multimap<sqlite3_int64, FileHandle *>::iterator it = range.first; it != range.second; ++it)
+  {
+    FileHandle *handle = it->second;
+    lock_guard<mutex> handle_lock(handle->mutex);
+    if (handle->version != -1)
+    {
+      handle->version = ver;
+      handle->chunked = version_chunked(ino, ver);
+    }
+    int res = handle->writeBuffer->truncate(length, handle->version);
+    if (res < 0)
+    {
+      FILE_LOG(LOG_ERROR) << "truncate_writers: truncate write buffer error. ino:" << ino << " res:" << res << endl;
+      return res;
+    }
+  }
+  return 0;
+}
 
-  FILE_LOG(LOG_DEBUG) << "ndnfs_open: path=" << path << endl;
+int ndnfs_open(sqlite3_int64 ino, struct fuse_file_info *fi)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_open: ino=" << ino << endl;
   // // The actual open operation
   // char full_path[PATH_MAX];
   // abs_path(full_path, path);
@@ -55,21 +116,21 @@ int ndnfs_open(const char *path, struct fuse_file_info *fi)
   // close(ret);
 
   // Ndnfs versioning operation
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT current_version FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT current_version, seg_size, size FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   int res = sqlite3_step(stmt);
   if (res != SQLITE_ROW)
   {
     FILE_LOG(LOG_DEBUG) << "open error!" << endl;
-    sqlite3_finalize(stmt);
+    stmt.finalize();
     return -ENOENT;
   }
 
-  int curr_ver = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
-
-  int temp_ver = time(0);
+  // Everything read and write need about the file is kept in the handle
+  FileHandle *handle = new FileHandle(ino, sqlite3_column_int(stmt, 0), sqlite3_column_int64(stmt, 2), sqlite3_column_int(stmt, 1));
+  stmt.finalize();
+  handle->chunked = version_chunked(ino, handle->version);
 
   switch (fi->flags & O_ACCMODE)
   { // O_ACCMODE 是一个
@@ -79,21 +140,22 @@ int ndnfs_open(const char *path, struct fuse_file_info *fi)
   case O_WRONLY:
   case O_RDWR:
 
-    // Copy old data from current version to the temp version
-    // if (duplicate_version(path, curr_ver, temp_ver) < 0) //This function has not been implenmented
-    copycurr_segment(path, curr_ver);
-    // return -EACCES;
+    // Nothing is copied here: the new version shares the segments of the pinned version that are
+    // not written (copy-on-write), and an open that truncates starts from no segments at all
+    if (fi->flags & O_TRUNC)
+    {
+      handle->version = -1;
+      handle->size = 0;
+    }
 
+    // Writes on this handle are buffered in memory until flush/release
+    handle->writeBuffer = new WriteBuffer(ino, handle->version, handle->segSize);
+    add_writer(handle);
     break;
   default:
     break;
   }
-
-  // When user open a file, make nlink+1
-  sqlite3_prepare_v2(db, "UPDATE file_system set nlink = nlink + 1 WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  fi->fh = (uint64_t) handle;
 
   return 0;
 }
@@ -104,62 +166,46 @@ int ndnfs_open(const char *path, struct fuse_file_info *fi)
  * In Linux(Ubuntu), current implementation reports "utimens: no such file" when executing touch; digging out why.
  * For the newly created file, getattr is called before mknod/open(O_CREAT); wonder how that works.
  */
-int ndnfs_mknod(const char *path, mode_t mode, dev_t dev)
+int ndnfs_mknod(sqlite3_int64 parent, const char *name, mode_t mode, dev_t dev)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_mknod: path=" << path << ", mode=0" << std::oct << mode << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_mknod: parent=" << parent << ", name=" << name << ", mode=0" << std::oct << mode << endl;
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res == SQLITE_ROW)
+  if (lookup_entry(db, parent, name) != 0)
   {
     // Cannot create file that has conflicting file name
-    sqlite3_finalize(stmt);
-    return -ENOENT;
+    return -EEXIST;
   }
 
-  sqlite3_finalize(stmt);
-
   // We cannot create file without creating necessary folders in advance
-  // Get father dir's level
-  int level = 0;
-  string path_father;
-  string name;
-  split_last_component(path, path_father, name);
-  sqlite3_prepare_v2(db, "SELECT level FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path_father.c_str(), -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT seg_size FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, parent);
+  int res = sqlite3_step(stmt);
   if (res != SQLITE_ROW)
   {
-    sqlite3_finalize(stmt);
+    stmt.finalize();
     return -ENOENT;
   }
-  level = sqlite3_column_int(stmt, 0);
-  level += 1;
+  // The file takes the segment size of its directory, if it has one, or the mount default
+  int seg_size = ndnfs::seg_size;
+  if (sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+    seg_size = sqlite3_column_int(stmt, 0);
 
-  sqlite3_finalize(stmt);
+  stmt.finalize();
   // Infer the mime_type of the file based on extension
   char mime_type[100] = "";
-  mime_infer(mime_type, path); // Get Type of New File
+  mime_infer(mime_type, name); // Get Type of New File
 
   // Generate first version entry for the new file
   int ver = time(0);
 
-  sqlite3_prepare_v2(db, "INSERT INTO file_versions (path, version) VALUES (?, ?);", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-
   // Add the file entry to database
-  sqlite3_prepare_v2(db, "INSERT INTO file_system (path, current_version, mime_type, ready_signed, type, mode, atime, nlink, size, level) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?);", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver);                           // current version
-  sqlite3_bind_text(stmt, 3, mime_type, -1, SQLITE_STATIC); // mime_type based on ext
+  stmt.prepare(db, "INSERT INTO file_system (current_version, mime_type, ready_signed, type, mode, atime, nlink, size, seg_size) VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?);");
+  sqlite3_bind_int(stmt, 1, ver);                           // current version
+  sqlite3_bind_text(stmt, 2, mime_type, -1, SQLITE_STATIC); // mime_type based on ext
 
   enum SignatureState signatureState = NOT_READY;
-  sqlite3_bind_int(stmt, 4, signatureState);
+  sqlite3_bind_int(stmt, 3, signatureState);
 
   enum FileType fileType = REGULAR;
 
@@ -187,18 +233,38 @@ int ndnfs_mknod(const char *path, mode_t mode, dev_t dev)
     fileType = REGULAR;
     break;
   }
-  sqlite3_bind_int(stmt, 5, fileType);
-  sqlite3_bind_int(stmt, 6, mode);
-  sqlite3_bind_int(stmt, 7, ver);
-  // sqlite3_bind_int(stmt, 8, ver);
+  sqlite3_bind_int(stmt, 4, fileType);
+  sqlite3_bind_int(stmt, 5, mode);
+  sqlite3_bind_int(stmt, 6, ver);
+  // sqlite3_bind_int(stmt, 7, ver);
+  // Link counts come from file_entries, see STAT_COLUMNS
+  sqlite3_bind_int(stmt, 7, 0);
   sqlite3_bind_int(stmt, 8, 0);
-  sqlite3_bind_int(stmt, 9, 0);
-  sqlite3_bind_int(stmt, 10, level);
+  sqlite3_bind_int(stmt, 9, seg_size);
 
   res = sqlite3_step(stmt);
   // FILE_LOG(LOG_DEBUG) << " Insert into file_system error! fileType= " << mime_type << " ??" << endl;
   // sqlite3_finalize(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+    return -EIO;
+  sqlite3_int64 ino = sqlite3_last_insert_rowid(db);
+
+  stmt.prepare(db, "INSERT INTO file_versions (ino, version) VALUES (?, ?);");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_step(stmt);
+  stmt.finalize();
+
+  // The name goes in last, which is what makes the file visible
+  stmt.prepare(db, "INSERT INTO file_entries (parent, name, ino) VALUES (?, ?, ?);");
+  sqlite3_bind_int64(stmt, 1, parent);
+  sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, ino);
+  sqlite3_step(stmt);
+  stmt.finalize();
+  refresh_attr(ino);
+  ndnfs::attr_cache->invalidateName(parent, name);
 
   // Create the actual file
   // char full_path[PATH_MAX];
@@ -232,98 +298,200 @@ int ndnfs_mknod(const char *path, mode_t mode, dev_t dev)
   return 0;
 }
 
-int ndnfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Read the content column of a row of table into buf, moving blob to that row; a handle is kept per table
+static int read_blob(sqlite3_blob *&blob, const char *table, sqlite3_int64 rowid, char *buf, int len)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_read: path=" << path << ", offset=" << std::dec << offset << ", size=" << size << endl;
+  int res;
+  if (blob == NULL)
+    res = sqlite3_blob_open(db, "main", table, "content", rowid, 0, &blob);
+  else
+    res = sqlite3_blob_reopen(blob, rowid);
+  if (res == SQLITE_OK)
+    res = sqlite3_blob_read(blob, buf, len, 0);
+  return res;
+}
 
-  // First check if the file entry exists in the database,
-  // this now presumes we don't want to do anything with older versions of the file
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT size FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
-  {
-    sqlite3_finalize(stmt);
-    return -ENOENT;
-  }
-  if (sqlite3_column_int(stmt, 0) == 0)
+// Copy size bytes at offset of the version pinned by handle into buf; size does not reach past the end of file
+static int read_segments(FileHandle *handle, char *buf, size_t size, off_t offset)
+{
+  sqlite3_int64 ino = handle->ino;
+  int ver = handle->version;
+  int seg_size = handle->segSize;
+  int res;
+
+  // Segments cut by content vary in size, and are found by where they start
+  if (handle->chunked)
+    return read_range(ino, ver, offset, size, buf);
+
+  int first = seek_segment(offset, seg_size);
+  int last = seek_segment(offset + size - 1, seg_size);
+  size_t len = 0;
+  int seg = first;
+
+  // Leading segments found in the segment cache are served from memory, without going to db
+  SegmentCache::Content cached;
+  while (seg <= last && (cached = ndnfs::segment_cache->find(ino, ver, seg)))
   {
-    // File is empty, So there is no segment in table file_segments
-    sqlite3_finalize(stmt);
-    return 0;
+    size_t content_offset = (seg == first) ? offset - segment_to_size(first, seg_size) : 0;
+    if (content_offset >= cached->size())
+      return len;
+    size_t copy_len = min(cached->size() - content_offset, size - len);
+    memcpy(buf + len, cached->data() + content_offset, copy_len);
+    len += copy_len;
+    if (cached->size() < (size_t)seg_size)
+      return len;
+    seg++;
   }
-  sqlite3_finalize(stmt);
+  if (seg > last)
+    return len;
+
+  // The rest comes from one range scan over the version. The scan yields the row holding each
+  // segment's content (its own, the origin row it shares, or the segment_blobs row of either),
+  // where that row keeps it and its length; segments not cached are read whole, through a blob
+  // handle or from their extent, decoded if their blob is compressed, cached, and copied into buf.
+  int scan_first = seg;
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT s.segment, COALESCE(b.id, h.rowid), COALESCE(b.extent, h.extent), \
+                           COALESCE(b.extent_offset, h.extent_offset), \
+                           COALESCE(length(b.content), b.extent_length, length(h.content), h.extent_length), \
+                           b.id IS NOT NULL, b.encoding, b.length \
+                    FROM file_segments s LEFT JOIN file_segments h \
+                      ON h.ino = s.ino AND h.version = COALESCE(s.origin, s.version) AND h.segment = s.segment \
+                    LEFT JOIN segment_blobs b ON b.id = h.blob_id \
+                    WHERE s.ino = ? AND s.version = ? AND s.segment BETWEEN ? AND ? ORDER BY s.segment;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int(stmt, 3, scan_first);
+  sqlite3_bind_int(stmt, 4, last);
 
-  // BIG CHANGE!
-  // Read from  db now
-  // test bt Anson at 2018.11.20
-  int seg_size = ndnfs::seg_size;
-  int seg = offset / seg_size;
-  int len = 0;
-  // Get the segment which nearst to offset
-  sqlite3_prepare_v2(db, "SELECT content FROM file_segments WHERE path = ? AND segment =  ? AND version = (SELECT current_version FROM file_system WHERE path = ?);", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, seg);
-  sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
-  res = sqlite3_step(stmt);
-  if (res == SQLITE_ROW)
-  {
-    int content_size = sqlite3_column_bytes(stmt, 0);
-    char content[seg_size];
-    memmove(content, (char *)sqlite3_column_blob(stmt, 0), content_size);
-    int content_offset = offset - seg * seg_size;
-    len += min(content_size - content_offset, (int)size);
-    memmove(buf, content + content_offset, len);
-    // The buf will be garbled withou this sentence
-    buf[len] = '\0';
-    // FILE_LOG(LOG_DEBUG)<< "content:"<< content<< endl;
-    sqlite3_finalize(stmt);
-    if (content_size < seg_size)
+  sqlite3_blob *blob = NULL;
+  sqlite3_blob *shared_blob = NULL;
+  while ((res = sqlite3_step(stmt)) == SQLITE_ROW)
+  {
+    // A missing segment ends the read, as the end of file does
+    if (sqlite3_column_int(stmt, 0) != seg || sqlite3_column_type(stmt, 1) == SQLITE_NULL)
+      break;
+
+    size_t stored_size = sqlite3_column_int(stmt, 4);
+    int encoding = sqlite3_column_int(stmt, 6);
+    size_t content_size = encoding != PLAIN_SEGMENT ? sqlite3_column_int(stmt, 7) : stored_size;
+    size_t content_offset = (seg == first) ? offset - segment_to_size(first, seg_size) : 0;
+    if (content_offset >= content_size)
+      break;
+    size_t copy_len = min(content_size - content_offset, size - len);
+
+    // The first scanned segment is already known to be a miss
+    cached = (seg == scan_first) ? SegmentCache::Content() : ndnfs::segment_cache->find(ino, ver, seg);
+    if (cached)
     {
-          FILE_LOG(LOG_DEBUG)<< "len="<<len<< endl;
-      // means this segment is the last segment
-      return len;
+      memcpy(buf + len, cached->data() + content_offset, copy_len);
     }
-    // If the nearst segment is not enough (missing segment)
-    while (len < size)
+    else
     {
-      seg++;
-      // FILE_LOG(LOG_DEBUG) << " len=" << len << " size=" << size << endl;
-      sqlite3_prepare_v2(db, "SELECT content FROM file_segments WHERE path = ? AND segment =  ? AND version = (SELECT current_version FROM file_system WHERE path = ?);", -1, &stmt, 0);
-      sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 2, seg);
-      sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
-      res = sqlite3_step(stmt);
-      char *read_content[seg_size];
-      if (res == SQLITE_ROW)
+      shared_ptr<string> content = make_shared<string>(stored_size, '\0');
+      if (sqlite3_column_type(stmt, 2) != SQLITE_NULL)
       {
-        memset(content, '\0', seg_size);
-        memset(read_content, '\0', seg_size);
-        content_size = sqlite3_column_bytes(stmt, 0);
-        // FILE_LOG(LOG_DEBUG)<< "circle: "<< content_size<< endl;
-        memmove(content, (char *)sqlite3_column_blob(stmt, 0), content_size);
-        int read_len = min(content_size, (int)size - len);
-        memmove(read_content, content, read_len);
-        sqlite3_finalize(stmt);
-        // strcat(buf, read_content);
-        // FILE_LOG(LOG_DEBUG)<< "circle: "<< read_len<< endl;
-        memmove(buf + len, read_content, read_len);
-        len += read_len;
-        if (read_len < seg_size)
+        if (ndnfs::extent_store->read(sqlite3_column_int(stmt, 2), sqlite3_column_int64(stmt, 3), stored_size, &(*content)[0]) < 0)
         {
-          return len;
+          res = SQLITE_IOERR;
+          break;
         }
       }
       else
       {
-        FILE_LOG(LOG_DEBUG) << "db error!!!" << endl;
-        sqlite3_finalize(stmt);
-        // break;
-        return -errno;
+        bool shared = sqlite3_column_int(stmt, 5) != 0;
+        res = read_blob(shared ? shared_blob : blob, shared ? "segment_blobs" : "file_segments",
+                        sqlite3_column_int64(stmt, 1), &(*content)[0], stored_size);
+        if (res != SQLITE_OK)
+          break;
+      }
+      if (encoding != PLAIN_SEGMENT)
+      {
+        string stored;
+        stored.swap(*content);
+        if (decode_segment(encoding, stored.data(), stored.size(), content_size, *content) < 0)
+        {
+          res = SQLITE_IOERR;
+          break;
+        }
       }
+      memcpy(buf + len, content->data() + content_offset, copy_len);
+      ndnfs::segment_cache->insert(ino, ver, seg, content);
     }
+    len += copy_len;
+
+    // Only the last segment of a version is shorter than seg_size
+    if (content_size < (size_t)seg_size)
+      break;
+    seg++;
   }
+  stmt.finalize();
+  sqlite3_blob_close(blob);
+  sqlite3_blob_close(shared_blob);
+
+  if (res != SQLITE_ROW && res != SQLITE_DONE && res != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "read_segments: db error " << res << ". ino:" << ino << endl;
+    return -EIO;
+  }
+  return len;
+}
+
+// Queue the segments after a sequential read for prefetching. The window starts at two segments,
+// doubles on every read that picks up where the last one ended, up to ndnfs::readahead_max
+// segments, and collapses on a seek.
+static void read_ahead(FileHandle *handle, off_t offset, size_t len)
+{
+  if (offset == handle->nextOffset)
+  {
+    handle->readaheadWindow = min(max(2, handle->readaheadWindow * 2), ndnfs::readahead_max);
+  }
+  else
+  {
+    handle->readaheadWindow = 0;
+    handle->readaheadEnd = 0;
+  }
+  handle->nextOffset = offset + len;
+  if (handle->readaheadWindow == 0 || len == 0)
+    return;
+
+  int next = seek_segment(offset + len, handle->segSize);
+  int last = min(next + handle->readaheadWindow - 1, seek_segment(handle->size - 1, handle->segSize));
+  // Segments already queued by an earlier read are not queued again
+  int first = max(next, handle->readaheadEnd);
+  if (first > last)
+    return;
+  ndnfs::readahead->request(handle->ino, handle->version, first, last);
+  handle->readaheadEnd = last + 1;
+}
+
+int ndnfs_read(sqlite3_int64 ino, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_read: ino=" << ino << ", offset=" << std::dec << offset << ", size=" << size << endl;
+
+  // Reads see the version the file had when it was opened
+  FileHandle *handle = (FileHandle *) fi->fh;
+  if (handle == NULL)
+    return -EBADF;
+  // and a handle opened for writing sees its own writes on top. The kernel also reads
+  // through write-only handles, to fill the pages of its writeback cache.
+  if (handle->writeBuffer != NULL)
+  {
+    lock_guard<mutex> lock(handle->mutex);
+    return handle->writeBuffer->read(buf, size, offset);
+  }
+  if (offset >= handle->size || size == 0)
+    return 0;
+  size = min(size, (size_t)(handle->size - offset));
+
+  int len = read_segments(handle, buf, size, offset);
+  // Readahead goes by segments of seg_size, which segments cut by content are not
+  if (len > 0 && ndnfs::readahead != NULL && !handle->chunked)
+  {
+    lock_guard<mutex> lock(handle->mutex);
+    read_ahead(handle, offset, len);
+  }
+  return len;
 
   // Then read from the actual file
   // char full_path[PATH_MAX];
@@ -349,25 +517,19 @@ int ndnfs_read(const char *path, char *buf, size_t size, off_t offset, struct fu
   // return read_len;
 }
 
-int ndnfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+int ndnfs_write(sqlite3_int64 ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_write: path=" << path << std::dec << ", size=" << size << ", offset=" << offset << endl;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_write: ino=" << ino << std::dec << ", size=" << size << ", offset=" << offset << endl;
 
   // First check if the entry exists in the database
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT current_version FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
+  FileHandle *handle = (FileHandle *) fi->fh;
+  if (handle == NULL || handle->writeBuffer == NULL)
   {
-    sqlite3_finalize(stmt);
-    return -ENOENT;
+    FILE_LOG(LOG_ERROR) << "ndnfs_write: file is not opened for writing. ino:" << ino << endl;
+    return -EBADF;
   }
-
-  sqlite3_finalize(stmt);
-
-  addtemp_segment(path, buf, size, offset);
-  return size;
+  lock_guard<mutex> lock(handle->mutex);
+  return handle->writeBuffer->write(buf, size, offset);
 
   // Create or change tmp_version in db (100000 means temp version)
   // char buf_seg[ndnfs::seg_size];
@@ -469,23 +631,112 @@ int ndnfs_write(const char *path, const char *buf, size_t size, off_t offset, st
   // return write_len; // return the number of bytes written on success
 }
 
-int ndnfs_truncate(const char *path, off_t length)
+// Versions are timestamps; a file committed twice in the same second takes the next one
+static int next_version(int curr_ver)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_truncate: path=" << path << " length=" << length << endl;
+  return max((int)time(0), curr_ver + 1);
+}
+
+/**
+ * Make ver, whose segments are in place, the current version of ino and queue it for
+ * signing, inside the transaction of the caller.
+ * @return 0, or negative errno on failure
+ */
+static int commit_version(sqlite3_int64 ino, int ver)
+{
+  CachedStatement stmt;
+  // The version is the modification time again, whatever utimens set before
+  stmt.prepare(db, "UPDATE file_system SET current_version = ?, mtime = NULL WHERE ino = ?;");
+  sqlite3_bind_int(stmt, 1, ver);
+  sqlite3_bind_int64(stmt, 2, ino);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "commit_version: update file_system error. " << res << endl;
+    return -EIO;
+  }
+
+  if (ndnfs_updateattr(ino, ver) < 0)
+    return -EIO;
+
+  stmt.prepare(db, "INSERT INTO file_versions (ino, version, size) VALUES (?, ?, (SELECT size FROM file_system WHERE ino = ?));");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int64(stmt, 3, ino);
+  res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "commit_version: insert file_versions error. " << res << endl;
+    return -EIO;
+  }
+
+  // With wire compression, the version may be signed and published compressed, as stored
+  if (encode_version(ino, ver) < 0)
+    return -EIO;
+
+  // Signing happens in the background; a commit only records the version to sign
+  return queue_version(ino, ver);
+}
+
+int ndnfs_truncate(sqlite3_int64 ino, off_t length)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_truncate: ino=" << ino << " length=" << length << endl;
+  // Commits a version, just like release
+  FileLock lock(ino);
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+    return -EIO;
+
   // First we check if the entry exists in database
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT MAX(current_version) FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT current_version, size FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   int res = sqlite3_step(stmt);
   if (res != SQLITE_ROW)
   {
-    sqlite3_finalize(stmt);
+    stmt.finalize();
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
     return -ENOENT;
   }
   int ver = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
+  off_t size = sqlite3_column_int64(stmt, 1);
+  stmt.finalize();
+  // The size is right already; the file keeps its version, and only handles open for writing may differ
+  if (length == size)
+  {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return truncate_writers(ino, length, ver);
+  }
+
+  int curr_version = next_version(ver);
+  if (length < size)
+    res = truncate_all_segment(ino, ver, curr_version, length);
+  else
+    res = extend_all_segment(ino, ver, curr_version, length, file_seg_size(db, ino));
+  // Segments left whole share their blobs with the old version already; this stores the cut,
+  // padded and zero ones
+  if (res == 0 && dedup_version(ino, curr_version) < 0)
+    res = -EIO;
+  if (res == 0)
+    res = commit_version(ino, curr_version);
+  if (res < 0)
+  {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return res;
+  }
+  // Segments appended to extents have to be on disk before the version pointing at them is
+  ndnfs::extent_store->sync();
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
 
-  truncate_all_segment(path, ver, length);
+  refresh_attr(ino);
+  ndnfs::segment_cache->forget(ino);
+  ndnfs::sign_queue->notify();
+
+  // Writes not released yet would bring back what was cut off, or keep the file at another length
+  res = truncate_writers(ino, length, curr_version);
+  if (res < 0)
+    return res;
 
   // For implentation version control, We can not truncate the
   // real file in database
@@ -531,9 +782,96 @@ int ndnfs_truncate(const char *path, off_t length)
   // return res;
 }
 
-int ndnfs_unlink(const char *path)
+// Drop the inode ino and everything stored under it if it has no name left; returns true if it was dropped
+static bool drop_unlinked(sqlite3_int64 ino)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_system WHERE ino = ? AND ino != ? AND NOT EXISTS (SELECT 1 FROM file_entries WHERE ino = ?);");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int64(stmt, 2, root_ino);
+  sqlite3_bind_int64(stmt, 3, ino);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE || sqlite3_changes(db) == 0)
+    return false;
+  remove_file_entry(ino);
+  return true;
+}
+
+// Lookups the kernel holds on each inode it was handed, and whether the inode lost a name
+// since; an inode is not dropped while the kernel holds it, so its number is not handed out
+// again for another file before the kernel forgets the old one
+struct LookupCount
+{
+  unsigned long nlookup;
+  bool unlinked;
+};
+static mutex lookups_mutex;
+static unordered_map<sqlite3_int64, LookupCount> lookups;
+
+void ndnfs_remember(sqlite3_int64 ino)
+{
+  lock_guard<mutex> lock(lookups_mutex);
+  LookupCount &count = lookups[ino];
+  count.nlookup++;
+}
+
+void ndnfs_forget(sqlite3_int64 ino, unsigned long nlookup)
+{
+  {
+    lock_guard<mutex> lock(lookups_mutex);
+    unordered_map<sqlite3_int64, LookupCount>::iterator it = lookups.find(ino);
+    if (it == lookups.end())
+      return;
+    if (it->second.nlookup > nlookup)
+    {
+      it->second.nlookup -= nlookup;
+      return;
+    }
+    bool unlinked = it->second.unlinked;
+    lookups.erase(it);
+    if (!unlinked)
+      return;
+  }
+
+  // The last name went away while the kernel held the inode, open handles included
+  FileLock lock(ino);
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  bool dropped = drop_unlinked(ino);
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  if (dropped)
+  {
+    FILE_LOG(LOG_DEBUG) << "ndnfs_forget: dropped unlinked inode " << ino << endl;
+    ndnfs::segment_cache->forget(ino);
+    refresh_attr(ino);
+  }
+}
+
+bool unlink_inode(sqlite3_int64 ino)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_unlink: path=" << path << endl;
+  {
+    lock_guard<mutex> lock(lookups_mutex);
+    unordered_map<sqlite3_int64, LookupCount>::iterator it = lookups.find(ino);
+    if (it != lookups.end())
+    {
+      // Dropped by ndnfs_forget
+      it->second.unlinked = true;
+      return false;
+    }
+  }
+  return drop_unlinked(ino);
+}
+
+int ndnfs_unlink(sqlite3_int64 parent, const char *name)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_unlink: parent=" << parent << ", name=" << name << endl;
+  sqlite3_int64 ino = lookup_entry(db, parent, name);
+  if (ino == 0)
+    return -ENOENT;
+  // Directories go by rmdir
+  if (inode_type(db, ino) == DIRECTORY)
+    return -EISDIR;
+  FileLock lock(ino);
 
   // It's hard to implement rm -f *
   // string  pre;
@@ -558,32 +896,26 @@ int ndnfs_unlink(const char *path)
   // else
   // {
 
-  sqlite3_stmt *stmt;
-
-  // check if any user is using this file
-  sqlite3_prepare_v2(db, "SELECT nlink from file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  // Remove the name; the inode and everything stored under it go with it, unless the kernel
+  // still holds the file, open or not, in which case they go when it forgets the file
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_entries WHERE parent = ? AND name = ?;");
+  sqlite3_bind_int64(stmt, 1, parent);
+  sqlite3_bind_text(stmt, 2, name, -1, SQLITE_STATIC);
   int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW) {
-    FILE_LOG(LOG_ERROR)<<"remove error, no such file!"<< endl;
-    sqlite3_finalize(stmt);
-    return -errno;
-  }
-  int nlink = sqlite3_column_int(stmt, 0);
-  if (nlink != 0) {
-    FILE_LOG(LOG_ERROR)<<"remove error, "<< nlink << " users are using this file"<< endl;
-    return -errno;
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_unlink: delete file_entries error. " << res << endl;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -EIO;
   }
-  sqlite3_finalize(stmt);
-
-  // TODO: update remove_versions
-  remove_file_entry(path);
-
-  // Then, remove file entry
-  sqlite3_prepare_v2(db, "DELETE FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  bool dropped = unlink_inode(ino);
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  if (dropped)
+    ndnfs::segment_cache->forget(ino);
+  refresh_attr(ino);
   // }
 
   // char full_path[PATH_MAX];
@@ -599,162 +931,188 @@ int ndnfs_unlink(const char *path)
   return 0;
 }
 
-int ndnfs_release(const char *path, struct fuse_file_info *fi)
+int ndnfs_flush(sqlite3_int64 ino, struct fuse_file_info *fi)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_release: path=" << path << ", flag=0x" << std::hex << fi->flags << endl;
-  int curr_version = time(0);
-  int latest_version = 0;
-
-  // First we check if the file exists
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT current_version FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
-  {
-    sqlite3_finalize(stmt);
-    return -ENOENT;
-  }
-  latest_version = sqlite3_column_int(stmt, 0);
-  // Make sure no unique conflict
-  latest_version += 1;
-  sqlite3_finalize(stmt);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_flush: ino=" << ino << endl;
 
-  if ((fi->flags & O_ACCMODE) != O_RDONLY)
-  {
+  FileHandle *handle = (FileHandle *) fi->fh;
+  if (handle == NULL || handle->writeBuffer == NULL)
+    return 0;
+  lock_guard<mutex> lock(handle->mutex);
+  return handle->writeBuffer->flush();
+}
 
-    // TODO: since older version is removed anyway, it makes sense to rely on system
-    // function calls for multiple file accesses. Simplification of versioning method?
-    //if (curr_ver != -1)
-    //  remove_version (path, curr_ver);
+// Kernel lookups do not survive an unmount: drop the files unlinked while the kernel held them, at mount
+int clear_unlinked()
+{
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  vector<sqlite3_int64> unlinked;
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT ino FROM file_system WHERE ino != ? AND NOT EXISTS (SELECT 1 FROM file_entries WHERE file_entries.ino = file_system.ino);");
+  sqlite3_bind_int64(stmt, 1, root_ino);
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    unlinked.push_back(sqlite3_column_int64(stmt, 0));
+  stmt.finalize();
+  for (size_t i = 0; i < unlinked.size(); i++)
+    drop_unlinked(unlinked[i]);
+  int res = sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  return res == SQLITE_OK ? 0 : -EIO;
+}
 
-    // remove temp version
-    removetemp_segment(path, latest_version);
+// Roll back a release, and drop the temp version its handle spilled to db before it began;
+// the handle is closed all the same
+static void abort_release(sqlite3_int64 ino, int temp_ver)
+{
+  sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+  if (temp_ver != -1)
+    cleartemp_segment(ino, temp_ver);
+}
 
-    sqlite3_prepare_v2(db, "UPDATE file_system SET current_version = ? WHERE path = ?;", -1, &stmt, 0);
-    sqlite3_bind_int(stmt, 1, curr_version); // set current_version to the current timestamp
-    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-    res = sqlite3_step(stmt);
-    if (res != SQLITE_OK && res != SQLITE_DONE)
-    {
-      FILE_LOG(LOG_ERROR) << "ndnfs_release: update file_system error. " << res << endl;
-      return res;
-    }
-    sqlite3_finalize(stmt);
+int ndnfs_release(sqlite3_int64 ino, struct fuse_file_info *fi)
+{
+  FILE_LOG(LOG_DEBUG) << "ndnfs_release: ino=" << ino << ", flag=0x" << std::hex << fi->flags << endl;
+  int curr_version;
+  int res;
 
-    sqlite3_prepare_v2(db, "INSERT INTO file_versions (path, version) VALUES (?,?);", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, curr_version);
-    sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
-
-    // After releasing, start a new signing thread for the file;
-    // If a signing thread for the file in question has already started, kill that thread.
-    int seg_all = 0;
-    sqlite3_prepare_v2(db, "SELECT MAX(segment) FROM file_segments WHERE path = ? AND version =  ?", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, latest_version);
-    res = sqlite3_step(stmt);
-    seg_all = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-    for (int seg = 0; seg <= seg_all; ++seg)
-    {
-      sqlite3_prepare_v2(db, "SELECT content FROM file_segments WHERE path = ? AND segment =  ?  AND version = ?", -1, &stmt, 0);
-      sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 2, seg);
-      sqlite3_bind_int(stmt, 3, latest_version);
-      res = sqlite3_step(stmt);
-      int len = 0;
-      if (res == SQLITE_ROW)
-      {
-        len = sqlite3_column_bytes(stmt, 0);
-        char data[len];
-        memmove(data, (char *)sqlite3_column_blob(stmt, 0), len);
-        sign_segment(path, curr_version, seg, data, len);
-      }
-      sqlite3_finalize(stmt);
-      // FILE_LOG(LOG_DEBUG) << "release:::" << path << " " << curr_version << " " << seg << " " << len << endl;
-    }
+  FileHandle *handle = (FileHandle *) fi->fh;
+  fi->fh = 0;
+  if (handle != NULL && handle->writeBuffer != NULL)
+    remove_writer(handle);
 
-    ndnfs_updateattr(path, curr_version);
+  // Only a handle that wrote, or truncated the file at open, has a version to commit;
+  // closing any other touches no table
+  if (handle == NULL || handle->writeBuffer == NULL || (!handle->writeBuffer->written() && handle->version != -1))
+  {
+    delete handle;
+    return 0;
+  }
 
-    // delete no signature segments
-    removenosign_segment(path);
+  // Releases of the same file commit one after another, each on top of the version the last one made
+  FileLock lock(ino);
 
-    //   char full_path[PATH_MAX];
-    //   abs_path(full_path, path);
+  // The whole commit runs in one transaction, so closing a written file costs one journal sync;
+  // IMMEDIATE takes the write lock up front, rather than failing to upgrade a read lock halfway
+  int base_version = handle->version;
+  int temp_version = handle->writeBuffer->tempVersion();
+  if (sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_release: begin transaction error. " << sqlite3_errmsg(db) << endl;
+    delete handle;
+    abort_release(ino, temp_version);
+    return -EIO;
+  }
 
-    //   int fd = open(full_path, O_RDONLY);
+  // Write out what is left in the handle's write buffer
+  map<int, string> written;
+  res = handle->writeBuffer->flush();
+  handle->writeBuffer->takeFlushed(written);
+  delete handle;
+  if (res < 0)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_release: flush write buffer error. " << res << endl;
+    abort_release(ino, temp_version);
+    return res;
+  }
 
-    //   if (fd == -1)
-    //   {
-    //     FILE_LOG(LOG_ERROR) << "ndnfs_release: open error. Errno: " << errno << endl;
-    //     return -errno;
-    //   }
+  // First we check if the file exists
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT current_version FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  res = sqlite3_step(stmt);
+  if (res != SQLITE_ROW)
+  {
+    stmt.finalize();
+    abort_release(ino, temp_version);
+    return -ENOENT;
+  }
+  curr_version = next_version(sqlite3_column_int(stmt, 0));
+  stmt.finalize();
+
+  // TODO: since older version is removed anyway, it makes sense to rely on system
+  // function calls for multiple file accesses. Simplification of versioning method?
+  //if (curr_ver != -1)
+  //  remove_version (path, curr_ver);
+
+  // The temp version becomes the new version directly; its segments stay unsigned until
+  // the sign queue gets to them. Versions cut by content, or made on top of one, are cut anew.
+  bool rebuilt = ndnfs::cdc_chunking || (base_version != -1 && version_chunked(ino, base_version));
+  if (!rebuilt)
+    res = removetemp_segment(ino, temp_version, curr_version);
+  else
+    res = rebuild_version(ino, temp_version, base_version, curr_version, file_seg_size(db, ino));
+  if (res < 0)
+  {
+    abort_release(ino, temp_version);
+    return -EIO;
+  }
 
-    //   char buf[ndnfs::seg_size];
-    //   int size = ndnfs::seg_size;
-    //   int seg = 0;
+  // Content another file or version already has is stored once
+  if (dedup_version(ino, curr_version) < 0)
+  {
+    abort_release(ino, temp_version);
+    return -EIO;
+  }
 
-    //   while (size == ndnfs::seg_size)
-    //   {
-    //     size = pread(fd, buf, ndnfs::seg_size, seg << ndnfs::seg_size_shift);
-    //     if (size == -1)
-    //     {
-    //       FILE_LOG(LOG_ERROR) << "ndnfs_release: read error. Errno: " << errno << endl;
-    //       return -errno;
-    //     }
-    //     sign_segment(path, curr_version, seg, buf, size);
-    //     seg++;
-    //   }
+  // Segments left untouched are shared with the version the file was opened at
+  if (!rebuilt && base_version != -1 && share_segments(ino, base_version, curr_version) < 0)
+  {
+    abort_release(ino, temp_version);
+    return -EIO;
+  }
 
-    //   close(fd);
+  res = commit_version(ino, curr_version);
+  if (res < 0)
+  {
+    abort_release(ino, temp_version);
+    return res;
   }
-  
- // When user release a file, make nlink-1
-    sqlite3_prepare_v2(db, "UPDATE file_system SET nlink = nlink-1 WHERE path = ?;", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-    res = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+
+  // Segments appended to extents have to be on disk before the version pointing at them is
+  ndnfs::extent_store->sync();
+  sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
+  refresh_attr(ino);
+
+  // What was just written is likely to be read again, and the committed version never changes;
+  // a version cut anew has segments other than the ones written
+  for (map<int, string>::iterator it = written.begin(); !rebuilt && it != written.end(); ++it)
+    ndnfs::segment_cache->insert(ino, curr_version, it->first, make_shared<const string>(std::move(it->second)));
+
+  // Writers are held back here when signing falls too far behind
+  ndnfs::sign_queue->notify();
+  ndnfs::sign_queue->waitForRoom();
   return 0;
 }
 
-int ndnfs_utimens(const char *path, const struct timespec ts[2])
+/**
+ * Set the access and modification times of ino, in seconds. Either may be UTIME_NOW, or
+ * UTIME_OMIT to leave it as it is. The modification time lasts until the next version is
+ * committed.
+ */
+int ndnfs_utimens(sqlite3_int64 ino, const struct timespec ts[2])
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_utimens: path=" << path << " 0:" << ts[0].tv_sec << " 1" << ts[1].tv_sec << endl;
-  // int res;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_utimens: ino=" << ino << " 0:" << ts[0].tv_sec << " 1" << ts[1].tv_sec << endl;
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  CachedStatement stmt;
+  stmt.prepare(db, "UPDATE file_system SET atime = COALESCE(?, atime), mtime = COALESCE(?, mtime, current_version) WHERE ino = ?;");
+  for (int i = 0; i < 2; i++)
+  {
+    if (ts[i].tv_nsec == UTIME_OMIT)
+      sqlite3_bind_null(stmt, i + 1);
+    else
+      sqlite3_bind_int64(stmt, i + 1, ts[i].tv_nsec == UTIME_NOW ? time(0) : ts[i].tv_sec);
+  }
+  sqlite3_bind_int64(stmt, 3, ino);
   int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
+  stmt.finalize();
+  if (res != SQLITE_DONE)
   {
-    // No such file
-    sqlite3_finalize(stmt);
-    return -ENOENT;
+    FILE_LOG(LOG_ERROR) << "ndnfs_utimens: update error. " << res << endl;
+    return -EIO;
   }
-  sqlite3_finalize(stmt);
+  if (sqlite3_changes(db) == 0)
+    return -ENOENT;
+  refresh_attr(ino);
   return 0;
-
-  // // sqlite3_prepare_v2(db, "UPDATE file_system SET  WHERE path = ?;", -1, &stmt, 0);
-  // // sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-
-  // struct timeval tv[2];
-
-  // char full_path[PATH_MAX];
-  // abs_path(full_path, path);
-
-  // tv[0].tv_sec = ts[0].tv_sec;
-  // tv[0].tv_usec = ts[0].tv_nsec / 1000;
-  // tv[1].tv_sec = ts[1].tv_sec;
-  // tv[1].tv_usec = ts[1].tv_nsec / 1000;
-
-  // res = utimes(full_path, tv);
-  // if (res == -1)
-  //   return -errno;
-
-  // return 0;
 }
 
 /*
@@ -788,40 +1146,38 @@ int ndnfs_symlink(const char *from, const char *to)
   int res;
 
   /*
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_system WHERE path = ?;", -1, &stmt, 0);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT * FROM file_system WHERE path = ?;");
   sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
   res = sqlite3_step(stmt);
   if (res == SQLITE_ROW) {
       // Cannot create symlink that has conflicting file name
-      sqlite3_finalize(stmt);
+      stmt.finalize();
       return -ENOENT;
   }
   
-  sqlite3_finalize(stmt);
+  stmt.finalize();
   
   // Generate first version entry for the new symlink
   int ver = time(0);
   
-  sqlite3_prepare_v2(db, "INSERT INTO file_versions (path, version) VALUES (?, ?);", -1, &stmt, 0);
+  stmt.prepare(db, "INSERT INTO file_versions (path, version) VALUES (?, ?);");
   sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 2, ver);
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
 
   // Add the symlink entry to database
-  sqlite3_prepare_v2(db, 
-                     "INSERT INTO file_system \
+  stmt.prepare(db, "INSERT INTO file_system \
                       (path, current_version, mime_type, type) \
-                      VALUES (?, ?, ?, ?);", 
-                     -1, &stmt, 0);
+                      VALUES (?, ?, ?, ?);");
   sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 2, ver);  // current version
   sqlite3_bind_text(stmt, 3, "", -1, SQLITE_STATIC);
   sqlite3_bind_int(stmt, 4, SYMBOLIC_LINK);
   
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);  
+  stmt.finalize();  
   */
 
   char full_path_from[PATH_MAX];
@@ -861,63 +1217,144 @@ int ndnfs_link(const char *from, const char *to)
 }
 
 /**
- * Right now, rename changes every entry related with the content, without creating new version
- * TODO: Rename would require checking if rename target (avoid collision error in db) already exists, and resigning of everything...
- * Rename should better work as a duplicate.
+ * Rename moves the name of the file, and nothing else: versions and segments are keyed by
+ * inode, and whatever is under a directory follows it, so any rename is one row update.
+ * A file at the target is replaced by a file, an empty directory by a directory. The
+ * actual folder of a directory moves along with it.
+ * TODO: Segments stay signed under the old name; resigning of everything...
  */
-int ndnfs_rename(const char *from, const char *to)
+int ndnfs_rename(sqlite3_int64 parent, const char *name, sqlite3_int64 to_parent, const char *to_name)
 {
-  int res = 0;
-  sqlite3_stmt *stmt;
-
-  sqlite3_prepare_v2(db, "UPDATE file_system SET PATH = ? WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, from, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_rename: parent=" << parent << ", name=" << name << ", to parent=" << to_parent << ", to name=" << to_name << endl;
+  sqlite3_int64 ino = lookup_entry(db, parent, name);
+  if (ino == 0)
+    return -ENOENT;
+  // The file moved, and the one it replaces, if any
+  FileLock lock(ino, lookup_entry(db, to_parent, to_name));
+  sqlite3_exec(db, "BEGIN IMMEDIATE TRANSACTION;", NULL, NULL, NULL);
+  // A directory cannot move under itself
+  CachedStatement stmt;
+  for (sqlite3_int64 dir = to_parent; dir != root_ino; )
+  {
+    if (dir == ino)
+    {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return -EINVAL;
+    }
+    stmt.prepare(db, "SELECT parent FROM file_entries WHERE ino = ?;");
+    sqlite3_bind_int64(stmt, 1, dir);
+    dir = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : root_ino;
+    stmt.finalize();
+  }
 
-  if (res != SQLITE_OK && res != SQLITE_DONE)
+  bool is_dir = inode_type(db, ino) == DIRECTORY;
+  sqlite3_int64 replaced = lookup_entry(db, to_parent, to_name);
+  if (replaced == ino)
+    replaced = 0;
+  bool replaced_dropped = false;
+  if (replaced != 0)
   {
-    FILE_LOG(LOG_ERROR) << "ndnfs_rename: update file_system error. " << res << endl;
-    return res;
+    // A directory only replaces an empty directory, and a file only a file
+    int res = 0;
+    if (inode_type(db, replaced) != DIRECTORY)
+    {
+      res = is_dir ? -ENOTDIR : 0;
+    }
+    else if (!is_dir)
+    {
+      res = -EISDIR;
+    }
+    else
+    {
+      stmt.prepare(db, "SELECT 1 FROM file_entries WHERE parent = ? LIMIT 1;");
+      sqlite3_bind_int64(stmt, 1, replaced);
+      if (sqlite3_step(stmt) == SQLITE_ROW)
+        res = -ENOTEMPTY;
+      stmt.finalize();
+    }
+    if (res < 0)
+    {
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return res;
+    }
+
+    // The file replaced goes like one unlinked
+    stmt.prepare(db, "DELETE FROM file_entries WHERE parent = ? AND name = ?;");
+    sqlite3_bind_int64(stmt, 1, to_parent);
+    sqlite3_bind_text(stmt, 2, to_name, -1, SQLITE_STATIC);
+    sqlite3_step(stmt);
+    stmt.finalize();
+    replaced_dropped = unlink_inode(replaced);
   }
-  sqlite3_finalize(stmt);
 
-  sqlite3_prepare_v2(db, "UPDATE file_versions SET PATH = ? WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, from, -1, SQLITE_STATIC);
-  sqlite3_step(stmt);
+  // The actual folder mirrors the tree of directories, see ndnfs_mkdir
+  string from, to;
+  if (is_dir && (ino_to_path(db, ino, from) < 0 || ino_to_path(db, to_parent, to) < 0))
+  {
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -ENOENT;
+  }
+  if (is_dir)
+  {
+    if (to != "/")
+      to += "/";
+    to += to_name;
+  }
 
-  if (res != SQLITE_OK && res != SQLITE_DONE)
+  stmt.prepare(db, "UPDATE file_entries SET parent = ?, name = ? WHERE parent = ? AND name = ?;");
+  sqlite3_bind_int64(stmt, 1, to_parent);
+  sqlite3_bind_text(stmt, 2, to_name, -1, SQLITE_STATIC);
+  sqlite3_bind_int64(stmt, 3, parent);
+  sqlite3_bind_text(stmt, 4, name, -1, SQLITE_STATIC);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
   {
-    FILE_LOG(LOG_ERROR) << "ndnfs_rename: update file_versions error. " << res << endl;
-    return res;
+    FILE_LOG(LOG_ERROR) << "ndnfs_rename: update file_entries error. " << res << endl;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    return -EIO;
   }
-  sqlite3_finalize(stmt);
 
-  sqlite3_prepare_v2(db, "UPDATE file_segments SET PATH = ? WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, to, -1, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, from, -1, SQLITE_STATIC);
+  // Manifests name the old path in every packet, so they cannot follow the rename
+  stmt.prepare(db, "DELETE FROM file_manifests WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   sqlite3_step(stmt);
+  stmt.finalize();
 
-  if (res != SQLITE_OK && res != SQLITE_DONE)
+  char full_path_from[PATH_MAX];
+  char full_path_to[PATH_MAX];
+  if (is_dir)
   {
-    FILE_LOG(LOG_ERROR) << "ndnfs_rename: update file_segments error. " << res << endl;
-    return res;
+    abs_path(full_path_from, from.c_str());
+    abs_path(full_path_to, to.c_str());
+    if (rename(full_path_from, full_path_to) == -1 && errno != ENOENT)
+    {
+      res = -errno;
+      FILE_LOG(LOG_ERROR) << "ndnfs_rename: rename of actual folder failed. Errno: " << -res << endl;
+      sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+      return res;
+    }
+  }
+  if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "ndnfs_rename: commit error. " << sqlite3_errmsg(db) << endl;
+    sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+    if (is_dir)
+      rename(full_path_to, full_path_from);
+    return -EIO;
   }
-  sqlite3_finalize(stmt);
-
-  // actual renaming
-  // char full_path_from[PATH_MAX];
-  // abs_path(full_path_from, from);
-
-  // char full_path_to[PATH_MAX];
-  // abs_path(full_path_to, to);
 
-  // res = rename(full_path_from, full_path_to);
+  // Attributes are cached by inode, which the rename leaves as they were; only the new name
+  // may have been cached as not existing
+  ndnfs::attr_cache->invalidateName(to_parent, to_name);
+  if (replaced != 0)
+  {
+    if (replaced_dropped)
+      ndnfs::segment_cache->forget(replaced);
+    refresh_attr(replaced);
+  }
 
   // FILE_LOG(LOG_ERROR) << "ndnfs_rename: rename should trigger resign of everything, which is not yet implemented" << endl;
-  // if (res == -1)
-  //   return -errno;
 
   return 0;
 }
@@ -938,21 +1375,11 @@ int ndnfs_statfs(const char *path, struct statvfs *si)
   return 0;
 }
 
-int ndnfs_access(const char *path, int mask)
+int ndnfs_access(sqlite3_int64 ino, int mask)
 {
-  FILE_LOG(LOG_DEBUG) << "ndnfs_acess: path = " << path << endl;
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_system WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_ROW)
-  {
-    // No such file
-    sqlite3_finalize(stmt);
-    return -ENOENT;
-  }
-  sqlite3_finalize(stmt);
-  return 0;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_acess: ino = " << ino << endl;
+  struct stat st;
+  return ndnfs_getattr(ino, &st);
 
   // char full_path[PATH_MAX];
   // abs_path(full_path, path);
@@ -28,26 +28,48 @@
 
 #include "mime-inference.h"
 #include "file-type.h"
+#include "write-buffer.h"
+#include "file-handle.h"
 
-int ndnfs_open(const char *path, struct fuse_file_info *fi);
+int ndnfs_open(sqlite3_int64 ino, struct fuse_file_info *fi);
 
-int ndnfs_mknod(const char *path, mode_t mode, dev_t dev);
+int ndnfs_mknod(sqlite3_int64 parent, const char *name, mode_t mode, dev_t dev);
 
-int ndnfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int ndnfs_read(sqlite3_int64 ino, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
-int ndnfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
+int ndnfs_write(sqlite3_int64 ino, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
 
-int ndnfs_truncate(const char *path, off_t offset);
+int ndnfs_truncate(sqlite3_int64 ino, off_t offset);
 
-int ndnfs_unlink(const char *path);
+int ndnfs_unlink(sqlite3_int64 parent, const char *name);
 
-int ndnfs_release(const char *path, struct fuse_file_info *fi);
+int ndnfs_flush(sqlite3_int64 ino, struct fuse_file_info *fi);
+
+int ndnfs_release(sqlite3_int64 ino, struct fuse_file_info *fi);
+
+int clear_unlinked();
+
+/**
+ * Whether a handle of ino is open for writing; open handles are only counted in memory.
+ */
+bool writer_open(sqlite3_int64 ino);
+
+void ndnfs_remember(sqlite3_int64 ino);
+
+void ndnfs_forget(sqlite3_int64 ino, unsigned long nlookup);
+
+/**
+ * The inode ino lost a name. It is dropped with everything stored under it once it has no
+ * name left and the kernel has forgotten it. Called in a transaction, holding the FileLock of ino.
+ * @return true if it was dropped right away
+ */
+bool unlink_inode(sqlite3_int64 ino);
 
 int ndnfs_statfs(const char *path, struct statvfs *si);
 
-int ndnfs_access(const char *path, int mask);
+int ndnfs_access(sqlite3_int64 ino, int mask);
 
-int ndnfs_utimens(const char *path, const struct timespec ts[2]);
+int ndnfs_utimens(sqlite3_int64 ino, const struct timespec ts[2]);
 
 int ndnfs_link(const char *from, const char *to);
 
@@ -55,6 +77,6 @@ int ndnfs_symlink(const char *from, const char *to);
 
 int ndnfs_readlink(const char *path, char *buf, size_t size);
 
-int ndnfs_rename(const char *from, const char *to);
+int ndnfs_rename(sqlite3_int64 parent, const char *name, sqlite3_int64 to_parent, const char *to_name);
 
 #endif
@@ -0,0 +1,566 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "lowlevel.h"
+#include "file.h"
+#include "directory.h"
+#include "attribute.h"
+#include "dentry.h"
+#include "attr-cache.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Inode number of directory entries listed without attributes, as the high-level library has it
+static const fuse_ino_t unknown_ino = 0xffffffff;
+
+// Entries of an open directory are listed a chunk at a time, each chunk resuming after the name
+// the one before ended with; see ndnfs_ll_opendir. The offset of an entry is its position in the
+// listing plus one, the same for readdir and readdirplus.
+static const size_t dir_chunk = 512;
+
+struct DirBuffer
+{
+  struct Entry
+  {
+    string name;
+    struct stat attr;
+    // attr is filled; false for "." and ".."
+    bool hasAttr;
+  };
+
+  // Chunk of the listing, entries[0] being at position first
+  vector<Entry> entries;
+  off_t first;
+  // The chunk is the last one
+  bool done;
+};
+
+// Reply the result of an operation, 0 or negative errno
+static void reply_status(fuse_req_t req, int res)
+{
+  fuse_reply_err(req, res < 0 ? -res : 0);
+}
+
+// Path of name in the directory at inode parent, for the operations that go by path
+static bool child_path(fuse_ino_t parent, const char *name, string &path)
+{
+  if (ino_to_path(db, parent, path) < 0)
+    return false;
+  if (path != "/")
+    path += "/";
+  path += name;
+  return true;
+}
+
+// Reply the entry of the file at inode ino, or ENOENT if ino is 0. The entry is one more
+// lookup the kernel holds on the inode, until it forgets it.
+static void reply_entry(fuse_req_t req, sqlite3_int64 ino)
+{
+  struct fuse_entry_param e;
+  memset(&e, 0, sizeof(e));
+  int res = ino != 0 ? ndnfs_getattr(ino, &e.attr) : -ENOENT;
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+  e.ino = e.attr.st_ino;
+  e.attr_timeout = ndnfs::attr_timeout;
+  e.entry_timeout = ndnfs::entry_timeout;
+  ndnfs_remember(e.ino);
+  // The request was interrupted, and the kernel never got the lookup
+  if (fuse_reply_entry(req, &e) != 0)
+    ndnfs_forget(e.ino, 1);
+}
+
+void ndnfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  // One query on the entry table, none for a name known not to exist; the attributes of the
+  // inode mostly come from the attribute cache
+  sqlite3_int64 ino = 0;
+  if (!ndnfs::attr_cache->absent(parent, name))
+  {
+    unsigned long stamp = ndnfs::attr_cache->nameStamp(parent, name);
+    ino = lookup_entry(db, parent, name);
+    if (ino == 0)
+      ndnfs::attr_cache->fillAbsent(parent, name, stamp);
+  }
+  // The kernel keeps the name as not existing, and asks no more for a while
+  if (ino == 0 && ndnfs::negative_timeout > 0)
+  {
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.entry_timeout = ndnfs::negative_timeout;
+    fuse_reply_entry(req, &e);
+    return;
+  }
+  reply_entry(req, ino);
+}
+
+void ndnfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+  // An inode unlinked meanwhile goes with the last lookup
+  ndnfs_forget(ino, nlookup);
+  fuse_reply_none(req);
+}
+
+void ndnfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  int res = ndnfs_getattr(ino, &st);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_attr(req, &st, ndnfs::attr_timeout);
+}
+
+void ndnfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+  // Owners are those of the user who mounted ndnfs, and cannot be changed
+  int res = 0;
+  if (to_set & (FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    res = -EPERM;
+  if (res == 0 && (to_set & FUSE_SET_ATTR_MODE))
+    res = ndnfs_chmod(ino, attr->st_mode);
+  // The writes held by handles open on the file, fi's among them, are cut as well
+  if (res == 0 && (to_set & FUSE_SET_ATTR_SIZE))
+    res = ndnfs_truncate(ino, attr->st_size);
+  if (res == 0 && (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME)))
+  {
+    // Times are kept in seconds; a time not being set is left as it is
+    struct timespec ts[2];
+    ts[0].tv_sec = attr->st_atime;
+    ts[0].tv_nsec = !(to_set & FUSE_SET_ATTR_ATIME) ? UTIME_OMIT : (to_set & FUSE_SET_ATTR_ATIME_NOW) ? UTIME_NOW : 0;
+    ts[1].tv_sec = attr->st_mtime;
+    ts[1].tv_nsec = !(to_set & FUSE_SET_ATTR_MTIME) ? UTIME_OMIT : (to_set & FUSE_SET_ATTR_MTIME_NOW) ? UTIME_NOW : 0;
+    res = ndnfs_utimens(ino, ts);
+  }
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+
+  struct stat st;
+  memset(&st, 0, sizeof(st));
+  res = ndnfs_getattr(ino, &st);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_attr(req, &st, ndnfs::attr_timeout);
+}
+
+void ndnfs_ll_readlink(fuse_req_t req, fuse_ino_t ino)
+{
+  string path;
+  if (ino_to_path(db, ino, path) < 0)
+  {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  char link[PATH_MAX];
+  int res = ndnfs_readlink(path.c_str(), link, sizeof(link));
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_readlink(req, link);
+}
+
+void ndnfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+  int res = ndnfs_mknod(parent, name, mode, rdev);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    reply_entry(req, lookup_entry(db, parent, name));
+}
+
+void ndnfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+  int res = ndnfs_mkdir(parent, name, mode);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    reply_entry(req, lookup_entry(db, parent, name));
+}
+
+void ndnfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  reply_status(req, ndnfs_unlink(parent, name));
+}
+
+void ndnfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+  reply_status(req, ndnfs_rmdir(parent, name));
+}
+
+void ndnfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name)
+{
+  string path;
+  if (!child_path(parent, name, path))
+  {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  int res = ndnfs_symlink(link, path.c_str());
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+  ndnfs::attr_cache->invalidateName(parent, name);
+  reply_entry(req, lookup_entry(db, parent, name));
+}
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+#else
+void ndnfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+#endif
+{
+#ifdef NDNFS_FUSE3
+  // Neither RENAME_NOREPLACE nor RENAME_EXCHANGE is supported
+  if (flags != 0)
+  {
+    fuse_reply_err(req, EINVAL);
+    return;
+  }
+#endif
+  reply_status(req, ndnfs_rename(parent, name, newparent, newname));
+}
+
+void ndnfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname)
+{
+  string from, to;
+  if (ino_to_path(db, ino, from) < 0 || !child_path(newparent, newname, to))
+  {
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+
+  int res = ndnfs_link(from.c_str(), to.c_str());
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+  ndnfs::attr_cache->invalidateName(newparent, newname);
+  reply_entry(req, lookup_entry(db, newparent, newname));
+}
+
+void ndnfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  int res = ndnfs_open(ino, fi);
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+  // The request was interrupted, and no release will follow for the handle
+  if (fuse_reply_open(req, fi) != 0)
+    ndnfs_release(ino, fi);
+}
+
+void ndnfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  vector<char> buf(size);
+  int res = ndnfs_read(ino, buf.data(), size, off, fi);
+  if (res < 0)
+  {
+    reply_status(req, res);
+    return;
+  }
+  // Content lives in memory rather than in a file, so there is no file descriptor to splice from
+  fuse_reply_buf(req, buf.data(), res);
+}
+
+void ndnfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  int res = ndnfs_write(ino, buf, size, off, fi);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_write(req, res);
+}
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi)
+{
+  // Written straight from the request when it arrived in memory; a request spliced
+  // into a pipe is read out of it once, into memory the write buffer copies from
+  size_t size = fuse_buf_size(bufv);
+  const char *buf;
+  vector<char> copy;
+  if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD))
+  {
+    buf = (const char *) bufv->buf[0].mem + bufv->off;
+    size -= bufv->off;
+  }
+  else
+  {
+    copy.resize(size);
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].mem = copy.data();
+    ssize_t res = fuse_buf_copy(&dst, bufv, (enum fuse_buf_copy_flags) 0);
+    if (res < 0)
+    {
+      fuse_reply_err(req, -res);
+      return;
+    }
+    size = res;
+    buf = copy.data();
+  }
+
+  int res = ndnfs_write(ino, buf, size, off, fi);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_write(req, res);
+}
+#endif
+
+void ndnfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  reply_status(req, ndnfs_flush(ino, fi));
+}
+
+void ndnfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  reply_status(req, ndnfs_release(ino, fi));
+}
+
+// Add an entry to a DirBuffer, until the chunk is full
+static int fill_dir(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+  DirBuffer *dir = (DirBuffer *) buf;
+  if (dir->entries.size() >= dir_chunk)
+    return 1;
+  dir->entries.push_back(DirBuffer::Entry());
+  DirBuffer::Entry &entry = dir->entries.back();
+  entry.name = name;
+  memset(&entry.attr, 0, sizeof(entry.attr));
+  entry.hasAttr = stbuf != NULL;
+  if (stbuf != NULL)
+  {
+    entry.attr = *stbuf;
+  }
+  else
+  {
+    entry.attr.st_ino = unknown_ino;
+    entry.attr.st_mode = S_IFDIR;
+  }
+  return 0;
+}
+
+void ndnfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  // Listed by readdir, a chunk at a time
+  DirBuffer *dir = new DirBuffer();
+  dir->first = 0;
+  dir->done = false;
+  fi->fh = (uint64_t) dir;
+  if (fuse_reply_open(req, fi) != 0)
+    delete dir;
+}
+
+// Replace the chunk held by the next one of the listing of the directory ino, resuming after
+// the last name of the one held, or by the first one
+static int fetch_dir(fuse_ino_t ino, DirBuffer *dir, bool restart)
+{
+  string after;
+  if (!restart)
+    after = dir->entries.back().name;
+  dir->first = restart ? 0 : dir->first + dir->entries.size();
+  dir->entries.clear();
+  int res = ndnfs_readdir(ino, restart ? NULL : after.c_str(), dir, fill_dir);
+  if (res < 0)
+  {
+    // Started over by the next readdir
+    dir->first = 0;
+    dir->entries.clear();
+    dir->done = false;
+    return res;
+  }
+  dir->done = dir->entries.size() < dir_chunk;
+  return 0;
+}
+
+// Load the chunk of the listing of the directory ino that holds position off, or the end of it.
+// The listing is only started over for off 0, or to seek back before the chunk held.
+static int seek_dir(fuse_ino_t ino, DirBuffer *dir, off_t off)
+{
+  if (off == 0 || off < dir->first || (dir->entries.empty() && !dir->done))
+  {
+    int res = fetch_dir(ino, dir, true);
+    if (res < 0)
+      return res;
+  }
+  while (off >= dir->first + (off_t) dir->entries.size() && !dir->done)
+  {
+    int res = fetch_dir(ino, dir, false);
+    if (res < 0)
+      return res;
+  }
+  return 0;
+}
+
+// Reply the entries from off on that fit in size bytes. Entries replied by readdirplus
+// carry their attributes, and each of them is a lookup of its inode.
+static void reply_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi, bool plus)
+{
+  DirBuffer *dir = (DirBuffer *) fi->fh;
+  vector<char> buf(size);
+  size_t used = 0;
+  vector<fuse_ino_t> remembered;
+  for (off_t i = off; ; i++)
+  {
+    if (i == off || i >= dir->first + (off_t) dir->entries.size())
+    {
+      int res = seek_dir(ino, dir, i);
+      if (res < 0)
+      {
+        // What already fits is replied, and the error comes back on the next call
+        if (used == 0)
+        {
+          reply_status(req, res);
+          return;
+        }
+        break;
+      }
+      if (i >= dir->first + (off_t) dir->entries.size())
+        break;
+    }
+
+    const DirBuffer::Entry &entry = dir->entries[i - dir->first];
+    size_t len;
+#ifdef NDNFS_FUSE3
+    if (plus)
+    {
+      struct fuse_entry_param e;
+      memset(&e, 0, sizeof(e));
+      e.attr = entry.attr;
+      if (entry.hasAttr)
+      {
+        e.ino = entry.attr.st_ino;
+        e.attr_timeout = ndnfs::attr_timeout;
+        e.entry_timeout = ndnfs::entry_timeout;
+      }
+      len = fuse_add_direntry_plus(req, buf.data() + used, size - used, entry.name.c_str(), &e, i + 1);
+      if (len > size - used)
+        break;
+      if (e.ino != 0)
+      {
+        ndnfs_remember(e.ino);
+        remembered.push_back(e.ino);
+      }
+    }
+    else
+#endif
+    {
+      len = fuse_add_direntry(req, buf.data() + used, size - used, entry.name.c_str(), &entry.attr, i + 1);
+      if (len > size - used)
+        break;
+    }
+    used += len;
+  }
+
+  // The request was interrupted, and the kernel never got the lookups
+  if (fuse_reply_buf(req, buf.data(), used) != 0)
+  {
+    for (size_t i = 0; i < remembered.size(); i++)
+      ndnfs_forget(remembered[i], 1);
+  }
+}
+
+void ndnfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  reply_dir(req, ino, size, off, fi, false);
+}
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+  reply_dir(req, ino, size, off, fi, true);
+}
+#endif
+
+void ndnfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+  delete (DirBuffer *) fi->fh;
+  fi->fh = 0;
+  fuse_reply_err(req, 0);
+}
+
+void ndnfs_ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+  struct statvfs st;
+  memset(&st, 0, sizeof(st));
+  int res = ndnfs_statfs("/", &st);
+  if (res < 0)
+    reply_status(req, res);
+  else
+    fuse_reply_statfs(req, &st);
+}
+
+#ifdef NDNFS_OSXFUSE
+void ndnfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags, uint32_t position)
+#elif NDNFS_FUSE
+void ndnfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags)
+#endif
+{
+#ifdef NDNFS_OSXFUSE
+  reply_status(req, ndnfs_setxattr(ino, name, value, size, flags, position));
+#elif NDNFS_FUSE
+  reply_status(req, ndnfs_setxattr(ino, name, value, size, flags));
+#endif
+}
+
+#ifdef NDNFS_OSXFUSE
+void ndnfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size, uint32_t position)
+#elif NDNFS_FUSE
+void ndnfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size)
+#endif
+{
+  vector<char> value(size);
+#ifdef NDNFS_OSXFUSE
+  int res = ndnfs_getxattr(ino, name, value.data(), size, position);
+#elif NDNFS_FUSE
+  int res = ndnfs_getxattr(ino, name, value.data(), size);
+#endif
+  if (res < 0)
+    reply_status(req, res);
+  else if (size == 0)
+    fuse_reply_xattr(req, res);
+  else
+    fuse_reply_buf(req, value.data(), res);
+}
+
+void ndnfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name)
+{
+  reply_status(req, ndnfs_removexattr(ino, name));
+}
+
+void ndnfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+  reply_status(req, ndnfs_access(ino, mask));
+}
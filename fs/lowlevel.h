@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_LOWLEVEL_H
+#define NDNFS_LOWLEVEL_H
+
+#include "ndnfs.h"
+
+/**
+ * Low-level FUSE operations. The kernel addresses files by inode number, which is the key
+ * of file_system; operations run on the inode, and only those that need a name resolve
+ * the path of it through file_entries. Each entry replied is a lookup the kernel holds on
+ * its inode until it forgets it, and an inode unlinked meanwhile is kept until then, see
+ * unlink_inode. Entries and attributes replied are cached by the kernel for
+ * ndnfs::entry_timeout and ndnfs::attr_timeout seconds, and names looked up and not found
+ * for ndnfs::negative_timeout seconds.
+ */
+
+void ndnfs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void ndnfs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+
+void ndnfs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+
+void ndnfs_ll_readlink(fuse_req_t req, fuse_ino_t ino);
+
+void ndnfs_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+
+void ndnfs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+
+void ndnfs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void ndnfs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+
+void ndnfs_ll_symlink(fuse_req_t req, const char *link, fuse_ino_t parent, const char *name);
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags);
+#else
+void ndnfs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+#endif
+
+void ndnfs_ll_link(fuse_req_t req, fuse_ino_t ino, fuse_ino_t newparent, const char *newname);
+
+void ndnfs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+
+void ndnfs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi);
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off, struct fuse_file_info *fi);
+#endif
+
+void ndnfs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+
+#ifdef NDNFS_FUSE3
+void ndnfs_ll_readdirplus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi);
+#endif
+
+void ndnfs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+
+void ndnfs_ll_statfs(fuse_req_t req, fuse_ino_t ino);
+
+#ifdef NDNFS_OSXFUSE
+void ndnfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags, uint32_t position);
+#elif NDNFS_FUSE
+void ndnfs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags);
+#endif
+
+#ifdef NDNFS_OSXFUSE
+void ndnfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size, uint32_t position);
+#elif NDNFS_FUSE
+void ndnfs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size);
+#endif
+
+void ndnfs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name);
+
+void ndnfs_ll_access(fuse_req_t req, fuse_ino_t ino, int mask);
+
+#endif
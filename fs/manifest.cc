@@ -0,0 +1,125 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "manifest.h"
+#include "segment.h"
+#include "namespace.h"
+
+#include <ndn-cpp/data.hpp>
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+using namespace ndn;
+
+Blob digest_content(const char *data, int len)
+{
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256((const uint8_t *)data, len, digest);
+  return Blob(digest, sizeof(digest));
+}
+
+int sign_manifest(sqlite3 *conn, KeyChain &keyChain, sqlite3_int64 ino, const char *path, int ver)
+{
+  FILE_LOG(LOG_DEBUG) << "sign_manifest: path=" << path << std::dec << ", ver=" << ver << endl;
+
+  string digests;
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT signature FROM file_segments WHERE ino = ? AND version = ? ORDER BY segment;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    if (sqlite3_column_bytes(stmt, 0) != manifest_digest_size)
+    {
+      FILE_LOG(LOG_ERROR) << "sign_manifest: segment without digest. path:" << path << " ver:" << ver << endl;
+      stmt.finalize();
+      return -EIO;
+    }
+    digests.append((const char *)sqlite3_column_blob(stmt, 0), manifest_digest_size);
+  }
+  stmt.finalize();
+
+  // An empty file still gets one, empty, manifest segment
+  int count = digests.size() / manifest_digest_size;
+  int per_segment = manifest_digests_per_segment(file_seg_size(conn, ino));
+  int total = max(1, (count + per_segment - 1) / per_segment);
+
+  Name manifest_name = file_name(path);
+  manifest_name.append(Name::fromEscapedString(NdnfsNamespace::manifestComponentName_)).appendVersion(ver);
+  Name::Component final_block_id = Name::Component::fromNumberWithMarker(total - 1, 0x00);
+
+  // Built from the last segment backwards, since each segment carries the digest of the next
+  vector<Blob> encoded(total);
+  Blob next_digest;
+  for (int i = total - 1; i >= 0; i--)
+  {
+    size_t begin = (size_t)i * per_segment * manifest_digest_size;
+    string content = digests.substr(begin, min(digests.size() - begin, (size_t)per_segment * manifest_digest_size));
+    if (i < total - 1)
+      content.append((const char *)next_digest.buf(), next_digest.size());
+    next_digest = digest_content(content.data(), content.size());
+
+    Name seg_name(manifest_name);
+    seg_name.appendSegment(i);
+    Data data(seg_name);
+    data.setContent((const uint8_t *)content.data(), content.size());
+    data.getMetaInfo().setFinalBlockId(final_block_id);
+    if (i == 0)
+      keyChain.sign(data, ndnfs::certificateName);
+    else
+      keyChain.signWithSha256(data);
+    encoded[i] = data.wireEncode();
+  }
+
+  sqlite3_exec(conn, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  stmt.prepare(conn, "DELETE FROM file_manifests WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_step(stmt);
+  stmt.finalize();
+
+  int res = SQLITE_DONE;
+  stmt.prepare(conn, "INSERT INTO file_manifests (ino, version, segment, data) VALUES (?, ?, ?, ?);");
+  for (int i = 0; i < total && res == SQLITE_DONE; i++)
+  {
+    sqlite3_bind_int64(stmt, 1, ino);
+    sqlite3_bind_int(stmt, 2, ver);
+    sqlite3_bind_int(stmt, 3, i);
+    sqlite3_bind_blob(stmt, 4, encoded[i].buf(), encoded[i].size(), SQLITE_STATIC);
+    res = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "sign_manifest: insert error. path:" << path << " res:" << res << endl;
+    sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+    return -EIO;
+  }
+
+  // Tells the server to serve this version's segments with digest signatures
+  stmt.prepare(conn, "UPDATE file_versions SET manifest = 1 WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_step(stmt);
+  stmt.finalize();
+  sqlite3_exec(conn, "COMMIT;", NULL, NULL, NULL);
+  return total;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_MANIFEST_H
+#define NDNFS_MANIFEST_H
+
+#include "ndnfs.h"
+
+/**
+ * Manifest signing (-o sign_mode=manifest): instead of an RSA signature per segment,
+ * each segment of a version gets the SHA-256 digest of its content, stored in
+ * file_segments.signature, and the version gets one manifest listing these digests,
+ * published as <prefix><path>/%C1.FS.manifest/<version>/<segment>.
+ *
+ * A manifest segment holds the digests of consecutive file segments, 32 bytes each.
+ * Every manifest segment but the last ends with the digest of the content of the next
+ * manifest segment, so the RSA signature on manifest segment 0, the only one signed
+ * with RSA, covers the whole version.
+ */
+
+const int manifest_digest_size = 32;
+
+/**
+ * Manifest segments are as large as the segments of the file they list.
+ */
+inline int manifest_digests_per_segment(int seg_size)
+{
+    return seg_size / manifest_digest_size - 1;
+}
+
+ndn::Blob digest_content(const char *data, int len);
+
+/**
+ * Build, sign and store the manifest of a version whose segment digests are all in db;
+ * path names the manifest.
+ * @return number of manifest segments, or negative errno on failure
+ */
+int sign_manifest(sqlite3 *conn, ndn::KeyChain &keyChain, sqlite3_int64 ino, const char *path, int ver);
+
+#endif
@@ -139,6 +139,7 @@ int initialize_ext_mime_map()
   ext_mime_map.insert(std::pair<const char *, const char *>(".csh", "text/x-script.csh"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".css", "application/x-pointplus"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".css", "text/css"));
+  ext_mime_map.insert(std::pair<const char *, const char *>(".csv", "text/csv"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".cxx", "text/plain"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".dcr", "application/x-director"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".deepv", "application/x-deepv"));
@@ -273,6 +274,7 @@ int initialize_ext_mime_map()
   ext_mime_map.insert(std::pair<const char *, const char *>(".js", "application/ecmascript"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".js", "text/javascript"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".js", "text/ecmascript"));
+  ext_mime_map.insert(std::pair<const char *, const char *>(".json", "application/json"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".jut", "image/jutvision"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".kar", "audio/midi"));
   ext_mime_map.insert(std::pair<const char *, const char *>(".kar", "music/x-karaoke"));
@@ -30,11 +30,22 @@
 #include "directory.h"
 #include "file.h"
 #include "attribute.h"
+#include "sign-pool.h"
+#include "sign-queue.h"
+#include "segment-cache.h"
+#include "attr-cache.h"
+#include "readahead.h"
+#include "extent-store.h"
+#include "compression.h"
+#include "lowlevel.h"
+#include "schema.h"
 
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+
 using namespace std;
 using namespace ndn;
 
@@ -137,7 +148,8 @@ static uint8_t DEFAULT_RSA_PRIVATE_KEY_DER[] = {
     0x3f, 0xb9, 0xfe, 0xbc, 0x8d, 0xda, 0xcb, 0xea, 0x8f};
 
 const char *db_name = "/tmp/ndnfs.db";
-sqlite3 *db;
+thread_local ThreadConnection db;
+ConnectionPool *ndnfs::connection_pool = NULL;
 
 ndn::ptr_lib::shared_ptr<ndn::KeyChain> ndnfs::keyChain; // 智能指针
 ndn::Name ndnfs::certificateName;
@@ -145,43 +157,196 @@ string ndnfs::global_prefix = "/ndn/broadcast/ndnfs";
 string ndnfs::root_path;
 string ndnfs::logging_path = "";
 
-const int ndnfs::seg_size = 8192; // size of the content in each content object segment counted in bytes
-const int ndnfs::seg_size_shift = 13;
+int ndnfs::seg_size = 8192; // size of the content in each content object segment counted in bytes, for new files
+const int ndnfs::min_seg_size = 1024;
+const int ndnfs::max_seg_size = 65536;
+bool ndnfs::cdc_chunking = false; // versions committed are cut into segments by content, of up to seg_size bytes
+
+int ndnfs::sign_threads = 0; // 0: one signing thread per core
+bool ndnfs::manifest_signing = false; // digest per segment and one signed manifest per version, instead of RSA per segment
+SignPool *ndnfs::sign_pool = NULL;
+
+int ndnfs::sign_queue_depth = 64; // versions waiting to be signed before writers are held back
+SignQueue *ndnfs::sign_queue = NULL;
+
+size_t ndnfs::write_buffer_cap = 16 * 1024 * 1024; // dirty bytes an open file may buffer before spilling to db
+
+double ndnfs::entry_timeout = 1.0; // seconds the kernel may keep a name looked up without asking again
+double ndnfs::attr_timeout = 1.0; // seconds the kernel may keep attributes without asking again
+double ndnfs::negative_timeout = 1.0; // seconds the kernel may keep a name not found without asking again
+bool ndnfs::writeback_cache = true; // kernel caches writes and sends them in large requests; FUSE 3 only
+
+size_t ndnfs::read_cache_cap = 64 * 1024 * 1024; // bytes of segment content kept in memory for reads
+SegmentCache *ndnfs::segment_cache = NULL;
+
+size_t ndnfs::attr_cache_cap = 256 * 1024; // inodes whose attributes are kept in memory
+AttrCache *ndnfs::attr_cache = NULL;
+
+int ndnfs::readahead_max = 32; // segments prefetched past a sequential read, at most
+Readahead *ndnfs::readahead = NULL;
+
+bool ndnfs::extent_segments = false; // new segment content appended to extent files next to the db, instead of stored in it
+ExtentStore *ndnfs::extent_store = NULL; // opened whatever the mode, since rows written under either one stay readable
+
+bool ndnfs::compress_segments = false; // content committed to files of compressible types stored compressed with zstd
+bool ndnfs::wire_compression = false; // versions stored all compressed also signed and published compressed
 
 int ndnfs::user_id = 0;
 int ndnfs::group_id = 0;
 
-static void create_fuse_operations(struct fuse_operations *fuse_op)
+/**
+ * Create a keychain holding the default signing key; signing threads
+ * each create their own, so that no keychain is shared across threads.
+ */
+ndn::ptr_lib::shared_ptr<ndn::KeyChain> create_keychain()
+{
+  ndn::ptr_lib::shared_ptr<ndn::MemoryIdentityStorage> identityStorage(new ndn::MemoryIdentityStorage());
+  ndn::ptr_lib::shared_ptr<ndn::MemoryPrivateKeyStorage> privateKeyStorage(new ndn::MemoryPrivateKeyStorage());
+  ndn::ptr_lib::shared_ptr<ndn::KeyChain> keyChain(new ndn::KeyChain(ndn::ptr_lib::make_shared<ndn::IdentityManager>(identityStorage, privateKeyStorage), ndn::ptr_lib::shared_ptr<ndn::NoVerifyPolicyManager>(new ndn::NoVerifyPolicyManager())));
+
+  ndn::Name keyName("/testname/DSK-123");
+  identityStorage->addKey(keyName, ndn::KEY_TYPE_RSA, ndn::Blob(DEFAULT_RSA_PUBLIC_KEY_DER, sizeof(DEFAULT_RSA_PUBLIC_KEY_DER)));
+  privateKeyStorage->setKeyPairForKeyName(keyName, ndn::KEY_TYPE_RSA, DEFAULT_RSA_PUBLIC_KEY_DER,
+                                          sizeof(DEFAULT_RSA_PUBLIC_KEY_DER), DEFAULT_RSA_PRIVATE_KEY_DER,
+                                          sizeof(DEFAULT_RSA_PRIVATE_KEY_DER));
+  return keyChain;
+}
+
+static void ndnfs_init(void *userdata, struct fuse_conn_info *conn)
 {
-  fuse_op->getattr = ndnfs_getattr;
-  fuse_op->chmod = ndnfs_chmod;
-  fuse_op->setxattr = ndnfs_setxattr;
-  fuse_op->open = ndnfs_open;
-  fuse_op->read = ndnfs_read;
-  fuse_op->readdir = ndnfs_readdir;
-  fuse_op->mknod = ndnfs_mknod;
-  fuse_op->write = ndnfs_write;
-  fuse_op->truncate = ndnfs_truncate;
-  fuse_op->release = ndnfs_release;
-  fuse_op->unlink = ndnfs_unlink;
-  fuse_op->mkdir = ndnfs_mkdir;
-  fuse_op->rmdir = ndnfs_rmdir;
-  fuse_op->statfs = ndnfs_statfs;
-  fuse_op->access = ndnfs_access;
-  fuse_op->utimens = ndnfs_utimens;
-  fuse_op->link = ndnfs_link;
-  fuse_op->readlink = ndnfs_readlink;
-  fuse_op->symlink = ndnfs_symlink;
-  fuse_op->rename = ndnfs_rename;
+#ifdef FUSE_CAP_ATOMIC_O_TRUNC
+  // Have O_TRUNC passed to open, which then skips sharing the old segments, instead of a separate truncate
+  if (conn->capable & FUSE_CAP_ATOMIC_O_TRUNC)
+    conn->want |= FUSE_CAP_ATOMIC_O_TRUNC;
+#endif
+
+#ifdef FUSE_CAP_BIG_WRITES
+  // Writes of up to max_write bytes at once, instead of a page per request; always on with FUSE 3
+  if (conn->capable & FUSE_CAP_BIG_WRITES)
+    conn->want |= FUSE_CAP_BIG_WRITES;
+#endif
+
+#ifdef NDNFS_FUSE3
+  // Let the kernel gather small writes in its page cache, and send them in large requests
+  if (ndnfs::writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+    conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+  // Write requests arrive spliced out of /dev/fuse; read replies are copied from memory,
+  // where segments live, so splicing them would gain nothing
+  if (conn->capable & FUSE_CAP_SPLICE_READ)
+    conn->want |= FUSE_CAP_SPLICE_READ;
+  // Listings come with attributes at no extra cost, so readdirplus is used for every one of them
+  if (conn->capable & FUSE_CAP_READDIRPLUS)
+    conn->want |= FUSE_CAP_READDIRPLUS;
+  conn->want &= ~FUSE_CAP_READDIRPLUS_AUTO;
+  FILE_LOG(LOG_DEBUG) << "ndnfs_init: max_write " << conn->max_write << ", want 0x" << std::hex << conn->want << std::dec << endl;
+#endif
+
+  // Threads have to be started here rather than in main, since FUSE forks when daemonizing
+  ndnfs::sign_pool = new SignPool(ndnfs::sign_threads);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_init: started " << ndnfs::sign_threads << " signing threads" << endl;
+  ndnfs::sign_queue = new SignQueue(db_name, ndnfs::sign_queue_depth);
+  ndnfs::segment_cache = new SegmentCache(ndnfs::read_cache_cap);
+  ndnfs::attr_cache = new AttrCache(ndnfs::attr_cache_cap);
+  ndnfs::extent_store = new ExtentStore(string(db_name) + ".extents", true);
+  ndnfs::readahead = new Readahead(db_name);
 }
 
-static struct fuse_operations ndnfs_fs_ops;
+static void ndnfs_destroy(void *userdata)
+{
+  ostringstream readahead_counts;
+  ndnfs::readahead->report(readahead_counts);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_destroy: readahead:" << endl << readahead_counts.str();
+  // Goes before the segment cache it fills
+  delete ndnfs::readahead;
+  ndnfs::readahead = NULL;
+
+  // The queue goes before the pool it signs with
+  delete ndnfs::sign_queue;
+  ndnfs::sign_queue = NULL;
+  delete ndnfs::sign_pool;
+  ndnfs::sign_pool = NULL;
+
+  ostringstream extent_counts;
+  ndnfs::extent_store->report(extent_counts);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_destroy: extent store:" << endl << extent_counts.str();
+  delete ndnfs::extent_store;
+  ndnfs::extent_store = NULL;
+
+  ostringstream counts;
+  ndnfs::connection_pool->report(counts);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_destroy: statement executions:" << endl << counts.str();
+
+  ostringstream cache_counts;
+  ndnfs::segment_cache->report(cache_counts);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_destroy: segment cache:" << endl << cache_counts.str();
+  delete ndnfs::segment_cache;
+  ndnfs::segment_cache = NULL;
+
+  ostringstream attr_counts;
+  ndnfs::attr_cache->report(attr_counts);
+  FILE_LOG(LOG_DEBUG) << "ndnfs_destroy: attribute cache:" << endl << attr_counts.str();
+  delete ndnfs::attr_cache;
+  ndnfs::attr_cache = NULL;
+}
+
+static void create_fuse_operations(struct fuse_lowlevel_ops *fuse_op)
+{
+  fuse_op->lookup = ndnfs_ll_lookup;
+  fuse_op->forget = ndnfs_ll_forget;
+  fuse_op->getattr = ndnfs_ll_getattr;
+  fuse_op->setattr = ndnfs_ll_setattr;
+  fuse_op->setxattr = ndnfs_ll_setxattr;
+  fuse_op->getxattr = ndnfs_ll_getxattr;
+  fuse_op->removexattr = ndnfs_ll_removexattr;
+  fuse_op->open = ndnfs_ll_open;
+  fuse_op->read = ndnfs_ll_read;
+  fuse_op->opendir = ndnfs_ll_opendir;
+  fuse_op->readdir = ndnfs_ll_readdir;
+#ifdef NDNFS_FUSE3
+  fuse_op->readdirplus = ndnfs_ll_readdirplus;
+#endif
+  fuse_op->releasedir = ndnfs_ll_releasedir;
+  fuse_op->mknod = ndnfs_ll_mknod;
+  fuse_op->write = ndnfs_ll_write;
+#ifdef NDNFS_FUSE3
+  fuse_op->write_buf = ndnfs_ll_write_buf;
+#endif
+  fuse_op->flush = ndnfs_ll_flush;
+  fuse_op->release = ndnfs_ll_release;
+  fuse_op->unlink = ndnfs_ll_unlink;
+  fuse_op->mkdir = ndnfs_ll_mkdir;
+  fuse_op->rmdir = ndnfs_ll_rmdir;
+  fuse_op->statfs = ndnfs_ll_statfs;
+  fuse_op->access = ndnfs_ll_access;
+  fuse_op->link = ndnfs_ll_link;
+  fuse_op->readlink = ndnfs_ll_readlink;
+  fuse_op->symlink = ndnfs_ll_symlink;
+  fuse_op->rename = ndnfs_ll_rename;
+  fuse_op->init = ndnfs_init;
+  fuse_op->destroy = ndnfs_destroy;
+}
+
+static struct fuse_lowlevel_ops ndnfs_fs_ops;
 
 struct ndnfs_config
 {
   char *prefix;
   char *log_path;
   char *db_path;
+  unsigned long write_buffer;
+  int sign_threads;
+  int sign_queue;
+  char *sign_mode;
+  int seg_size;
+  unsigned long read_cache;
+  int readahead;
+  double entry_timeout;
+  double attr_timeout;
+  int writeback;
+  double negative_timeout;
+  char *seg_store;
+  char *chunking;
+  char *compress;
 };
 
 // offsetof 用来计算在某个类型里面某个成员的偏移量
@@ -194,6 +359,20 @@ static struct fuse_opt ndnfs_opts[] = {
     NDNFS_OPT("prefix=%s", prefix, 0),
     NDNFS_OPT("log=%s", log_path, 1),
     NDNFS_OPT("db=%s", db_path, 2),
+    NDNFS_OPT("write_buffer=%lu", write_buffer, 3),
+    NDNFS_OPT("sign_threads=%d", sign_threads, 4),
+    NDNFS_OPT("sign_queue=%d", sign_queue, 5),
+    NDNFS_OPT("sign_mode=%s", sign_mode, 6),
+    NDNFS_OPT("seg_size=%d", seg_size, 7),
+    NDNFS_OPT("read_cache=%lu", read_cache, 8),
+    NDNFS_OPT("readahead=%d", readahead, 9),
+    NDNFS_OPT("entry_timeout=%lf", entry_timeout, 10),
+    NDNFS_OPT("attr_timeout=%lf", attr_timeout, 11),
+    NDNFS_OPT("writeback=%d", writeback, 12),
+    NDNFS_OPT("negative_timeout=%lf", negative_timeout, 13),
+    NDNFS_OPT("seg_store=%s", seg_store, 14),
+    NDNFS_OPT("chunking=%s", chunking, 15),
+    NDNFS_OPT("compress=%s", compress, 16),
     FUSE_OPT_END};
 
 void abs_path(char *dest, const char *path)
@@ -205,7 +384,7 @@ void abs_path(char *dest, const char *path)
 // 用来提示用户应该如何正确启动 ndnfs
 void usage()
 {
-  cout << "Usage: ./ndnfs -s [actual folder directory (where files are stored in local file system)] [mount point directory] [-o prefix=\"prefix\"] [-o log=\"log file path\"] [-o db=\"database file path\"]" << endl;
+  cout << "Usage: ./ndnfs [-s] [actual folder directory (where files are stored in local file system)] [mount point directory] [-o prefix=\"prefix\"] [-o log=\"log file path\"] [-o db=\"database file path\"] [-o write_buffer=\"bytes buffered per open file\"] [-o sign_threads=\"number of signing threads\"] [-o sign_queue=\"versions waiting to be signed before writers block\"] [-o sign_mode=\"segment|manifest\"] [-o seg_size=\"segment size of new files in bytes\"] [-o read_cache=\"bytes of segments cached for reads\"] [-o readahead=\"segments prefetched past sequential reads, at most\"] [-o entry_timeout=\"seconds names are cached by the kernel\"] [-o attr_timeout=\"seconds attributes are cached by the kernel\"] [-o writeback=\"0|1, kernel write caching with FUSE 3\"] [-o negative_timeout=\"seconds names not found are cached by the kernel\"] [-o seg_store=\"db|extent\"] [-o chunking=\"fixed|cdc\"] [-o compress=\"none|zstd|wire\"]" << endl;
   return;
 }
 
@@ -214,16 +393,10 @@ int main(int argc, char **argv)
   umask(0); //用于给后续的创建文件和目录等操作以最大的权限。
 
   // Initialize the keychain
-  ndn::ptr_lib::shared_ptr<ndn::MemoryIdentityStorage> identityStorage(new ndn::MemoryIdentityStorage());
-  ndn::ptr_lib::shared_ptr<ndn::MemoryPrivateKeyStorage> privateKeyStorage(new ndn::MemoryPrivateKeyStorage());
-  ndnfs::keyChain.reset(new ndn::KeyChain(ndn::ptr_lib::make_shared<ndn::IdentityManager>(identityStorage, privateKeyStorage), ndn::ptr_lib::shared_ptr<ndn::NoVerifyPolicyManager>(new ndn::NoVerifyPolicyManager())));
+  ndnfs::keyChain = create_keychain();
 
   ndn::Name keyName("/testname/DSK-123");
   ndnfs::certificateName = keyName.getSubName(0, keyName.size() - 1).append("KEY").append(keyName.get(keyName.size() - 1)).append("ID-CERT").append("0");
-  identityStorage->addKey(keyName, ndn::KEY_TYPE_RSA, ndn::Blob(DEFAULT_RSA_PUBLIC_KEY_DER, sizeof(DEFAULT_RSA_PUBLIC_KEY_DER)));
-  privateKeyStorage->setKeyPairForKeyName(keyName, ndn::KEY_TYPE_RSA, DEFAULT_RSA_PUBLIC_KEY_DER,
-                                          sizeof(DEFAULT_RSA_PUBLIC_KEY_DER), DEFAULT_RSA_PRIVATE_KEY_DER,
-                                          sizeof(DEFAULT_RSA_PRIVATE_KEY_DER));
 
   cout << "NDNFS: version 0.3" << endl;
 
@@ -284,8 +457,38 @@ int main(int argc, char **argv)
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   struct ndnfs_config conf;
   memset(&conf, 0, sizeof(conf));
+  // 0 turns kernel caching off, so unset is told apart by a negative value
+  conf.entry_timeout = -1;
+  conf.attr_timeout = -1;
+  conf.writeback = -1;
+  conf.negative_timeout = -1;
   fuse_opt_parse(&args, &conf, ndnfs_opts, NULL);
 
+  // What is left is for FUSE: the mount point, -s, -f, -d and its own -o options
+#ifdef NDNFS_FUSE3
+  struct fuse_cmdline_opts cmdline;
+  memset(&cmdline, 0, sizeof(cmdline));
+  if (fuse_parse_cmdline(&args, &cmdline) != 0 || cmdline.mountpoint == NULL)
+  {
+    cerr << "Error: missing mount point." << endl;
+    usage();
+    return -1;
+  }
+  char *mountpoint = cmdline.mountpoint;
+  int multithreaded = !cmdline.singlethread;
+  int foreground = cmdline.foreground;
+#else
+  char *mountpoint = NULL;
+  int multithreaded = 0;
+  int foreground = 0;
+  if (fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1 || mountpoint == NULL)
+  {
+    cerr << "Error: missing mount point." << endl;
+    usage();
+    return -1;
+  }
+#endif
+
   if (conf.prefix != NULL)
   {
     ndn::Name interestBaseName(conf.prefix);
@@ -297,8 +500,126 @@ int main(int argc, char **argv)
     db_name = conf.db_path;
   }
 
+  if (conf.write_buffer != 0)
+  {
+    ndnfs::write_buffer_cap = conf.write_buffer;
+  }
+
+  if (conf.read_cache != 0)
+  {
+    ndnfs::read_cache_cap = conf.read_cache;
+  }
+
+  if (conf.readahead > 0)
+  {
+    ndnfs::readahead_max = conf.readahead;
+  }
+
+  if (conf.entry_timeout >= 0)
+  {
+    ndnfs::entry_timeout = conf.entry_timeout;
+  }
+
+  if (conf.attr_timeout >= 0)
+  {
+    ndnfs::attr_timeout = conf.attr_timeout;
+  }
+
+  if (conf.writeback >= 0)
+  {
+    ndnfs::writeback_cache = conf.writeback != 0;
+  }
+
+  if (conf.negative_timeout >= 0)
+  {
+    ndnfs::negative_timeout = conf.negative_timeout;
+  }
+
+  ndnfs::sign_threads = conf.sign_threads;
+  if (ndnfs::sign_threads <= 0)
+  {
+    ndnfs::sign_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (conf.sign_queue > 0)
+  {
+    ndnfs::sign_queue_depth = conf.sign_queue;
+  }
+
+  if (conf.sign_mode != NULL)
+  {
+    if (strcmp(conf.sign_mode, "manifest") == 0)
+    {
+      ndnfs::manifest_signing = true;
+    }
+    else if (strcmp(conf.sign_mode, "segment") != 0)
+    {
+      cerr << "Error: unknown sign_mode " << conf.sign_mode << ", expecting segment or manifest." << endl;
+      return -1;
+    }
+  }
+
+  if (conf.seg_store != NULL)
+  {
+    if (strcmp(conf.seg_store, "extent") == 0)
+    {
+      ndnfs::extent_segments = true;
+    }
+    else if (strcmp(conf.seg_store, "db") != 0)
+    {
+      cerr << "Error: unknown seg_store " << conf.seg_store << ", expecting db or extent." << endl;
+      return -1;
+    }
+  }
+
+  if (conf.chunking != NULL)
+  {
+    if (strcmp(conf.chunking, "cdc") == 0)
+    {
+      ndnfs::cdc_chunking = true;
+    }
+    else if (strcmp(conf.chunking, "fixed") != 0)
+    {
+      cerr << "Error: unknown chunking " << conf.chunking << ", expecting fixed or cdc." << endl;
+      return -1;
+    }
+  }
+
+  if (conf.compress != NULL)
+  {
+    if (strcmp(conf.compress, "zstd") == 0)
+    {
+      ndnfs::compress_segments = true;
+    }
+    else if (strcmp(conf.compress, "wire") == 0)
+    {
+      ndnfs::compress_segments = true;
+      ndnfs::wire_compression = true;
+    }
+    else if (strcmp(conf.compress, "none") != 0)
+    {
+      cerr << "Error: unknown compress " << conf.compress << ", expecting none, zstd or wire." << endl;
+      return -1;
+    }
+  }
+
+  if (conf.seg_size != 0)
+  {
+    if (conf.seg_size < ndnfs::min_seg_size || conf.seg_size > ndnfs::max_seg_size)
+    {
+      cerr << "Error: seg_size " << conf.seg_size << " out of range [" << ndnfs::min_seg_size << ", " << ndnfs::max_seg_size << "]." << endl;
+      return -1;
+    }
+    ndnfs::seg_size = conf.seg_size;
+  }
+
   cout << "NDNFS: prefix " << ndnfs::global_prefix << endl;
   cout << "NDNFS: database file " << db_name << endl;
+  cout << "NDNFS: sign mode " << (ndnfs::manifest_signing ? "manifest" : "segment") << endl;
+  cout << "NDNFS: segment size " << ndnfs::seg_size << endl;
+  cout << "NDNFS: chunking " << (ndnfs::cdc_chunking ? "cdc" : "fixed") << endl;
+  cout << "NDNFS: compression " << (ndnfs::wire_compression ? "zstd, also on the wire" : ndnfs::compress_segments ? "zstd" : "none") << endl;
+  cout << "NDNFS: segment store " << (ndnfs::extent_segments ? string(db_name) + ".extents" : "db") << endl;
 
   Log<Output2FILE>::reportingLevel() = LOG_DEBUG;
   if (conf.log_path != NULL)
@@ -321,72 +642,26 @@ int main(int argc, char **argv)
 
   FILE_LOG(LOG_DEBUG) << "main: global prefix is " << ndnfs::global_prefix << endl;
 
-  if (sqlite3_open(db_name, &db) == SQLITE_OK)
+  ndnfs::connection_pool = new ConnectionPool(db_name);
+  if (db != NULL)
   {
     FILE_LOG(LOG_DEBUG) << "main: sqlite db open ok" << endl;
   }
   else
   {
     FILE_LOG(LOG_DEBUG) << "main: cannot connect to sqlite db, quit" << endl;
-    sqlite3_close(db);
+    delete ndnfs::connection_pool;
     return -1;
   }
 
-  // Init tables in database
-  const char *INIT_FS_TABLE = "\
-CREATE TABLE IF NOT EXISTS                        \n\
-  file_system(                                    \n\
-    path                 TEXT NOT NULL,           \n\
-    current_version      INTEGER,                 \n\
-    mime_type            TEXT,                    \n\
-    ready_signed         INTEGER,                 \n\
-    type                 INTEGER,                 \n\
-    mode                 INTEGER,                 \n\
-    atime                INTEGER,                 \n\    
-    nlink                INTEGER,                 \n\
-    size                 INTEGER,                 \n\    
-    level                INTEGER,                 \n\ 
-    PRIMARY KEY (path)                            \n\
-  );                                              \n\
-CREATE INDEX id_path ON file_system (path);       \n\
-CREATE INDEX id_parent ON file_system (parent);   \n\
-";
-
-  sqlite3_exec(db, INIT_FS_TABLE, NULL, NULL, NULL);
-
-  // In our new implementation, we store the latest version of the file, and version history in database,
-  // and when opening with write permission, nothing is copied, and there's no notion of a temp_version while writing.
-  //
-  // TODO: figure out how multiple write access is handled by system calls.
-  const char *INIT_VER_TABLE = "\
-CREATE TABLE IF NOT EXISTS                                   \n\
-  file_versions(                                             \n\
-    path          TEXT NOT NULL,                             \n\
-    version       INTEGER,                                   \n\
-    size          INTEGER,                                   \n\
-    PRIMARY KEY (path, version)                              \n\
-  );                                                         \n\
-CREATE INDEX id_ver ON file_versions (path, version);        \n\
-";
-
-  sqlite3_exec(db, INIT_VER_TABLE, NULL, NULL, NULL);
-
-  // Segment table still stores the version, and does not assume that the signature
-  // always belong to the latest version.
-  const char *INIT_SEG_TABLE = "\
-CREATE TABLE IF NOT EXISTS                                       \n\
-  file_segments(                                                 \n\
-    path        TEXT NOT NULL,                                   \n\
-    version     INTEGER,                                         \n\
-    segment     INTEGER,                                         \n\
-    signature   BLOB NOT NULL,                                   \n\
-    content     BLOB,                                            \n\  
-    PRIMARY KEY (path, version, segment)                         \n\
-  );                                                             \n\
-CREATE INDEX id_seg ON file_segments (path, version, segment);   \n\
-";
-
-  sqlite3_exec(db, INIT_SEG_TABLE, NULL, NULL, NULL);
+  // Init tables in database, or move those of an earlier ndnfs over
+  if (init_schema(db) < 0)
+  {
+    FILE_LOG(LOG_DEBUG) << "main: cannot set up tables in sqlite db, quit" << endl;
+    db.release();
+    delete ndnfs::connection_pool;
+    return -1;
+  }
 
   FILE_LOG(LOG_DEBUG) << "main: table creation ok" << endl;
 
@@ -397,10 +672,62 @@ CREATE INDEX id_seg ON file_segments (path, version, segment);   \n\
 
   create_fuse_operations(&ndnfs_fs_ops);
 
-  cout<< "NDNFS: Build root directory..."<<endl;
-  const char *MAKE_ROOT_DIR ="INSERT INTO file_system (path, current_version, mime_type, ready_signed, type, level) VALUES('/', 0, '', 0, 8, 0);";
-  sqlite3_exec(db, MAKE_ROOT_DIR, NULL, NULL, NULL);
+  // Temp versions belong to the handles that wrote them, and none survive an unmount
+  cleartemp_segments();
+  clear_unlinked();
+
+  // No connection is carried across the fork fuse_daemonize makes;
+  // FUSE threads open theirs on first use
+  db.release();
+  ndnfs::connection_pool->closeIdle();
 
-  cout << "NDNFS: enter FUSE main loop. Log written to " << ndnfs::logging_path << endl;
-  return fuse_main(args.argc, args.argv, &ndnfs_fs_ops, NULL);
+  int ret = -1;
+#ifdef NDNFS_FUSE3
+  struct fuse_session *se = fuse_session_new(&args, &ndnfs_fs_ops, sizeof(ndnfs_fs_ops), NULL);
+  if (se != NULL)
+  {
+    if (fuse_set_signal_handlers(se) == 0)
+    {
+      if (fuse_session_mount(se, mountpoint) == 0)
+      {
+        cout << "NDNFS: enter FUSE main loop. Log written to " << ndnfs::logging_path << endl;
+        fuse_daemonize(foreground);
+        ret = multithreaded ? fuse_session_loop_mt(se, cmdline.clone_fd) : fuse_session_loop(se);
+        fuse_session_unmount(se);
+      }
+      fuse_remove_signal_handlers(se);
+    }
+    // Calls ndnfs_destroy
+    fuse_session_destroy(se);
+  }
+#else
+  struct fuse_chan *ch = fuse_mount(mountpoint, &args);
+  if (ch != NULL)
+  {
+    struct fuse_session *se = fuse_lowlevel_new(&args, &ndnfs_fs_ops, sizeof(ndnfs_fs_ops), NULL);
+    if (se != NULL)
+    {
+      if (fuse_set_signal_handlers(se) != -1)
+      {
+        fuse_session_add_chan(se, ch);
+        cout << "NDNFS: enter FUSE main loop. Log written to " << ndnfs::logging_path << endl;
+        fuse_daemonize(foreground);
+        ret = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+        fuse_remove_signal_handlers(se);
+        fuse_session_remove_chan(ch);
+      }
+      // Calls ndnfs_destroy
+      fuse_session_destroy(se);
+    }
+    fuse_unmount(mountpoint, ch);
+  }
+#endif
+  free(mountpoint);
+  fuse_opt_free_args(&args);
+
+  // The main thread serves requests itself in single-threaded mode
+  db.release();
+  delete ndnfs::connection_pool;
+  ndnfs::connection_pool = NULL;
+  return ret;
 }
@@ -39,8 +39,14 @@
 
 #include <pthread.h>
 
+#include "config.h"
+
+#ifdef NDNFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#endif
+#include <fuse_lowlevel.h>
 #include <sqlite3.h>
 
 #include <ndn-cpp/security/key-chain.hpp>
@@ -49,11 +55,13 @@
 #include <ndn-cpp/security/policy/no-verify-policy-manager.hpp>
 #include <ndn-cpp/name.hpp>
 
-#include "config.h"
 #include "logger.h"
+#include "statement-cache.h"
+#include "connection-pool.h"
 
 extern const char *db_name;
-extern sqlite3 *db;
+// Connection of the calling FUSE thread, checked out of ndnfs::connection_pool
+extern thread_local ThreadConnection db;
 
 namespace ndnfs {
     extern ndn::Name certificateName;
@@ -64,8 +72,20 @@ namespace ndnfs {
 
     extern const int version_type;
     extern const int segment_type;
-    extern const int seg_size;
-    extern const int seg_size_shift;
+    extern int seg_size;
+    extern const int min_seg_size;
+    extern const int max_seg_size;
+    extern bool cdc_chunking;
+
+    extern size_t write_buffer_cap;
+
+    extern double entry_timeout;
+    extern double attr_timeout;
+    extern double negative_timeout;
+    extern bool writeback_cache;
+
+    extern int sign_threads;
+    extern bool manifest_signing;
 
     extern int user_id;
     extern int group_id;
@@ -87,4 +107,6 @@ inline int split_last_component(const std::string &path, std::string &prefix, st
 
 void abs_path(char *dest, const char *path);
 
+ndn::ptr_lib::shared_ptr<ndn::KeyChain> create_keychain();
+
 #endif
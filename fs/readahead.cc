@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "readahead.h"
+#include "segment-cache.h"
+#include "extent-store.h"
+#include "compression.h"
+
+using namespace std;
+
+// Requests queued at most; a reader that got this far ahead of the thread has moved on
+static const size_t max_requests = 16;
+
+Readahead::Readahead(const char *db_path)
+  : dbPath_(db_path), db_(NULL), stop_(false), requested_(0), dropped_(0), fetched_(0)
+{
+  if (sqlite3_open(dbPath_.c_str(), &db_) != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "Readahead: cannot connect to sqlite db " << dbPath_ << endl;
+    return;
+  }
+  sqlite3_busy_timeout(db_, 10000);
+
+  thread_ = thread(&Readahead::run, this);
+}
+
+Readahead::~Readahead()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+  drop_statement_cache(db_);
+  sqlite3_close(db_);
+}
+
+void Readahead::request(sqlite3_int64 ino, int ver, int first, int last)
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    if (requests_.size() >= max_requests)
+    {
+      requests_.pop_front();
+      dropped_++;
+    }
+    Request request = {ino, ver, first, last};
+    requests_.push_back(request);
+    requested_++;
+  }
+  work_.notify_one();
+}
+
+void Readahead::run()
+{
+  while (true)
+  {
+    Request request;
+    {
+      unique_lock<mutex> lock(mutex_);
+      work_.wait(lock, [this] { return stop_ || !requests_.empty(); });
+      if (stop_)
+        return;
+      request = requests_.front();
+      requests_.pop_front();
+    }
+    fetch(request);
+  }
+}
+
+void Readahead::fetch(const Request &request)
+{
+  // Skip what is cached already, e.g. segments the reader caught up with
+  int first = request.first;
+  while (first <= request.last && ndnfs::segment_cache->contains(request.ino, request.version, first))
+    first++;
+  if (first > request.last)
+    return;
+
+  CachedStatement stmt;
+  stmt.prepare(db_, "SELECT segment, content, extent, extent_offset, stored_size, encoding, size FROM segment_content WHERE ino = ? AND version = ? AND segment BETWEEN ? AND ? ORDER BY segment;");
+  sqlite3_bind_int64(stmt, 1, request.ino);
+  sqlite3_bind_int(stmt, 2, request.version);
+  sqlite3_bind_int(stmt, 3, first);
+  sqlite3_bind_int(stmt, 4, request.last);
+  unsigned long fetched = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    int seg = sqlite3_column_int(stmt, 0);
+    if (ndnfs::segment_cache->contains(request.ino, request.version, seg))
+      continue;
+    shared_ptr<string> content = make_shared<string>();
+    if (read_content(ndnfs::extent_store, stmt, 1, *content) < 0)
+      break;
+    ndnfs::segment_cache->insert(request.ino, request.version, seg, content);
+    fetched++;
+  }
+  stmt.finalize();
+
+  lock_guard<mutex> lock(mutex_);
+  fetched_ += fetched;
+}
+
+void Readahead::report(ostream &os) const
+{
+  lock_guard<mutex> lock(mutex_);
+  os << "requests " << requested_ << endl
+     << "dropped " << dropped_ << endl
+     << "prefetched " << fetched_ << endl;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_READAHEAD_H
+#define NDNFS_READAHEAD_H
+
+#include "ndnfs.h"
+
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ostream>
+
+/**
+ * Readahead prefetches segments into the segment cache on a background thread, with its
+ * own db connection, so that a sequential reader finds the segments after what it just
+ * read already in memory. ndnfs_read decides what is worth prefetching; request() only
+ * queues it. Requests pile up only while the thread is behind, in which case the oldest,
+ * which the reader has most likely passed already, are dropped.
+ */
+class Readahead
+{
+public:
+  Readahead(const char *db_path);
+
+  ~Readahead();
+
+  /**
+   * Queue segments first to last of a version for prefetching.
+   */
+  void
+  request(sqlite3_int64 ino, int ver, int first, int last);
+
+  void
+  report(std::ostream &os) const;
+
+private:
+  struct Request
+  {
+    sqlite3_int64 ino;
+    int version;
+    int first;
+    int last;
+  };
+
+  void
+  run();
+
+  void
+  fetch(const Request &request);
+
+  std::string dbPath_;
+  sqlite3 *db_;
+
+  std::thread thread_;
+  mutable std::mutex mutex_;
+  std::condition_variable work_;
+  bool stop_;
+  std::deque<Request> requests_;
+
+  unsigned long requested_;
+  unsigned long dropped_;
+  unsigned long fetched_;
+};
+
+namespace ndnfs {
+    extern int readahead_max;
+    extern Readahead *readahead;
+}
+
+#endif
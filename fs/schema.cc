@@ -0,0 +1,435 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "schema.h"
+#include "dentry.h"
+
+#include <vector>
+
+using namespace std;
+
+// Layout created by init_schema. Version 0 keyed every table by the full path, version 1
+// kept all segment content in file_segments, version 2 did not share it between files,
+// version 3 only had segments of fixed size, version 4 did not compress them, and version 5
+// had no modification time apart from the current version.
+static const int schema_version = 6;
+
+// Files and directories, keyed by inode number; see dentry.h. nlink is no longer kept up:
+// link counts come from file_entries, and open handles are counted in memory. mtime is set
+// by utimens only; it is NULL while the current version is the modification time.
+static const char *INIT_FS_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  file_system(                                                   \n\
+    ino                  INTEGER PRIMARY KEY,                    \n\
+    current_version      INTEGER,                                \n\
+    mime_type            TEXT,                                   \n\
+    ready_signed         INTEGER,                                \n\
+    type                 INTEGER,                                \n\
+    mode                 INTEGER,                                \n\
+    atime                INTEGER,                                \n\
+    nlink                INTEGER,                                \n\
+    size                 INTEGER,                                \n\
+    signed_version       INTEGER,                                \n\
+    seg_size             INTEGER,                                \n\
+    mtime                INTEGER                                 \n\
+  );                                                             \n\
+";
+
+// Names of the files and directories in each directory. Listing a directory is a range
+// scan of its entries; finding the name of an inode goes through id_entry_ino.
+static const char *INIT_ENTRY_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  file_entries(                                                  \n\
+    parent      INTEGER NOT NULL,                                \n\
+    name        TEXT NOT NULL,                                   \n\
+    ino         INTEGER NOT NULL,                                \n\
+    PRIMARY KEY (parent, name)                                   \n\
+  ) WITHOUT ROWID;                                               \n\
+CREATE INDEX IF NOT EXISTS id_entry_ino ON file_entries (ino);   \n\
+";
+
+// In our new implementation, we store the latest version of the file, and version history in database,
+// and when opening with write permission, nothing is copied, and there's no notion of a temp_version while writing.
+// A version with an encoding is signed and published as its segments are stored (compression.h).
+static const char *INIT_VER_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  file_versions(                                                 \n\
+    ino           INTEGER NOT NULL,                              \n\
+    version       INTEGER,                                       \n\
+    size          INTEGER,                                       \n\
+    manifest      INTEGER,                                       \n\
+    encoding      INTEGER,                                       \n\
+    PRIMARY KEY (ino, version)                                   \n\
+  );                                                             \n\
+";
+
+// Segment table still stores the version, and does not assume that the signature
+// always belong to the latest version. Segments written but not committed yet live
+// under the negated inode, in the temp version of the handle that wrote them.
+static const char *INIT_SEG_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  file_segments(                                                 \n\
+    ino         INTEGER NOT NULL,                                \n\
+    version     INTEGER,                                         \n\
+    segment     INTEGER,                                         \n\
+    signature   BLOB NOT NULL,                                   \n\
+    content     BLOB,                                            \n\
+    origin      INTEGER,                                         \n\
+    extent      INTEGER,                                         \n\
+    extent_offset INTEGER,                                       \n\
+    extent_length INTEGER,                                       \n\
+    blob_id     INTEGER,                                         \n\
+    seg_offset  INTEGER,                                         \n\
+    PRIMARY KEY (ino, version, segment)                          \n\
+  );                                                             \n\
+";
+
+// Segments of a version cut by content (chunker.h) vary in size, and know where they start in
+// seg_offset; it is NULL for segments of the file's seg_size, which start at segment * seg_size.
+static const char *INIT_SEG_OFFSET_INDEX = "\
+CREATE INDEX IF NOT EXISTS                                       \n\
+  id_segment_offset ON file_segments (ino, version, seg_offset); \n\
+";
+
+// Committed segment content, stored once per SHA-256 digest however many files and versions
+// have it. refs counts the file_segments rows pointing at a blob in blob_id, and is kept up
+// by the triggers below, so every way a segment row goes away (remove_version, unlink, rmdir,
+// rename over a file) lets go of its blob. A blob with an encoding holds its content compressed
+// (compression.h), and length bytes once decoded; a blob whose encoding is 0 did not compress.
+static const char *INIT_BLOB_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  segment_blobs(                                                 \n\
+    id          INTEGER PRIMARY KEY,                             \n\
+    digest      BLOB NOT NULL UNIQUE,                            \n\
+    refs        INTEGER NOT NULL,                                \n\
+    content     BLOB,                                            \n\
+    extent      INTEGER,                                         \n\
+    extent_offset INTEGER,                                       \n\
+    extent_length INTEGER,                                       \n\
+    encoding    INTEGER,                                         \n\
+    length      INTEGER                                          \n\
+  );                                                             \n\
+";
+
+static const char *INIT_BLOB_TRIGGERS = "\
+CREATE TRIGGER IF NOT EXISTS                                     \n\
+  segment_blob_ref AFTER INSERT ON file_segments                 \n\
+  WHEN new.blob_id IS NOT NULL                                   \n\
+BEGIN                                                            \n\
+  UPDATE segment_blobs SET refs = refs + 1 WHERE id = new.blob_id; \n\
+END;                                                             \n\
+CREATE TRIGGER IF NOT EXISTS                                     \n\
+  segment_blob_move AFTER UPDATE OF blob_id ON file_segments     \n\
+  WHEN old.blob_id IS NOT new.blob_id                            \n\
+BEGIN                                                            \n\
+  UPDATE segment_blobs SET refs = refs + 1 WHERE id = new.blob_id; \n\
+  UPDATE segment_blobs SET refs = refs - 1 WHERE id = old.blob_id; \n\
+  DELETE FROM segment_blobs WHERE id = old.blob_id AND refs = 0; \n\
+END;                                                             \n\
+CREATE TRIGGER IF NOT EXISTS                                     \n\
+  segment_blob_unref AFTER DELETE ON file_segments               \n\
+  WHEN old.blob_id IS NOT NULL                                   \n\
+BEGIN                                                            \n\
+  UPDATE segment_blobs SET refs = refs - 1 WHERE id = old.blob_id; \n\
+  DELETE FROM segment_blobs WHERE id = old.blob_id AND refs = 0; \n\
+END;                                                             \n\
+";
+
+// A segment shared with an earlier version has no content of its own, but the version
+// whose row holds it in origin. A row holds its content either in content, at extent_offset
+// of an extent file (extent-store.h), or in the segment_blobs row of blob_id; only one of the
+// rows joined here has it. Everything that reads segment content goes through this view: size
+// is the length of the content, and stored_size the bytes stored, compressed when encoding is
+// set (compression.h), which only blobs are.
+static const char *INIT_SEG_VIEW = "\
+CREATE VIEW IF NOT EXISTS                                        \n\
+  segment_content AS                                             \n\
+  SELECT s.ino AS ino, s.version AS version,                     \n\
+         s.segment AS segment, s.signature AS signature,         \n\
+         s.seg_offset AS seg_offset,                             \n\
+         COALESCE(s.content, o.content, b.content) AS content,   \n\
+         COALESCE(s.extent, o.extent, b.extent) AS extent,       \n\
+         COALESCE(s.extent_offset, o.extent_offset,              \n\
+                  b.extent_offset) AS extent_offset,             \n\
+         COALESCE(length(s.content), s.extent_length,            \n\
+                  length(o.content), o.extent_length,            \n\
+                  length(b.content), b.extent_length) AS stored_size, \n\
+         NULLIF(b.encoding, 0) AS encoding,                      \n\
+         COALESCE(length(s.content), s.extent_length,            \n\
+                  length(o.content), o.extent_length, b.length,  \n\
+                  length(b.content), b.extent_length) AS size    \n\
+  FROM file_segments s LEFT JOIN file_segments o                 \n\
+    ON o.ino = s.ino AND o.version = s.origin                    \n\
+   AND o.segment = s.segment                                     \n\
+  LEFT JOIN segment_blobs b ON b.id = COALESCE(s.blob_id, o.blob_id); \n\
+";
+
+// Versions committed by release and truncate wait here until the sign queue has signed them.
+// Rows survive a restart, so unsigned versions are picked up again on the next mount.
+static const char *INIT_SIGN_QUEUE_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  sign_queue(                                                    \n\
+    ino         INTEGER NOT NULL,                                \n\
+    version     INTEGER,                                         \n\
+    PRIMARY KEY (ino, version)                                   \n\
+  );                                                             \n\
+";
+
+// Versions signed in manifest mode keep their manifest here, as Data packets ready to be sent
+static const char *INIT_MANIFEST_TABLE = "\
+CREATE TABLE IF NOT EXISTS                                       \n\
+  file_manifests(                                                \n\
+    ino         INTEGER NOT NULL,                                \n\
+    version     INTEGER,                                         \n\
+    segment     INTEGER,                                         \n\
+    data        BLOB NOT NULL,                                   \n\
+    PRIMARY KEY (ino, version, segment)                          \n\
+  );                                                             \n\
+";
+
+static int exec(sqlite3 *conn, const char *sql)
+{
+  char *err = NULL;
+  int res = sqlite3_exec(conn, sql, NULL, NULL, &err);
+  if (res != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "init_schema: " << (err != NULL ? err : "error") << " in " << sql << endl;
+    sqlite3_free(err);
+  }
+  return res;
+}
+
+static int user_version(sqlite3 *conn)
+{
+  int version = 0;
+  CachedStatement stmt;
+  stmt.prepare(conn, "PRAGMA user_version;");
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    version = sqlite3_column_int(stmt, 0);
+  stmt.finalize();
+  return version;
+}
+
+static bool has_table(sqlite3 *conn, const char *name)
+{
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = ?;");
+  sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+  bool found = sqlite3_step(stmt) == SQLITE_ROW;
+  stmt.finalize();
+  return found;
+}
+
+/*
+ * Give a path-keyed database every column and table the last path-keyed ndnfs had,
+ * the root directory rowid 1, and every entry the rowid of its directory in parent_id.
+ * Statements fail harmlessly for what is there already.
+ */
+static void update_path_schema(sqlite3 *conn)
+{
+  sqlite3_exec(conn, "ALTER TABLE file_system ADD COLUMN signed_version INTEGER;", NULL, NULL, NULL);
+  // Files created before segment size was configurable were all cut into 8192 bytes
+  sqlite3_exec(conn, "ALTER TABLE file_system ADD COLUMN seg_size INTEGER;", NULL, NULL, NULL);
+  sqlite3_exec(conn, "UPDATE file_system SET seg_size = 8192 WHERE seg_size IS NULL AND type != 8;", NULL, NULL, NULL);
+  sqlite3_exec(conn, "ALTER TABLE file_system ADD COLUMN parent_id INTEGER;", NULL, NULL, NULL);
+  sqlite3_exec(conn, "CREATE TABLE IF NOT EXISTS file_versions (path TEXT NOT NULL, version INTEGER, size INTEGER, PRIMARY KEY (path, version));", NULL, NULL, NULL);
+  sqlite3_exec(conn, "ALTER TABLE file_versions ADD COLUMN manifest INTEGER;", NULL, NULL, NULL);
+  sqlite3_exec(conn, "CREATE TABLE IF NOT EXISTS file_segments (path TEXT NOT NULL, version INTEGER, segment INTEGER, signature BLOB NOT NULL, content BLOB, PRIMARY KEY (path, version, segment));", NULL, NULL, NULL);
+  sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN origin INTEGER;", NULL, NULL, NULL);
+  sqlite3_exec(conn, "CREATE TABLE IF NOT EXISTS sign_queue (path TEXT NOT NULL, version INTEGER, PRIMARY KEY (path, version));", NULL, NULL, NULL);
+  sqlite3_exec(conn, "CREATE TABLE IF NOT EXISTS file_manifests (path TEXT NOT NULL, version INTEGER, segment INTEGER, data BLOB NOT NULL, PRIMARY KEY (path, version, segment));", NULL, NULL, NULL);
+
+  sqlite3_exec(conn, "INSERT OR IGNORE INTO file_system (path, current_version, mime_type, ready_signed, type) VALUES('/', 0, '', 0, 8);", NULL, NULL, NULL);
+  sqlite3_exec(conn, "UPDATE file_system SET rowid = (SELECT MAX(rowid) + 1 FROM file_system) WHERE rowid = 1 AND path != '/';", NULL, NULL, NULL);
+  sqlite3_exec(conn, "UPDATE file_system SET rowid = 1 WHERE path = '/' AND rowid != 1;", NULL, NULL, NULL);
+  if (sqlite3_changes(conn) > 0)
+  {
+    // Rowids moved, and parent_id of whatever pointed at them with them
+    sqlite3_exec(conn, "UPDATE file_system SET parent_id = NULL;", NULL, NULL, NULL);
+  }
+
+  vector<pair<sqlite3_int64, string> > orphans;
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT rowid, path FROM file_system WHERE parent_id IS NULL AND path != '/';");
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    orphans.push_back(make_pair(sqlite3_column_int64(stmt, 0), string((const char *)sqlite3_column_text(stmt, 1))));
+  stmt.finalize();
+
+  for (size_t i = 0; i < orphans.size(); i++)
+  {
+    string dir_path, name;
+    split_last_component(orphans[i].second, dir_path, name);
+    stmt.prepare(conn, "UPDATE file_system SET parent_id = (SELECT rowid FROM file_system WHERE path = ?) WHERE rowid = ?;");
+    sqlite3_bind_text(stmt, 1, dir_path.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int64(stmt, 2, orphans[i].first);
+    sqlite3_step(stmt);
+    stmt.finalize();
+  }
+}
+
+/*
+ * Move a path-keyed database over to inodes. The rowid of a file_system row becomes
+ * its inode, as it already was its inode number towards the kernel, and every row
+ * of the other tables is keyed by the inode of its path. Segments of temp versions
+ * are not carried over, they are cleared at mount anyway.
+ */
+static int migrate_from_paths(sqlite3 *conn)
+{
+  FILE_LOG(LOG_DEBUG) << "init_schema: moving path-keyed tables over to inodes" << endl;
+  cout << "NDNFS: Moving database over to inode-keyed tables..." << endl;
+
+  if (exec(conn, "BEGIN IMMEDIATE TRANSACTION;") != SQLITE_OK)
+    return -1;
+  update_path_schema(conn);
+
+  const char *MIGRATE = "\
+DROP VIEW IF EXISTS segment_content;                                                           \n\
+ALTER TABLE file_system RENAME TO file_system_v0;                                              \n\
+ALTER TABLE file_versions RENAME TO file_versions_v0;                                          \n\
+ALTER TABLE file_segments RENAME TO file_segments_v0;                                          \n\
+ALTER TABLE sign_queue RENAME TO sign_queue_v0;                                                \n\
+ALTER TABLE file_manifests RENAME TO file_manifests_v0;                                        \n\
+";
+  int res = exec(conn, MIGRATE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_FS_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_ENTRY_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_VER_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SEG_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SIGN_QUEUE_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_MANIFEST_TABLE);
+
+  // The name of an entry is what its path has past the path of its directory
+  const char *COPY = "\
+INSERT INTO file_system (ino, current_version, mime_type, ready_signed, type, mode, atime,      \n\
+                         nlink, size, signed_version, seg_size)                                \n\
+  SELECT rowid, current_version, mime_type, ready_signed, type, mode, atime,                   \n\
+         nlink, size, signed_version, seg_size FROM file_system_v0;                            \n\
+INSERT INTO file_entries (parent, name, ino)                                                   \n\
+  SELECT p.rowid, substr(c.path, length(p.path) + CASE WHEN p.path = '/' THEN 1 ELSE 2 END),   \n\
+         c.rowid                                                                               \n\
+  FROM file_system_v0 c JOIN file_system_v0 p ON p.rowid = c.parent_id                         \n\
+  WHERE c.path != '/';                                                                         \n\
+INSERT INTO file_versions (ino, version, size, manifest)                                       \n\
+  SELECT f.rowid, v.version, v.size, v.manifest                                                \n\
+  FROM file_versions_v0 v JOIN file_system_v0 f ON f.path = v.path;                            \n\
+INSERT INTO file_segments (ino, version, segment, signature, content, origin)                  \n\
+  SELECT f.rowid, s.version, s.segment, s.signature, s.content, s.origin                       \n\
+  FROM file_segments_v0 s JOIN file_system_v0 f ON f.path = s.path;                            \n\
+INSERT INTO sign_queue (ino, version)                                                          \n\
+  SELECT f.rowid, q.version                                                                    \n\
+  FROM sign_queue_v0 q JOIN file_system_v0 f ON f.path = q.path ORDER BY q.rowid;              \n\
+INSERT INTO file_manifests (ino, version, segment, data)                                       \n\
+  SELECT f.rowid, m.version, m.segment, m.data                                                 \n\
+  FROM file_manifests_v0 m JOIN file_system_v0 f ON f.path = m.path;                           \n\
+DROP TABLE file_system_v0;                                                                     \n\
+DROP TABLE file_versions_v0;                                                                   \n\
+DROP TABLE file_segments_v0;                                                                   \n\
+DROP TABLE sign_queue_v0;                                                                      \n\
+DROP TABLE file_manifests_v0;                                                                  \n\
+PRAGMA user_version = 1;                                                                       \n\
+";
+  if (res == SQLITE_OK)
+    res = exec(conn, COPY);
+
+  if (res != SQLITE_OK)
+  {
+    sqlite3_exec(conn, "ROLLBACK;", NULL, NULL, NULL);
+    return -1;
+  }
+  exec(conn, "COMMIT;");
+  // Hand back the space every segment row spent on its path
+  exec(conn, "VACUUM;");
+  return 0;
+}
+
+int init_schema(sqlite3 *conn)
+{
+  int version = user_version(conn);
+  if (version > schema_version)
+  {
+    FILE_LOG(LOG_ERROR) << "init_schema: database has layout " << version << ", newer than this ndnfs" << endl;
+    return -1;
+  }
+  if (version == 0 && has_table(conn, "file_system") && migrate_from_paths(conn) < 0)
+    return -1;
+  if (version < 2 && has_table(conn, "file_segments"))
+  {
+    // Layout 2 lets a segment keep its content in an extent file, and the view picks that up
+    sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN extent INTEGER;", NULL, NULL, NULL);
+    sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN extent_offset INTEGER;", NULL, NULL, NULL);
+    sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN extent_length INTEGER;", NULL, NULL, NULL);
+    exec(conn, "DROP VIEW IF EXISTS segment_content;");
+  }
+  if (version < 3 && has_table(conn, "file_segments"))
+  {
+    // Layout 3 shares committed content through segment_blobs; content already stored stays in its row
+    sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN blob_id INTEGER;", NULL, NULL, NULL);
+    exec(conn, "DROP VIEW IF EXISTS segment_content;");
+  }
+  if (version < 4 && has_table(conn, "file_segments"))
+  {
+    // Layout 4 has segments cut by content, which start at seg_offset
+    sqlite3_exec(conn, "ALTER TABLE file_segments ADD COLUMN seg_offset INTEGER;", NULL, NULL, NULL);
+    exec(conn, "DROP VIEW IF EXISTS segment_content;");
+  }
+  if (version < 5 && has_table(conn, "file_segments"))
+  {
+    // Layout 5 has blobs stored compressed, and versions published that way; nothing stored is
+    sqlite3_exec(conn, "ALTER TABLE segment_blobs ADD COLUMN encoding INTEGER;", NULL, NULL, NULL);
+    sqlite3_exec(conn, "ALTER TABLE segment_blobs ADD COLUMN length INTEGER;", NULL, NULL, NULL);
+    sqlite3_exec(conn, "ALTER TABLE file_versions ADD COLUMN encoding INTEGER;", NULL, NULL, NULL);
+    exec(conn, "DROP VIEW IF EXISTS segment_content;");
+  }
+  if (version < 6 && has_table(conn, "file_system"))
+  {
+    // Layout 6 keeps modification times set by utimens
+    sqlite3_exec(conn, "ALTER TABLE file_system ADD COLUMN mtime INTEGER;", NULL, NULL, NULL);
+  }
+
+  int res = exec(conn, INIT_FS_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_ENTRY_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_VER_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SEG_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SEG_OFFSET_INDEX);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_BLOB_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_BLOB_TRIGGERS);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SEG_VIEW);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_SIGN_QUEUE_TABLE);
+  if (res == SQLITE_OK)
+    res = exec(conn, INIT_MANIFEST_TABLE);
+  if (res != SQLITE_OK)
+    return -1;
+  exec(conn, "PRAGMA user_version = 6;");
+
+  // The kernel knows the root as FUSE_ROOT_ID
+  sqlite3_exec(conn, "INSERT OR IGNORE INTO file_system (ino, current_version, mime_type, ready_signed, type) VALUES (1, 0, '', 0, 8);", NULL, NULL, NULL);
+  return 0;
+}
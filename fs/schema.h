@@ -0,0 +1,31 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_SCHEMA_H
+#define NDNFS_SCHEMA_H
+
+#include "ndnfs.h"
+
+/**
+ * Create the tables ndnfs keeps its files in, or bring those of a database made by an
+ * earlier ndnfs up to date; PRAGMA user_version tells which layout a database has.
+ * The root directory is created if missing.
+ * @return 0, or -1 if the database cannot be used
+ */
+int init_schema(sqlite3 *conn);
+
+#endif
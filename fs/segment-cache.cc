@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "segment-cache.h"
+
+#include <climits>
+
+using namespace std;
+
+bool SegmentCache::Key::operator<(const Key &other) const
+{
+  if (ino != other.ino)
+    return ino < other.ino;
+  if (version != other.version)
+    return version < other.version;
+  return segment < other.segment;
+}
+
+SegmentCache::SegmentCache(size_t capacity)
+  : capacity_(capacity), bytes_(0), hits_(0), misses_(0), evictions_(0)
+{
+}
+
+SegmentCache::Content SegmentCache::find(sqlite3_int64 ino, int ver, int seg)
+{
+  lock_guard<mutex> lock(mutex_);
+  Key key = {ino, ver, seg};
+  map<Key, list<Entry>::iterator>::iterator it = index_.find(key);
+  if (it == index_.end())
+  {
+    misses_++;
+    return Content();
+  }
+
+  hits_++;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->content;
+}
+
+bool SegmentCache::contains(sqlite3_int64 ino, int ver, int seg) const
+{
+  lock_guard<mutex> lock(mutex_);
+  Key key = {ino, ver, seg};
+  return index_.find(key) != index_.end();
+}
+
+void SegmentCache::insert(sqlite3_int64 ino, int ver, int seg, const Content &content)
+{
+  if (content->size() > capacity_)
+    return;
+
+  lock_guard<mutex> lock(mutex_);
+  Key key = {ino, ver, seg};
+  map<Key, list<Entry>::iterator>::iterator it = index_.find(key);
+  if (it != index_.end())
+    erase(it);
+
+  while (bytes_ + content->size() > capacity_ && !lru_.empty())
+  {
+    erase(index_.find(lru_.back().key));
+    evictions_++;
+  }
+
+  Entry entry = {key, content};
+  lru_.push_front(entry);
+  index_[key] = lru_.begin();
+  bytes_ += content->size();
+}
+
+void SegmentCache::forget(sqlite3_int64 ino)
+{
+  lock_guard<mutex> lock(mutex_);
+  Key first = {ino, INT_MIN, INT_MIN};
+  map<Key, list<Entry>::iterator>::iterator it = index_.lower_bound(first);
+  while (it != index_.end() && it->first.ino == ino)
+    erase(it++);
+}
+
+void SegmentCache::erase(map<Key, list<Entry>::iterator>::iterator it)
+{
+  bytes_ -= it->second->content->size();
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+void SegmentCache::report(ostream &os) const
+{
+  lock_guard<mutex> lock(mutex_);
+  os << "hits " << hits_ << endl
+     << "misses " << misses_ << endl
+     << "evictions " << evictions_ << endl
+     << "segments " << lru_.size() << endl
+     << "bytes " << bytes_ << endl
+     << "capacity " << capacity_ << endl;
+}
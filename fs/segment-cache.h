@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_SEGMENT_CACHE_H
+#define NDNFS_SEGMENT_CACHE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <ostream>
+
+#include <sqlite3.h>
+
+/**
+ * SegmentCache keeps the content of recently read or written segments in memory, up to
+ * a number of bytes, and evicts the least recently used segment first. Entries are keyed
+ * by (inode, version, segment); committed versions never change, so an entry stays valid
+ * until the file itself goes away (unlink, truncate), which forget() handles.
+ * The cache is shared by the FUSE thread and the readahead thread.
+ */
+class SegmentCache
+{
+public:
+  SegmentCache(size_t capacity);
+
+  typedef std::shared_ptr<const std::string> Content;
+
+  /**
+   * @return the cached content, or an empty pointer on a miss
+   */
+  Content
+  find(sqlite3_int64 ino, int ver, int seg);
+
+  /**
+   * Like find, without counting a hit or a miss.
+   */
+  bool
+  contains(sqlite3_int64 ino, int ver, int seg) const;
+
+  void
+  insert(sqlite3_int64 ino, int ver, int seg, const Content &content);
+
+  /**
+   * Drop every cached segment of an inode, of any version.
+   */
+  void
+  forget(sqlite3_int64 ino);
+
+  /**
+   * Write the hit, miss and eviction counters, and how much is cached.
+   */
+  void
+  report(std::ostream &os) const;
+
+private:
+  struct Key
+  {
+    sqlite3_int64 ino;
+    int version;
+    int segment;
+
+    bool
+    operator<(const Key &other) const;
+  };
+
+  struct Entry
+  {
+    Key key;
+    Content content;
+  };
+
+  void
+  erase(std::map<Key, std::list<Entry>::iterator>::iterator it);
+
+  mutable std::mutex mutex_;
+  size_t capacity_;
+  size_t bytes_;
+  // most recently used first
+  std::list<Entry> lru_;
+  std::map<Key, std::list<Entry>::iterator> index_;
+
+  unsigned long hits_;
+  unsigned long misses_;
+  unsigned long evictions_;
+};
+
+namespace ndnfs {
+    extern size_t read_cache_cap;
+    extern SegmentCache *segment_cache;
+}
+
+#endif
@@ -20,7 +20,18 @@
  */
 
 #include "segment.h"
+#include "file-type.h"
 #include "signature-states.h"
+#include "sign-pool.h"
+#include "sign-queue.h"
+#include "file-lock.h"
+#include "attribute.h"
+#include "extent-store.h"
+#include "manifest.h"
+#include "chunker.h"
+#include "compression.h"
+#include "segment-cache.h"
+#include "file.h"
 
 #include <ndn-cpp/data.hpp>
 #include <ndn-cpp/common.hpp>
@@ -28,6 +39,11 @@
 
 #include <iostream>
 #include <cstdio>
+#include <map>
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <atomic>
 
 #define INT2STRLEN 100
 
@@ -35,13 +51,10 @@ using namespace std;
 using namespace ndn;
 
 /**
- * version parameter is not used right now, as duplicate_version is now a stub, 
- * and write does not create/write to a new file by the name of the version.
+ * NDN name of a file, i.e. the global prefix followed by its path.
  */
-int sign_segment(const char *path, int ver, int seg, const char *data, int len)
+Name file_name(const char *path)
 {
-  FILE_LOG(LOG_DEBUG) << "sign_segment: path=" << path << std::dec << ", ver=" << ver << ", seg=" << seg << ", len=" << len << endl;
-
   string file_path(path);
   string full_name = ndnfs::global_prefix + file_path;
   // We want the Name(uri) constructor to split the path into components between "/", but we first need
@@ -57,8 +70,76 @@ int sign_segment(const char *path, int ver, int seg, const char *data, int len)
       break;
     escapedString.replace(found, 3, "/");
   }
-  Name seg_name(escapedString);
+  return Name(escapedString);
+}
+
+int file_seg_size(sqlite3 *conn, sqlite3_int64 ino)
+{
+  int seg_size = ndnfs::seg_size;
+  CachedStatement stmt;
+  stmt.prepare(conn, "SELECT seg_size FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+    seg_size = sqlite3_column_int(stmt, 0);
+  stmt.finalize();
+  return seg_size;
+}
+
+int set_seg_size(sqlite3_int64 ino, int seg_size)
+{
+  FILE_LOG(LOG_DEBUG) << "set_seg_size: ino=" << ino << std::dec << ", seg_size=" << seg_size << endl;
+  // No release may commit the first content of the file between the checks and the update
+  FileLock lock(ino);
+
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT type FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  if (sqlite3_step(stmt) != SQLITE_ROW)
+  {
+    stmt.finalize();
+    return -ENOENT;
+  }
+  bool is_dir = sqlite3_column_int(stmt, 0) == DIRECTORY;
+  stmt.finalize();
+
+  if (seg_size == 0 ? !is_dir : (seg_size < ndnfs::min_seg_size || seg_size > ndnfs::max_seg_size))
+    return -EINVAL;
+
+  if (!is_dir)
+  {
+    // Existing versions, and the temp version of an open writer, are cut into the old size
+    if (writer_open(ino))
+      return -EBUSY;
+
+    stmt.prepare(db, "SELECT 1 FROM file_segments WHERE ino IN (?, ?) LIMIT 1;");
+    sqlite3_bind_int64(stmt, 1, ino);
+    sqlite3_bind_int64(stmt, 2, temp_ino(ino));
+    int res = sqlite3_step(stmt);
+    stmt.finalize();
+    if (res == SQLITE_ROW)
+      return -EBUSY;
+  }
+
+  stmt.prepare(db, "UPDATE file_system SET seg_size = ? WHERE ino = ?;");
+  if (seg_size == 0)
+    sqlite3_bind_null(stmt, 1);
+  else
+    sqlite3_bind_int(stmt, 1, seg_size);
+  sqlite3_bind_int64(stmt, 2, ino);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  // Gives st_blksize
+  refresh_attr(ino);
+  return res == SQLITE_DONE ? 0 : -EIO;
+}
 
+/**
+ * Build the Data packet of a segment and return its signature;
+ * instead of putting the whole content object into sqlite, we store only the signature field.
+ */
+Blob sign_content(KeyChain &keyChain, const char *path, int ver, int seg, const char *data, int len)
+{
+  Name seg_name = file_name(path);
   seg_name.appendVersion(ver);
   seg_name.appendSegment(seg);
   FILE_LOG(LOG_DEBUG) << "sign_segment: segment name is " << seg_name.toUri() << endl;
@@ -66,244 +147,303 @@ int sign_segment(const char *path, int ver, int seg, const char *data, int len)
   Data data0;
   data0.setName(seg_name);
   data0.setContent((const uint8_t *)data, len);
-  // instead of putting the whole content object into sqlite, we put only the signature field.
-
-  // FILE_LOG(LOG_DEBUG)<<"THIS IS GOING TO DETECT "<< seg_name<< "    "<< data<<endl;
-
-  ndnfs::keyChain->sign(data0, ndnfs::certificateName);
-  Blob signature = data0.getSignature()->getSignature();
 
-  const char *sig_raw = (const char *)signature.buf();
-  int sig_size = signature.size();
+  keyChain.sign(data0, ndnfs::certificateName);
+  return data0.getSignature()->getSignature();
+}
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO file_segments (signature ,path, version, segment, content) VALUES (?, ?, ?, ?, ?);", -1, &stmt, 0);
-  // sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  // sqlite3_bind_int(stmt, 2, ver);
-  // sqlite3_bind_int(stmt, 3, seg);
-  sqlite3_bind_blob(stmt, 1, sig_raw, sig_size, SQLITE_STATIC);
-  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 3, ver);
-  sqlite3_bind_int(stmt, 4, seg);
-  sqlite3_bind_blob(stmt, 5, data, len, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res != SQLITE_OK)
+/**
+ * Bind segment content to the content, extent, extent_offset and extent_length parameters
+ * col to col + 3 of stmt: into the row itself, or, with ndnfs::extent_segments, appended
+ * to the extent store with the row pointing at it.
+ * @return 0, or negative errno if the append fails
+ */
+static int bind_payload(sqlite3_stmt *stmt, int col, const char *data, int len)
+{
+  if (!ndnfs::extent_segments)
   {
-    // FILE_LOG(LOG_DEBUG) << "WHY????" << endl;
+    sqlite3_bind_blob(stmt, col, data, len, SQLITE_STATIC);
+    sqlite3_bind_null(stmt, col + 1);
+    sqlite3_bind_null(stmt, col + 2);
+    sqlite3_bind_null(stmt, col + 3);
+    return 0;
   }
-  sqlite3_finalize(stmt);
 
-  // change ready_signed to ready;
-  sqlite3_prepare_v2(db, "UPDATE file_system SET ready_signed = ? WHERE path = ? AND current_version = ? ;", -1, &stmt, 0);
-  enum SignatureState signatureState = READY;
-  sqlite3_bind_int(stmt, 1, signatureState);
-  sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 3, ver);
-  res = sqlite3_step(stmt);
-  return sig_size;
+  int extent;
+  off_t offset;
+  int ret = ndnfs::extent_store->append(data, len, extent, offset);
+  if (ret < 0)
+    return ret;
+  sqlite3_bind_null(stmt, col);
+  sqlite3_bind_int(stmt, col + 1, extent);
+  sqlite3_bind_int64(stmt, col + 2, offset);
+  sqlite3_bind_int(stmt, col + 3, len);
+  return 0;
 }
 
-void remove_segments(const char *path, const int ver, const int start /* = 0 */)
+/**
+ * Sign every segment of a committed version in place, on the given connection. Segments are
+ * read in batches with a range scan, signed by the pool without holding any database lock,
+ * and their signatures written back in one short transaction per batch.
+ * @return number of segments signed, or negative errno on failure
+ */
+int sign_version(sqlite3 *conn, sqlite3_int64 ino, const char *path, int ver)
 {
-  FILE_LOG(LOG_DEBUG) << "remove_segments: path=" << path << std::dec << ", ver=" << ver << ", starting from segment #" << start << endl;
-  /*
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db, "SELECT totalSegments FROM file_versions WHERE path = ? AND version = ?;", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, ver);
-    int res = sqlite3_step(stmt);
-    if (res != SQLITE_ROW) {
-        sqlite3_finalize(stmt);
-        return;
-    }
-    int segs = sqlite3_column_int(stmt, 0);
-    sqlite3_finalize(stmt);
-
-    for (int i = start; i < segs; i++) {
-        sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path = ? AND version = ? AND segment = ?;", -1, &stmt, 0);
-        sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-        sqlite3_bind_int(stmt, 2, ver);
-        sqlite3_bind_int(stmt, 3, i);
-        sqlite3_step(stmt);
-        sqlite3_finalize(stmt);
-    }
-  */
-}
+  FILE_LOG(LOG_DEBUG) << "sign_version: path=" << path << std::dec << ", ver=" << ver << endl;
 
-// truncate is not tested in current implementation
-void truncate_segment(const char *path, const int ver, const int seg, const off_t length)
-{
-  FILE_LOG(LOG_DEBUG) << "truncate_segment: path=" << path << std::dec << ", ver=" << ver << ", seg=" << seg << ", length=" << length << endl;
+  // A version published compressed is signed as its segments are stored (compression.h)
+  CachedStatement select_stmt;
+  select_stmt.prepare(conn, "SELECT encoding FROM file_versions WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(select_stmt, 1, ino);
+  sqlite3_bind_int(select_stmt, 2, ver);
+  bool encoded = sqlite3_step(select_stmt) == SQLITE_ROW && sqlite3_column_int(select_stmt, 0) != PLAIN_SEGMENT;
+  select_stmt.finalize();
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_segments WHERE path = ? AND version = ? AND segment = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, ver);
-  sqlite3_bind_int(stmt, 3, seg);
+  select_stmt.prepare(conn, "SELECT segment, content, extent, extent_offset, stored_size, encoding, size FROM segment_content WHERE ino = ? AND version = ? AND segment > ? ORDER BY segment LIMIT ?;");
 
-  if (sqlite3_step(stmt) == SQLITE_ROW)
+  CachedStatement update_stmt;
+  update_stmt.prepare(conn, "UPDATE file_segments SET signature = ? WHERE ino = ? AND version = ? AND segment = ?;");
+
+  // Segments are signed by the pool in batches, which bounds the content held in memory for large files
+  size_t batch_size = ndnfs::sign_pool->size() * 16;
+  vector<SignJob> jobs;
+  jobs.reserve(batch_size);
+
+  int count = 0;
+  int last_seg = -1;
+  int res = SQLITE_DONE;
+  do
   {
-    if (length == 0)
+    jobs.clear();
+    sqlite3_bind_int64(select_stmt, 1, ino);
+    sqlite3_bind_int(select_stmt, 2, ver);
+    sqlite3_bind_int(select_stmt, 3, last_seg);
+    sqlite3_bind_int(select_stmt, 4, batch_size);
+    while (sqlite3_step(select_stmt) == SQLITE_ROW)
     {
-      sqlite3_finalize(stmt);
-      sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path = ? AND version = ? AND segment = ?;", -1, &stmt, 0);
-      sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 2, ver);
-      sqlite3_bind_int(stmt, 3, seg);
-      sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
-    }
-    else
-    {
-      // the file is already truncated, so we only update the signature here.
-      char fullPath[PATH_MAX];
-      abs_path(fullPath, path);
-      int fd = open(fullPath, O_RDONLY);
-      if (fd == -1)
+      SignJob job;
+      job.seg = sqlite3_column_int(select_stmt, 0);
+      if (read_content(ndnfs::extent_store, select_stmt, 1, job.content, !encoded) < 0)
       {
-        FILE_LOG(LOG_ERROR) << "truncate_segment: open error. Errno: " << errno << endl;
-        return;
-      }
-
-      char *data = new char[ndnfs::seg_size];
-      int read_len = pread(fd, data, length, segment_to_size(seg));
-      if (read_len < 0)
-      {
-        FILE_LOG(LOG_ERROR) << "truncate_segment: write error. Errno: " << errno << endl;
-        return;
+        res = SQLITE_IOERR;
+        break;
       }
+      jobs.push_back(job);
+    }
+    sqlite3_reset(select_stmt);
+    if (res != SQLITE_DONE || jobs.empty())
+      break;
+    last_seg = jobs.back().seg;
 
-      string file_path(path);
-      string full_name = ndnfs::global_prefix + file_path;
-      // We want the Name(uri) constructor to split the path into components between "/", but we first need
-      // to escape the characters in full_name which the Name(uri) constructor will unescape.  So, create a component
-      // from the raw string and use its toEscapedString.
+    ndnfs::sign_pool->sign(path, ver, jobs);
 
-      string escapedString = Name::Component((uint8_t *)&full_name[0], full_name.size()).toEscapedString();
-      // The "/" was escaped, so unescape.
-      while (1)
+    sqlite3_exec(conn, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+      sqlite3_bind_blob(update_stmt, 1, jobs[i].signature.buf(), jobs[i].signature.size(), SQLITE_STATIC);
+      sqlite3_bind_int64(update_stmt, 2, ino);
+      sqlite3_bind_int(update_stmt, 3, ver);
+      sqlite3_bind_int(update_stmt, 4, jobs[i].seg);
+      res = sqlite3_step(update_stmt);
+      sqlite3_reset(update_stmt);
+      if (res != SQLITE_DONE)
       {
-        size_t found = escapedString.find("%2F");
-        if (found == string::npos)
-          break;
-        escapedString.replace(found, 3, "/");
+        FILE_LOG(LOG_ERROR) << "sign_version: update error. path:" << path << " seg:" << jobs[i].seg << " res:" << res << endl;
+        break;
       }
-      Name seg_name(escapedString);
-
-      seg_name.appendVersion(ver);
-      seg_name.appendSegment(seg);
+      count++;
+    }
+    sqlite3_exec(conn, res == SQLITE_DONE ? "COMMIT;" : "ROLLBACK;", NULL, NULL, NULL);
+  } while (res == SQLITE_DONE && jobs.size() == batch_size);
 
-      Data trunc_data;
-      trunc_data.setContent((const uint8_t *)data, length);
+  select_stmt.finalize();
+  update_stmt.finalize();
+  if (res != SQLITE_DONE)
+    return -EIO;
+  return count;
+}
 
-      ndnfs::keyChain->sign(trunc_data, ndnfs::certificateName);
-      Blob signature = trunc_data.getSignature()->getSignature();
+void remove_segments(sqlite3_int64 ino, const int ver, const int start /* = 0 */)
+{
+  FILE_LOG(LOG_DEBUG) << "remove_segments: ino=" << ino << std::dec << ", ver=" << ver << ", starting from segment #" << start << endl;
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_segments WHERE ino = ? AND version = ? AND segment >= ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int(stmt, 3, start);
+  sqlite3_step(stmt);
+  stmt.finalize();
+}
 
-      const char *sig_raw = (const char *)signature.buf();
-      int sig_size = signature.size();
+// Give to_ver a row for every segment of from_ver before segment cut, see share_segments
+static int share_segments_below(sqlite3_int64 ino, int from_ver, int to_ver, int cut)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "INSERT INTO file_segments (ino, version, segment, signature, origin, blob_id, seg_offset) \
+                          SELECT ino, ?, segment, 'NONE', CASE WHEN blob_id IS NULL THEN COALESCE(origin, version) END, blob_id, seg_offset \
+                          FROM file_segments WHERE ino = ? AND version = ? AND segment < ?;");
+  sqlite3_bind_int(stmt, 1, to_ver);
+  sqlite3_bind_int64(stmt, 2, ino);
+  sqlite3_bind_int(stmt, 3, from_ver);
+  sqlite3_bind_int(stmt, 4, cut);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "share_segments_below: insert error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
+  }
+  return 0;
+}
 
-      sqlite3_finalize(stmt);
-      sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO file_segments (path,version,segment,signature) VALUES (?,?,?,?);", -1, &stmt, 0);
-      sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 2, ver);
-      sqlite3_bind_int(stmt, 3, seg);
-      sqlite3_bind_blob(stmt, 4, sig_raw, sig_size, SQLITE_STATIC);
-      sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
+/**
+ * Make version new_ver of ino the first length bytes of version ver: the segments that end
+ * before length are shared with ver, as share_segments does, and the one length falls in is
+ * stored again, cut short. The caller commits new_ver, in the same transaction.
+ * @return 0, or negative errno on failure
+ */
+int truncate_all_segment(sqlite3_int64 ino, int ver, int new_ver, off_t length)
+{
+  FILE_LOG(LOG_DEBUG) << "truncate_all_segment: ino=" << ino << std::dec << ", ver=" << ver << ", new ver=" << new_ver << ", length=" << length << endl;
 
-      delete data;
-      close(fd);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT segment, content, extent, extent_offset, stored_size, encoding, size, seg_offset FROM segment_content WHERE ino = ? AND version = ? ORDER BY segment;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  // start is where the segment starts, whether the version was cut by size or by content
+  off_t start = 0;
+  int cut = INT_MAX;
+  string content;
+  bool has_offset = false;
+  sqlite3_int64 seg_offset = 0;
+  int ret = 0;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    int size = sqlite3_column_int(stmt, 6);
+    if (start + size <= length)
+    {
+      start += size;
+      continue;
     }
+    cut = sqlite3_column_int(stmt, 0);
+    if (start < length)
+    {
+      ret = read_content(ndnfs::extent_store, stmt, 1, content);
+      content.resize(length - start);
+      has_offset = sqlite3_column_type(stmt, 7) != SQLITE_NULL;
+      seg_offset = sqlite3_column_int64(stmt, 7);
+    }
+    break;
+  }
+  stmt.finalize();
+  if (ret < 0)
+    return ret;
+
+  if (share_segments_below(ino, ver, new_ver, cut) < 0)
+    return -EIO;
+  if (content.empty())
+    return 0;
+
+  stmt.prepare(db, "INSERT INTO file_segments (content, extent, extent_offset, extent_length, ino, segment, version, seg_offset, signature) VALUES (?, ?, ?, ?, ?, ?, ?, ?, 'NONE');");
+  ret = bind_payload(stmt, 1, content.data(), content.size());
+  if (ret < 0)
+  {
+    stmt.finalize();
+    return ret;
+  }
+  sqlite3_bind_int64(stmt, 5, ino);
+  sqlite3_bind_int(stmt, 6, cut);
+  sqlite3_bind_int(stmt, 7, new_ver);
+  if (has_offset)
+    sqlite3_bind_int64(stmt, 8, seg_offset);
+  else
+    sqlite3_bind_null(stmt, 8);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "truncate_all_segment: insert segment error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
   }
+  return 0;
 }
 
-int truncate_all_segment(const char *path, const int ver, const off_t length)
+/**
+ * Make new_ver out of ver zero-extended to length: every segment of ver is shared, the last
+ * one is padded to a whole segment, and zero segments follow up to length. A version cut by
+ * content keeps its chunks as they are, and the zero segments are placed by offset after them.
+ * @return 0, or negative errno on failure
+ */
+int extend_all_segment(sqlite3_int64 ino, int ver, int new_ver, off_t length, int seg_size)
 {
-  FILE_LOG(LOG_DEBUG) << "truncate_all_segment: path=" << path << std::dec << ", ver=" << ver << ", length=" << length << endl;
+  FILE_LOG(LOG_DEBUG) << "extend_all_segment: ino=" << ino << std::dec << ", ver=" << ver << ", new ver=" << new_ver << ", length=" << length << endl;
+  if (share_segments(ino, ver, new_ver) < 0)
+    return -EIO;
 
-  sqlite3_stmt *stmt_main;
-  sqlite3_prepare_v2(db, "SELECT * FROM file_segments WHERE path = ? AND version = ?;", -1, &stmt_main, 0);
-  sqlite3_bind_text(stmt_main, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt_main, 2, ver);
-  int seg = -1;
-  int res;
-  int length_curr = 0;
-  bool flag_over = false;
-  int curr_ver = time(0);
-
-  while (sqlite3_step(stmt_main) == SQLITE_ROW)
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT segment, content, extent, extent_offset, stored_size, encoding, size, seg_offset FROM segment_content WHERE ino = ? AND version = ? ORDER BY segment DESC LIMIT 1;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  int seg = 0;
+  off_t end = 0;
+  bool chunked = false;
+  string content;
+  int ret = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
   {
-    seg++;
-    if (length == 0 || flag_over)
+    int last = sqlite3_column_int(stmt, 0);
+    off_t size = sqlite3_column_int64(stmt, 6);
+    chunked = sqlite3_column_type(stmt, 7) != SQLITE_NULL;
+    off_t start = chunked ? sqlite3_column_int64(stmt, 7) : segment_to_size(last, seg_size);
+    end = start + size;
+    seg = last + 1;
+    // The segments of a version cut by size all start at a multiple of seg_size
+    if (!chunked && size < seg_size)
     {
-      sqlite3_stmt *stmt;
-      sqlite3_prepare_v2(db, "UPDATE file_system SET current_version = ? WHERE path = ?;", -1, &stmt, 0);
-      sqlite3_bind_int(stmt, 1, curr_ver); // set current_version to the current timestamp
-      sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-      res = sqlite3_step(stmt);
-      if (res != SQLITE_OK && res != SQLITE_DONE)
-      {
-        FILE_LOG(LOG_ERROR) << "truncate all segment: update file_system error. " << res << endl;
-        return res;
-      }
-      sqlite3_finalize(stmt);
-      FILE_LOG(LOG_DEBUG) << "here:" << curr_ver << endl;
-      return 0;
-      // sqlite3_stmt *stmt;
-      // sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path = ? AND version = ? AND segment = ?;", -1, &stmt, 0);
-      // sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-      // sqlite3_bind_int(stmt, 2, ver);
-      // sqlite3_bind_int(stmt, 3, seg);
-      // sqlite3_step(stmt);
-      // sqlite3_finalize(stmt);
-    }
-    else
-    {
-      int size = sqlite3_column_bytes(stmt_main, 4);
-      char data[size];
-      int len_use = 0;
-      if ((long) size < (length - (seg * ndnfs::seg_size)))
-      {
-        len_use = size;
-      }
-      else
-      {
-        len_use = (length - (seg * ndnfs::seg_size));
-        flag_over = true;
-      }
-      length_curr += len_use;
-      memmove(data, (char *)sqlite3_column_blob(stmt_main, 4), len_use);
-      sqlite3_stmt *stmt;
-      // sqlite3_prepare_v2(db, "IPDATE file_segments SET content = ? WHERE path = ? AND segment = ? and version = ?;", -1, &stmt, 0);
-      sqlite3_prepare_v2(db, "INSERT INTO file_segments (content, path, segment, version, signature) VALUES (?, ?, ?, ?, 'NONE');", -1, &stmt, 0);
-      sqlite3_bind_blob(stmt, 1, data, len_use, SQLITE_STATIC);
-      sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-      sqlite3_bind_int(stmt, 3, seg);
-      sqlite3_bind_int(stmt, 4, curr_ver);
-      res = sqlite3_step(stmt);
-      sqlite3_finalize(stmt);
-      FILE_LOG(LOG_DEBUG)<< "len_use"<<len_use<< " min" << length - (seg * ndnfs::seg_size)<< endl;
-      if (length_curr > length)
-        break;
-      // sign_segment(path, ver, seg, data, len_use);
+      ret = read_content(ndnfs::extent_store, stmt, 1, content);
+      content.resize(min((off_t)seg_size, length - start), '\0');
+      end = start + content.size();
+      seg = last;
     }
   }
-  if (flag_over)
+  stmt.finalize();
+  if (ret < 0)
+    return ret;
+
+  stmt.prepare(db, "INSERT OR REPLACE INTO file_segments (content, extent, extent_offset, extent_length, ino, segment, version, seg_offset, signature) VALUES (?, ?, ?, ?, ?, ?, ?, ?, 'NONE');");
+  // The padded last segment first, if any, then zeros; dedup_version stores those once
+  if (content.empty())
+    content.assign(min((off_t)seg_size, length - end), '\0');
+  else
+    end = segment_to_size(seg, seg_size);
+  int res = SQLITE_DONE;
+  while (end < length && res == SQLITE_DONE)
   {
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(db, "UPDATE file_system SET current_version = ? WHERE path = ?;", -1, &stmt, 0);
-    sqlite3_bind_int(stmt, 1, curr_ver); // set current_version to the current timestamp
-    sqlite3_bind_text(stmt, 2, path, -1, SQLITE_STATIC);
-    res = sqlite3_step(stmt);
-    if (res != SQLITE_OK && res != SQLITE_DONE)
+    if (bind_payload(stmt, 1, content.data(), content.size()) < 0)
     {
-      FILE_LOG(LOG_ERROR) << "truncate all segment: update file_system error. " << res << endl;
-      return res;
+      stmt.finalize();
+      return -EIO;
     }
-    sqlite3_finalize(stmt);
-    FILE_LOG(LOG_DEBUG) << "here:" << curr_ver << endl;
-    return 0;
+    sqlite3_bind_int64(stmt, 5, ino);
+    sqlite3_bind_int(stmt, 6, seg);
+    sqlite3_bind_int(stmt, 7, new_ver);
+    if (chunked)
+      sqlite3_bind_int64(stmt, 8, end);
+    else
+      sqlite3_bind_null(stmt, 8);
+    res = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    end += content.size();
+    seg++;
+    content.assign(min((off_t)seg_size, length - end), '\0');
+  }
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "extend_all_segment: insert segment error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
   }
+  return 0;
 }
 
 // int truncate_all_segment(const char *path, const int ver, const off_t length)
@@ -456,153 +596,632 @@ int truncate_all_segment(const char *path, const int ver, const off_t length)
 // }
 
 
-int addtemp_segment(const char *path, const char *buf, size_t size, off_t offset) {
-    FILE_LOG(LOG_DEBUG) << "addtemp_segment path=" << path << " buf=" << buf << " size=" << size << " offset" << offset
-                        << endl;
-    sqlite3_stmt *stmt;
-    char buf_seg[ndnfs::seg_size];
-    int seg_size = ndnfs::seg_size;
-    int seg = offset / (seg_size); // current segment
-    int seg_curr = 0;
-    int size_curr = 0;
-    int len_use = 0;
-    bool isempty = false;
-    // Add ".segtemp" after path to indicate this is a temp version
-    char temp_char[9] = ".segtemp";
-    char path_temp[strlen(path) + strlen(temp_char) + 1];
-    strcpy(path_temp, path);
-    strcat(path_temp, temp_char);
-    // Get file current size
-    sqlite3_prepare_v2(db,
-                       "SELECT length(content), segment FROM file_segments WHERE path = ? AND segment = (SELECT MAX(segment) FROM file_segments WHERE path = ?);",
-                       -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path_temp, -1, SQLITE_STATIC);
-    sqlite3_bind_text(stmt, 2, path_temp, -1, SQLITE_STATIC);
-    int res = sqlite3_step(stmt);
-    if(res == SQLITE_ROW) {
-      int size_last = sqlite3_column_int(stmt, 0);
-      seg_curr = sqlite3_column_int(stmt, 1);
-      sqlite3_finalize(stmt);
-      size_curr = seg_curr * seg_size + size_last;
-      if (offset > size_curr) {
-          FILE_LOG(LOG_ERROR) << "Offset is bigger than the file orignal size!" << endl;
-          return -errno;
+// Size in bytes of a version as stored in db, where its last segment ends
+static off_t extent_segment(sqlite3_int64 ino, int ver, int seg_size)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT COALESCE(seg_offset, segment * ?) + size FROM segment_content WHERE ino = ? AND version = ? ORDER BY segment DESC LIMIT 1;");
+  sqlite3_bind_int(stmt, 1, seg_size);
+  sqlite3_bind_int64(stmt, 2, ino);
+  sqlite3_bind_int(stmt, 3, ver);
+  off_t size = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    size = sqlite3_column_int64(stmt, 0);
+  }
+  stmt.finalize();
+  return size;
+}
+
+bool version_chunked(sqlite3_int64 ino, int ver)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT 1 FROM file_segments WHERE ino = ? AND version = ? AND seg_offset IS NOT NULL LIMIT 1;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  bool chunked = sqlite3_step(stmt) == SQLITE_ROW;
+  stmt.finalize();
+  return chunked;
+}
+
+/**
+ * Copy size bytes at offset of a committed version into buf, finding the segments that hold
+ * them by where they start, so this works whatever the version was cut into. Segments are
+ * read through the segment cache.
+ * @return bytes copied, which stop at the end of the version, or negative errno on failure
+ */
+int read_range(sqlite3_int64 ino, int ver, off_t offset, size_t size, char *buf)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT segment, seg_offset, content, extent, extent_offset, stored_size, encoding, size FROM segment_content \
+                    WHERE ino = ? AND version = ? AND segment >= \
+                      (SELECT segment FROM file_segments WHERE ino = ? AND version = ? AND seg_offset <= ? ORDER BY seg_offset DESC LIMIT 1) \
+                    ORDER BY segment;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int64(stmt, 3, ino);
+  sqlite3_bind_int(stmt, 4, ver);
+  sqlite3_bind_int64(stmt, 5, offset);
+
+  size_t len = 0;
+  int res = SQLITE_DONE;
+  while (len < size && (res = sqlite3_step(stmt)) == SQLITE_ROW)
+  {
+    int seg = sqlite3_column_int(stmt, 0);
+    off_t seg_offset = sqlite3_column_int64(stmt, 1);
+    // A missing segment ends the read, as the end of file does
+    if (seg_offset > offset + (off_t)len)
+      break;
+
+    SegmentCache::Content content = ndnfs::segment_cache->find(ino, ver, seg);
+    if (!content)
+    {
+      shared_ptr<string> loaded = make_shared<string>();
+      if (read_content(ndnfs::extent_store, stmt, 2, *loaded) < 0)
+      {
+        res = SQLITE_IOERR;
+        break;
       }
-    } else {
-      sqlite3_finalize(stmt);
-      isempty = true;
+      ndnfs::segment_cache->insert(ino, ver, seg, loaded);
+      content = loaded;
     }
 
-    while (len_use < size) {
-        if (seg <= seg_curr && !isempty) {
-            sqlite3_prepare_v2(db, "SELECT content FROM file_segments WHERE path = ? AND segment =  ?;", -1, &stmt, 0);
-            sqlite3_bind_text(stmt, 1, path_temp, -1, SQLITE_STATIC);
-            sqlite3_bind_int(stmt, 2, seg);
-            int res = sqlite3_step(stmt);
-            if (res == SQLITE_ROW) {
-                int originlen = sqlite3_column_bytes(stmt, 0);
-                memset(buf_seg, '\0', seg_size);
-                memcpy(buf_seg, (char *) sqlite3_column_blob(stmt, 0), originlen);
-                int offset_remain = offset - (seg * seg_size);
-                if (offset_remain < 0)
-                    offset_remain = 0;
-                int seg_use = min((int) (size - len_use), seg_size - offset_remain);
-                memcpy(buf_seg + offset_remain, buf + len_use, seg_use);
-                sqlite3_prepare_v2(db,
-                                   "UPDATE file_segments SET content = ? WHERE path = ? AND segment = ? and version = 100000;",
-                                   -1, &stmt, 0);
-                sqlite3_bind_blob(stmt, 1, buf_seg, max(offset_remain + seg_use, originlen), SQLITE_STATIC);
-                sqlite3_bind_text(stmt, 2, path_temp, -1, SQLITE_STATIC);
-                sqlite3_bind_int(stmt, 3, seg);
-                res = sqlite3_step(stmt);
-                sqlite3_finalize(stmt);
-                len_use += seg_use;
-                seg++;
-            } else {
-                sqlite3_finalize(stmt);
-            }
-        } else {
-            memset(buf_seg, '\0', seg_size);
-            int seg_use = min(seg_size, (int) (size - len_use));
-            memcpy(buf_seg, buf + len_use, seg_use);
-            sqlite3_prepare_v2(db,
-                               "INSERT OR REPLACE INTO file_segments (path,version,segment, signature, content) VALUES (?,100000,?,'NONE', ?);",
-                               -1, &stmt, 0);
-            sqlite3_bind_text(stmt, 1, path_temp, -1, SQLITE_STATIC);
-            sqlite3_bind_int(stmt, 2, seg);
-            sqlite3_bind_blob(stmt, 3, buf_seg, seg_use,
-                              SQLITE_STATIC);
-            int res = sqlite3_step(stmt);
-            sqlite3_finalize(stmt);
-            len_use += seg_use;
-            seg++;
-        }
-    }
+    size_t content_offset = offset + len - seg_offset;
+    if (content_offset >= content->size())
+      break;
+    size_t copy_len = min(content->size() - content_offset, size - len);
+    memcpy(buf + len, content->data() + content_offset, copy_len);
+    len += copy_len;
+  }
+  stmt.finalize();
+
+  if (res != SQLITE_ROW && res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "read_range: error " << res << ". ino:" << ino << " ver:" << ver << endl;
+    return -EIO;
+  }
+  return len;
+}
+
+// Temp versions count up from here, one per handle opened for writing since mount
+static atomic<int> next_temp_version(100000);
+
+int new_temp_version()
+{
+  return next_temp_version++;
+}
+
+// Size in bytes of the temp version currently stored in db, laid over its base version
+off_t tempsize_segment(sqlite3_int64 ino, int temp_ver, int base_ver, int seg_size)
+{
+  off_t size = extent_segment(temp_ino(ino), temp_ver, seg_size);
+  if (base_ver != -1)
+    size = max(size, extent_segment(ino, base_ver, seg_size));
+  return size;
 }
 
-void copycurr_segment(const char *path, int cuur_ver)
+// A segment of the temp version; segments not written yet are read from the base version
+int readtemp_segment(sqlite3_int64 ino, int temp_ver, int base_ver, int seg, int seg_size, string &content)
 {
-  FILE_LOG(LOG_DEBUG) << "copycurr_segment path=" << path << " current version=" << cuur_ver << endl;
-  char temp_char[9] = ".segtemp";
-  char path_temp[strlen(path) + strlen(temp_char) + 1];
-  strcpy(path_temp, path);
-  strcat(path_temp, temp_char);
-  sqlite3_stmt *stmt;
-
-  // get max seg
-  sqlite3_prepare_v2(db, "SELECT MAX(segment) FROM file_segments WHERE path = ? AND version = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int(stmt, 2, cuur_ver);
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT content, extent, extent_offset, extent_length, NULL, NULL FROM file_segments WHERE ino = ? AND version = ? AND segment = ?;");
+  sqlite3_bind_int64(stmt, 1, temp_ino(ino));
+  sqlite3_bind_int(stmt, 2, temp_ver);
+  sqlite3_bind_int(stmt, 3, seg);
   int res = sqlite3_step(stmt);
-  if (res != SQLITE_OK)
-  {
-    FILE_LOG(LOG_DEBUG) << "no segment exists" << endl;
-    sqlite3_finalize(stmt);
-    return;
-  }
-  int seg_max = sqlite3_column_int(stmt, 0);
-  sqlite3_finalize(stmt);
-  for (int seg = 0; seg <= seg_max; ++seg)
-  {
-    sqlite3_prepare_v2(db, "INSERT INTO file_segments (path, version, segment, signature, content) VALUES(?, 100000, ?, 'NONE', (SELECT content FROM file_segments WHERE (path = ? AND version = ? AND segment = ?)));", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path_temp, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 2, seg);
-    sqlite3_bind_text(stmt, 3, path, -1, SQLITE_STATIC);
-    sqlite3_bind_int(stmt, 4, cuur_ver);
-    sqlite3_bind_int(stmt, 5, seg);
+  if (res != SQLITE_ROW && base_ver != -1 && version_chunked(ino, base_ver))
+  {
+    // The base version was cut by content, so the segment is put together from the bytes it covers
+    stmt.finalize();
+    content.resize(seg_size);
+    int len = read_range(ino, base_ver, segment_to_size(seg, seg_size), seg_size, &content[0]);
+    content.resize(max(len, 0));
+    return len > 0 ? 0 : -1;
+  }
+  if (res != SQLITE_ROW && base_ver != -1)
+  {
+    stmt.finalize();
+    stmt.prepare(db, "SELECT content, extent, extent_offset, stored_size, encoding, size FROM segment_content WHERE ino = ? AND version = ? AND segment = ?;");
+    sqlite3_bind_int64(stmt, 1, ino);
+    sqlite3_bind_int(stmt, 2, base_ver);
+    sqlite3_bind_int(stmt, 3, seg);
     res = sqlite3_step(stmt);
-    sqlite3_finalize(stmt);
+  }
+  int ret = -1;
+  if (res == SQLITE_ROW)
+  {
+    ret = read_content(ndnfs::extent_store, stmt, 0, content);
+  }
+  else
+  {
+    content.clear();
+  }
+  stmt.finalize();
+  return ret < 0 ? -1 : 0;
+}
+
+/**
+ * Store whole segments into the temp version. All segments go in one transaction
+ * with a single prepared statement, instead of a SELECT/UPDATE pair per write.
+ */
+int addtemp_segments(sqlite3_int64 ino, int temp_ver, const map<int, string> &segments)
+{
+  FILE_LOG(LOG_DEBUG) << "addtemp_segments: ino=" << ino << ", temp ver=" << std::dec << temp_ver << ", segments=" << segments.size() << endl;
+  if (segments.empty())
+    return 0;
+
+  // A savepoint works as a transaction on its own, and nests inside the one ndnfs_release holds
+  sqlite3_exec(db, "SAVEPOINT addtemp;", NULL, NULL, NULL);
+
+  CachedStatement stmt;
+  stmt.prepare(db, "INSERT OR REPLACE INTO file_segments (ino, version, segment, signature, content, extent, extent_offset, extent_length) VALUES (?, ?, ?, 'NONE', ?, ?, ?, ?);");
+  int res = SQLITE_DONE;
+  for (map<int, string>::const_iterator it = segments.begin(); it != segments.end(); ++it)
+  {
+    sqlite3_bind_int64(stmt, 1, temp_ino(ino));
+    sqlite3_bind_int(stmt, 2, temp_ver);
+    sqlite3_bind_int(stmt, 3, it->first);
+    if (bind_payload(stmt, 4, it->second.data(), it->second.size()) < 0)
+    {
+      res = SQLITE_IOERR;
+      break;
+    }
+    res = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
     if (res != SQLITE_DONE)
-      FILE_LOG(LOG_DEBUG) << "copy current segment error! path:" << path << " seg:" << seg << " cuur_ver:" << cuur_ver << endl;
+    {
+      FILE_LOG(LOG_ERROR) << "addtemp_segments: insert error. ino:" << ino << " seg:" << it->first << " res:" << res << endl;
+      break;
+    }
+  }
+  stmt.finalize();
+
+  if (res != SQLITE_DONE)
+  {
+    sqlite3_exec(db, "ROLLBACK TO addtemp; RELEASE addtemp;", NULL, NULL, NULL);
+    return -EIO;
+  }
+  sqlite3_exec(db, "RELEASE addtemp;", NULL, NULL, NULL);
+  return 0;
+}
+
+/**
+ * Copy-on-write: give to_ver a row for every segment of from_ver it does not have yet.
+ * The new rows hold no content, only the blob of from_ver's row, or for content stored
+ * before blobs, the version whose row holds it (origin); both are resolved by the
+ * segment_content view. Each still gets its own signature, since the version is part
+ * of the signed name.
+ */
+int share_segments(sqlite3_int64 ino, int from_ver, int to_ver)
+{
+  FILE_LOG(LOG_DEBUG) << "share_segments: ino=" << ino << std::dec << ", from ver=" << from_ver << ", to ver=" << to_ver << endl;
+
+  CachedStatement stmt;
+  stmt.prepare(db, "INSERT OR IGNORE INTO file_segments (ino, version, segment, signature, origin, blob_id) \
+                          SELECT ino, ?, segment, 'NONE', CASE WHEN blob_id IS NULL THEN COALESCE(origin, version) END, blob_id \
+                          FROM file_segments WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int(stmt, 1, to_ver);
+  sqlite3_bind_int64(stmt, 2, ino);
+  sqlite3_bind_int(stmt, 3, from_ver);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "share_segments: insert error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
+  }
+  return sqlite3_changes(db);
+}
+
+// Whether content committed to a file is compressed, going by the MIME type it was created with
+static bool file_compressible(sqlite3_int64 ino)
+{
+  if (!ndnfs::compress_segments)
+    return false;
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT mime_type FROM file_system WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  bool compressible = sqlite3_step(stmt) == SQLITE_ROW && mime_compressible((const char *)sqlite3_column_text(stmt, 0));
+  stmt.finalize();
+  return compressible;
+}
+
+/**
+ * Store the content read by read_stmt, whose columns are those of read_payload, compressed
+ * with the parameters of update_stmt: content, extent, extent_offset, extent_length, encoding
+ * and length, in that order from 1. Content that does not get smaller is left alone, unless always.
+ * @return 1 if the content was stored compressed, 0 if not, or negative errno on failure
+ */
+static int compress_payload(sqlite3_stmt *read_stmt, sqlite3_stmt *update_stmt, bool always)
+{
+  string content;
+  string compressed;
+  int ret = sqlite3_step(read_stmt) == SQLITE_ROW ? read_payload(ndnfs::extent_store, read_stmt, 0, content) : -EIO;
+  sqlite3_reset(read_stmt);
+  if (ret == 0)
+    ret = compress_segment(content.data(), content.size(), compressed);
+  if (ret < 0)
+    return ret;
+  if (!always && compressed.size() >= content.size())
+    return 0;
+
+  if (bind_payload(update_stmt, 1, compressed.data(), compressed.size()) < 0)
+    return -EIO;
+  sqlite3_bind_int(update_stmt, 5, ZSTD_SEGMENT);
+  sqlite3_bind_int(update_stmt, 6, content.size());
+  int res = sqlite3_step(update_stmt);
+  sqlite3_reset(update_stmt);
+  return res == SQLITE_DONE ? 1 : -EIO;
+}
+
+/**
+ * Move the content of every segment a committed version holds itself into segment_blobs,
+ * keyed by its SHA-256 digest. Content some file or version already has is dropped, and
+ * the row points at the blob holding it. Segment rows keep their own signature.
+ * With ndnfs::compress_segments, new blobs of files of a compressible type are stored
+ * compressed when that makes them smaller (compression.h).
+ * @return number of segments whose content was already stored, or negative errno on failure
+ */
+int dedup_version(sqlite3_int64 ino, int ver)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT rowid, content, extent, extent_offset, COALESCE(length(content), extent_length) FROM file_segments \
+                    WHERE ino = ? AND version = ? AND origin IS NULL AND blob_id IS NULL;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  vector<pair<sqlite3_int64, Blob> > digests;
+  string content;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+  {
+    if (read_payload(ndnfs::extent_store, stmt, 1, content) < 0)
+    {
+      stmt.finalize();
+      return -EIO;
+    }
+    digests.push_back(make_pair(sqlite3_column_int64(stmt, 0), digest_content(content.data(), content.size())));
+  }
+  stmt.finalize();
+
+  bool compress = file_compressible(ino);
+  CachedStatement find_stmt;
+  find_stmt.prepare(db, "SELECT id FROM segment_blobs WHERE digest = ?;");
+  CachedStatement insert_stmt;
+  insert_stmt.prepare(db, "INSERT INTO segment_blobs (digest, refs, content, extent, extent_offset, extent_length, encoding) \
+                           SELECT ?, 0, content, extent, extent_offset, extent_length, ? FROM file_segments WHERE rowid = ?;");
+  CachedStatement read_stmt;
+  read_stmt.prepare(db, "SELECT content, extent, extent_offset, extent_length FROM segment_blobs WHERE id = ?;");
+  CachedStatement compress_stmt;
+  compress_stmt.prepare(db, "UPDATE segment_blobs SET content = ?, extent = ?, extent_offset = ?, extent_length = ?, encoding = ?, length = ? \
+                             WHERE id = ?;");
+  CachedStatement update_stmt;
+  update_stmt.prepare(db, "UPDATE file_segments SET blob_id = ?, content = NULL, extent = NULL, extent_offset = NULL, extent_length = NULL \
+                           WHERE rowid = ?;");
+
+  int shared = 0;
+  int compressed = 0;
+  int res = SQLITE_DONE;
+  for (size_t i = 0; i < digests.size() && res == SQLITE_DONE; i++)
+  {
+    sqlite3_int64 blob_id;
+    sqlite3_bind_blob(find_stmt, 1, digests[i].second.buf(), digests[i].second.size(), SQLITE_STATIC);
+    if (sqlite3_step(find_stmt) == SQLITE_ROW)
+    {
+      blob_id = sqlite3_column_int64(find_stmt, 0);
+      shared++;
+    }
     else
-      FILE_LOG(LOG_DEBUG) << "copy current segment sucess!" << endl;
+    {
+      // The row's content moves into the new blob as is, wherever it is kept; a blob tried
+      // and left plain gets encoding 0, so that encode_version knows it did not compress
+      sqlite3_bind_blob(insert_stmt, 1, digests[i].second.buf(), digests[i].second.size(), SQLITE_STATIC);
+      if (compress)
+        sqlite3_bind_int(insert_stmt, 2, PLAIN_SEGMENT);
+      else
+        sqlite3_bind_null(insert_stmt, 2);
+      sqlite3_bind_int64(insert_stmt, 3, digests[i].first);
+      res = sqlite3_step(insert_stmt);
+      sqlite3_reset(insert_stmt);
+      blob_id = sqlite3_last_insert_rowid(db);
+
+      if (res == SQLITE_DONE && compress)
+      {
+        sqlite3_bind_int64(read_stmt, 1, blob_id);
+        sqlite3_bind_int64(compress_stmt, 7, blob_id);
+        int ret = compress_payload(read_stmt, compress_stmt, false);
+        if (ret < 0)
+          res = SQLITE_IOERR;
+        compressed += max(ret, 0);
+      }
+    }
+    sqlite3_reset(find_stmt);
+    if (res != SQLITE_DONE)
+      break;
+
+    sqlite3_bind_int64(update_stmt, 1, blob_id);
+    sqlite3_bind_int64(update_stmt, 2, digests[i].first);
+    res = sqlite3_step(update_stmt);
+    sqlite3_reset(update_stmt);
   }
+  find_stmt.finalize();
+  insert_stmt.finalize();
+  read_stmt.finalize();
+  compress_stmt.finalize();
+  update_stmt.finalize();
+
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "dedup_version: error " << res << ". ino:" << ino << " ver:" << ver << endl;
+    return -EIO;
+  }
+  FILE_LOG(LOG_DEBUG) << "dedup_version: ino=" << ino << ", ver=" << std::dec << ver << ", segments " << digests.size() << ", already stored " << shared
+                      << ", compressed " << compressed << endl;
+  return shared;
 }
 
-// remove temp version
-int removetemp_segment(const char *path, int ver)
+/**
+ * With ndnfs::wire_compression, store every blob of a committed version of a compressible file
+ * compressed, whether or not that makes it smaller, and mark the version in file_versions to
+ * be signed and published as stored (compression.h). Blobs shared with other versions change
+ * for them too, which read them decoded all the same. A version with segments stored before
+ * blobs, in rows of their own, stays plain.
+ * @return 1 if the version is published compressed, 0 if not, or negative errno on failure
+ */
+int encode_version(sqlite3_int64 ino, int ver)
 {
-  FILE_LOG(LOG_DEBUG) << "removetemp_segment path=" << path << endl;
-  char temp_char[9] = ".segtemp";
-  char path_temp[strlen(path) + strlen(temp_char) + 1];
-  strcpy(path_temp, path);
-  strcat(path_temp, temp_char);
-
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "UPDATE file_segments SET path = ?, version = ? WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  if (!ndnfs::wire_compression || !file_compressible(ino))
+    return 0;
+
+  CachedStatement stmt;
+  stmt.prepare(db, "SELECT DISTINCT b.id FROM file_segments s JOIN segment_blobs b ON b.id = s.blob_id \
+                    WHERE s.ino = ? AND s.version = ? AND b.encoding IS NOT ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   sqlite3_bind_int(stmt, 2, ver);
-  sqlite3_bind_text(stmt, 3, path_temp, -1, SQLITE_STATIC);
+  sqlite3_bind_int(stmt, 3, ZSTD_SEGMENT);
+  vector<sqlite3_int64> blobs;
+  while (sqlite3_step(stmt) == SQLITE_ROW)
+    blobs.push_back(sqlite3_column_int64(stmt, 0));
+  stmt.finalize();
+
+  CachedStatement read_stmt;
+  read_stmt.prepare(db, "SELECT content, extent, extent_offset, extent_length FROM segment_blobs WHERE id = ?;");
+  CachedStatement compress_stmt;
+  compress_stmt.prepare(db, "UPDATE segment_blobs SET content = ?, extent = ?, extent_offset = ?, extent_length = ?, encoding = ?, length = ? \
+                             WHERE id = ?;");
+  int ret = 0;
+  for (size_t i = 0; i < blobs.size() && ret >= 0; i++)
+  {
+    sqlite3_bind_int64(read_stmt, 1, blobs[i]);
+    sqlite3_bind_int64(compress_stmt, 7, blobs[i]);
+    ret = compress_payload(read_stmt, compress_stmt, true);
+  }
+  read_stmt.finalize();
+  compress_stmt.finalize();
+  if (ret < 0)
+  {
+    FILE_LOG(LOG_ERROR) << "encode_version: compress error. ino:" << ino << " ver:" << ver << endl;
+    return ret;
+  }
+
+  stmt.prepare(db, "SELECT 1 FROM segment_content WHERE ino = ? AND version = ? AND encoding IS NOT ? LIMIT 1;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int(stmt, 3, ZSTD_SEGMENT);
+  bool plain = sqlite3_step(stmt) == SQLITE_ROW;
+  stmt.finalize();
+  if (plain)
+    return 0;
+
+  stmt.prepare(db, "UPDATE file_versions SET encoding = ? WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int(stmt, 1, ZSTD_SEGMENT);
+  sqlite3_bind_int64(stmt, 2, ino);
+  sqlite3_bind_int(stmt, 3, ver);
   int res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  return 0;
+  stmt.finalize();
+  FILE_LOG(LOG_DEBUG) << "encode_version: ino=" << ino << ", ver=" << std::dec << ver << ", blobs compressed " << blobs.size() << endl;
+  return res == SQLITE_DONE ? 1 : -EIO;
 }
 
-int removenosign_segment(const char* path) {
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path = ? AND signature = 'NONE';", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+// Store one segment of a rebuilt version: a row pointing at the blob of the same content, if there is one
+static int store_chunk(sqlite3_stmt *insert_stmt, sqlite3_stmt *find_stmt, sqlite3_int64 ino, int ver, int seg, off_t offset, const char *data, size_t len)
+{
+  Blob digest = digest_content(data, len);
+  sqlite3_bind_blob(find_stmt, 1, digest.buf(), digest.size(), SQLITE_STATIC);
+  bool found = sqlite3_step(find_stmt) == SQLITE_ROW;
+  sqlite3_int64 blob_id = found ? sqlite3_column_int64(find_stmt, 0) : 0;
+  sqlite3_reset(find_stmt);
+
+  sqlite3_bind_int64(insert_stmt, 1, ino);
+  sqlite3_bind_int(insert_stmt, 2, ver);
+  sqlite3_bind_int(insert_stmt, 3, seg);
+  if (found)
+  {
+    sqlite3_bind_int64(insert_stmt, 4, blob_id);
+    for (int col = 5; col <= 8; col++)
+      sqlite3_bind_null(insert_stmt, col);
+  }
+  else
+  {
+    sqlite3_bind_null(insert_stmt, 4);
+    if (bind_payload(insert_stmt, 5, data, len) < 0)
+      return -EIO;
+  }
+  if (ndnfs::cdc_chunking)
+    sqlite3_bind_int64(insert_stmt, 9, offset);
+  else
+    sqlite3_bind_null(insert_stmt, 9);
+  int res = sqlite3_step(insert_stmt);
+  sqlite3_reset(insert_stmt);
+  return res == SQLITE_DONE ? 0 : -EIO;
+}
+
+/**
+ * Commit a temp version as version ver by cutting what it holds, laid over its base version,
+ * anew: by content with ndnfs::cdc_chunking, into segments of seg_size otherwise. This is how
+ * a version is committed whenever the new or the base version is cut by content, since their
+ * segments do not line up with those of the temp version. Segments some file or version
+ * already has only get a row pointing at the blob holding them. The temp version is dropped.
+ * When the base version is also cut by content, the chunks of the base version before the first
+ * segment written are shared as they are, and cutting resumes at the start of the chunk
+ * holding it, since cut points only depend on the bytes since the last one; everything from
+ * there to the end of the file is read and cut again, so appending to a large file costs a
+ * pass over its last chunk only, and writing near its start a pass over all of it.
+ * @return number of segments of the new version, or negative errno on failure
+ */
+int rebuild_version(sqlite3_int64 ino, int temp_ver, int base_ver, int ver, int seg_size)
+{
+  FILE_LOG(LOG_DEBUG) << "rebuild_version: ino=" << ino << ", temp ver=" << std::dec << temp_ver << ", base ver=" << base_ver << ", ver=" << ver << endl;
+
+  off_t total = tempsize_segment(ino, temp_ver, base_ver, seg_size);
+  int last = total > 0 ? seek_segment(total - 1, seg_size) : -1;
+  // The longest chunk is seg_size, so chunks never outgrow the segments of the file
+  Chunker chunker(seg_size);
+
+  CachedStatement find_stmt;
+  find_stmt.prepare(db, "SELECT id FROM segment_blobs WHERE digest = ?;");
+  CachedStatement insert_stmt;
+  insert_stmt.prepare(db, "INSERT INTO file_segments (ino, version, segment, signature, blob_id, content, extent, extent_offset, extent_length, seg_offset) \
+                           VALUES (?, ?, ?, 'NONE', ?, ?, ?, ?, ?, ?);");
+
+  string pending;
+  string content;
+  off_t offset = 0;
+  int count = 0;
+  int ret = 0;
+  int first = 0;
+  size_t skip = 0;
+  if (ndnfs::cdc_chunking && base_ver != -1 && version_chunked(ino, base_ver))
+  {
+    // The first byte written, or the end of the file if none was
+    CachedStatement stmt;
+    stmt.prepare(db, "SELECT MIN(segment) FROM file_segments WHERE ino = ? AND version = ?;");
+    sqlite3_bind_int64(stmt, 1, temp_ino(ino));
+    sqlite3_bind_int(stmt, 2, temp_ver);
+    off_t dirty = total;
+    if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_type(stmt, 0) != SQLITE_NULL)
+      dirty = segment_to_size(sqlite3_column_int(stmt, 0), seg_size);
+    stmt.finalize();
+
+    stmt.prepare(db, "SELECT segment, seg_offset FROM file_segments WHERE ino = ? AND version = ? AND seg_offset <= ? ORDER BY seg_offset DESC LIMIT 1;");
+    sqlite3_bind_int64(stmt, 1, ino);
+    sqlite3_bind_int(stmt, 2, base_ver);
+    sqlite3_bind_int64(stmt, 3, dirty);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      count = sqlite3_column_int(stmt, 0);
+      offset = sqlite3_column_int64(stmt, 1);
+    }
+    stmt.finalize();
+    if (count > 0 && share_segments_below(ino, base_ver, ver, count) < 0)
+      return -EIO;
+    first = seek_segment(offset, seg_size);
+    skip = offset - segment_to_size(first, seg_size);
+  }
+
+  for (int seg = first; ret == 0; seg++)
+  {
+    bool end = seg > last;
+    if (!end)
+    {
+      // A segment missing within the file would be committed as zeros
+      if (readtemp_segment(ino, temp_ver, base_ver, seg, seg_size, content) < 0)
+      {
+        ret = -EIO;
+        break;
+      }
+      // A segment shorter than the file around it ends in a hole, read as zeros
+      content.resize(min((off_t)seg_size, total - segment_to_size(seg, seg_size)), '\0');
+      if (seg == first)
+        content.erase(0, skip);
+      pending.append(content);
+    }
+
+    // A chunk is cut once as many bytes as the longest chunk are pending, or at the end
+    size_t done = 0;
+    while (ret == 0 && (pending.size() - done >= chunker.maxSize() || (end && done < pending.size())))
+    {
+      size_t len = ndnfs::cdc_chunking ? chunker.cut(pending.data() + done, pending.size() - done)
+                                       : min(pending.size() - done, (size_t)seg_size);
+      ret = store_chunk(insert_stmt, find_stmt, ino, ver, count, offset, pending.data() + done, len);
+      done += len;
+      offset += len;
+      count++;
+    }
+    pending.erase(0, done);
+    if (end)
+      break;
+  }
+  find_stmt.finalize();
+  insert_stmt.finalize();
+
+  if (ret < 0)
+  {
+    FILE_LOG(LOG_ERROR) << "rebuild_version: error " << ret << ". ino:" << ino << " seg:" << count << endl;
+    return ret;
+  }
+  cleartemp_segment(ino, temp_ver);
+  return count;
+}
+
+// Drop whatever a temp version holds, for releases that fail
+int cleartemp_segment(sqlite3_int64 ino, int temp_ver)
+{
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_segments WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(stmt, 1, temp_ino(ino));
+  sqlite3_bind_int(stmt, 2, temp_ver);
   int res = sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
-  return 0; 
-}
\ No newline at end of file
+  stmt.finalize();
+  return res == SQLITE_DONE ? 0 : -EIO;
+}
+
+// Cut the temp version at length: segments past it are dropped, and the one it falls in is cut
+int cuttemp_segments(sqlite3_int64 ino, int temp_ver, off_t length, int seg_size)
+{
+  FILE_LOG(LOG_DEBUG) << "cuttemp_segments: ino=" << ino << ", temp ver=" << std::dec << temp_ver << ", length=" << length << endl;
+  int last = length > 0 ? seek_segment(length - 1, seg_size) : -1;
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_segments WHERE ino = ? AND version = ? AND segment > ?;");
+  sqlite3_bind_int64(stmt, 1, temp_ino(ino));
+  sqlite3_bind_int(stmt, 2, temp_ver);
+  sqlite3_bind_int(stmt, 3, last);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+    return -EIO;
+
+  // Only the temp version itself is read; base version segments are cut by the truncation of the file
+  map<int, string> cut;
+  string &content = cut[last];
+  size_t keep = length - segment_to_size(last, seg_size);
+  if (last < 0 || readtemp_segment(ino, temp_ver, -1, last, seg_size, content) < 0 || content.size() <= keep)
+    return 0;
+  content.resize(keep);
+  return addtemp_segments(ino, temp_ver, cut);
+}
+
+// Drop the temp versions left behind by handles that were never released, at mount
+int cleartemp_segments()
+{
+  int res = sqlite3_exec(db, "DELETE FROM file_segments WHERE ino < 0;", NULL, NULL, NULL);
+  return res == SQLITE_OK ? 0 : -EIO;
+}
+
+// Turn the temp version into version ver; returns 0, or -EIO on failure
+int removetemp_segment(sqlite3_int64 ino, int temp_ver, int ver)
+{
+  FILE_LOG(LOG_DEBUG) << "removetemp_segment ino=" << ino << ", temp ver=" << std::dec << temp_ver << endl;
+  CachedStatement stmt;
+  stmt.prepare(db, "UPDATE file_segments SET ino = ?, version = ? WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_bind_int64(stmt, 3, temp_ino(ino));
+  sqlite3_bind_int(stmt, 4, temp_ver);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "removetemp_segment: update error. ino:" << ino << " res:" << res << endl;
+    return -EIO;
+  }
+  return 0;
+}
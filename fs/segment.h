@@ -23,30 +23,86 @@
 
 #include "ndnfs.h"
 
-inline int seek_segment(int doff)
+#include <map>
+#include <string>
+
+inline int seek_segment(off_t doff, int seg_size)
+{
+    return (int)(doff / seg_size);
+}
+
+inline off_t segment_to_size(int seg, int seg_size)
 {
-    return (doff >> ndnfs::seg_size_shift);
+    return (off_t)seg * seg_size;
 }
 
-inline int segment_to_size(int seg)
+/**
+ * Segment size of a file, fixed when it is created; for a directory, the segment size
+ * handed down to files created in it, or ndnfs::seg_size if it has none.
+ */
+int file_seg_size(sqlite3 *conn, sqlite3_int64 ino);
+
+/**
+ * Set the segment size of a file, which is only allowed before it has any content,
+ * or of a directory; 0 removes the one of a directory.
+ * @return 0 on success, negative errno on failure
+ */
+int set_seg_size(sqlite3_int64 ino, int seg_size);
+
+ndn::Name file_name(const char *path);
+
+ndn::Blob sign_content(ndn::KeyChain &keyChain, const char *path, int ver, int seg, const char *data, int len);
+
+int sign_version(sqlite3 *conn, sqlite3_int64 ino, const char *path, int ver);
+
+void remove_segments(sqlite3_int64 ino, const int ver, const int start = 0);
+
+int truncate_all_segment(sqlite3_int64 ino, int ver, int new_ver, off_t length);
+int extend_all_segment(sqlite3_int64 ino, int ver, int new_ver, off_t length, int seg_size);
+
+int share_segments(sqlite3_int64 ino, int from_ver, int to_ver);
+
+int dedup_version(sqlite3_int64 ino, int ver);
+
+int encode_version(sqlite3_int64 ino, int ver);
+
+/**
+ * Whether the segments of a version were cut by content (chunker.h), and start at their
+ * seg_offset rather than at segment * seg_size.
+ */
+bool version_chunked(sqlite3_int64 ino, int ver);
+
+int read_range(sqlite3_int64 ino, int ver, off_t offset, size_t size, char *buf);
+
+int rebuild_version(sqlite3_int64 ino, int temp_ver, int base_ver, int ver, int seg_size);
+
+/**
+ * Temp version helpers used by WriteBuffer: every handle opened for writing keeps its
+ * temp version in file_segments under temp_ino() of the file, with a version number of
+ * its own from new_temp_version(), until release. It holds only the segments written
+ * since open; the rest are read from the base version the file had at open, or -1
+ * if the open truncated it. Handles writing the same file do not see each other's writes.
+ */
+int new_temp_version();
+
+// Inode the temp versions of a file are stored under, which no file has
+inline sqlite3_int64 temp_ino(sqlite3_int64 ino)
 {
-    return (seg << ndnfs::seg_size_shift);
+    return -ino;
 }
 
-int sign_segment(const char* path, int ver, int seg, const char *data, int len);
-// int sign_segment(const char* path, int ver);
+off_t tempsize_segment(sqlite3_int64 ino, int temp_ver, int base_ver, int seg_size);
 
-void remove_segments(const char* path, const int ver, const int start = 0);
+int readtemp_segment(sqlite3_int64 ino, int temp_ver, int base_ver, int seg, int seg_size, std::string &content);
 
-void truncate_segment(const char* path, const int ver, const int seg, const off_t length);
-int truncate_all_segment(const char *path, const int ver, const off_t length);
+int addtemp_segments(sqlite3_int64 ino, int temp_ver, const std::map<int, std::string> &segments);
 
-void copycurr_segment(const char* path, int cuur_ver);
+int removetemp_segment(sqlite3_int64 ino, int temp_ver, int ver);
 
-int addtemp_segment(const char *path, const char *buf, size_t size, off_t offset);
+int cleartemp_segment(sqlite3_int64 ino, int temp_ver);
 
-int removetemp_segment(const char *path, int ver);
+int cleartemp_segments();
 
-int removenosign_segment(const char* path);
+int cuttemp_segments(sqlite3_int64 ino, int temp_ver, off_t length, int seg_size);
 
 #endif
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "sign-pool.h"
+#include "segment.h"
+#include "manifest.h"
+
+using namespace std;
+
+SignPool::SignPool(int threads)
+  : stop_(false), ver_(0), jobs_(NULL), next_(0), pending_(0)
+{
+  for (int i = 0; i < threads; i++)
+  {
+    workers_.push_back(thread(&SignPool::run, this, create_keychain()));
+  }
+}
+
+SignPool::~SignPool()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_.notify_all();
+  for (size_t i = 0; i < workers_.size(); i++)
+  {
+    workers_[i].join();
+  }
+}
+
+void SignPool::sign(const string &path, int ver, vector<SignJob> &jobs)
+{
+  if (jobs.empty())
+    return;
+
+  unique_lock<mutex> lock(mutex_);
+  path_ = path;
+  ver_ = ver;
+  jobs_ = &jobs;
+  next_ = 0;
+  pending_ = jobs.size();
+  work_.notify_all();
+
+  done_.wait(lock, [this] { return pending_ == 0; });
+  jobs_ = NULL;
+}
+
+void SignPool::run(ndn::ptr_lib::shared_ptr<ndn::KeyChain> keyChain)
+{
+  unique_lock<mutex> lock(mutex_);
+  while (true)
+  {
+    work_.wait(lock, [this] { return stop_ || (jobs_ != NULL && next_ < jobs_->size()); });
+    if (stop_)
+      return;
+
+    SignJob &job = (*jobs_)[next_++];
+    string path = path_;
+    int ver = ver_;
+
+    lock.unlock();
+    if (ndnfs::manifest_signing)
+      job.signature = digest_content(job.content.data(), job.content.size());
+    else
+      job.signature = sign_content(*keyChain, path.c_str(), ver, job.seg, job.content.data(), job.content.size());
+    lock.lock();
+
+    if (--pending_ == 0)
+      done_.notify_one();
+  }
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_SIGN_POOL_H
+#define NDNFS_SIGN_POOL_H
+
+#include "ndnfs.h"
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+struct SignJob
+{
+  int seg;
+  std::string content;
+  ndn::Blob signature;
+};
+
+/**
+ * SignPool keeps one signing thread per core, each with its own keychain.
+ * sign() hands a batch of segments of one version to the workers and
+ * returns once every segment in the batch carries its signature.
+ */
+class SignPool
+{
+public:
+  SignPool(int threads);
+
+  ~SignPool();
+
+  void
+  sign(const std::string &path, int ver, std::vector<SignJob> &jobs);
+
+  size_t
+  size() const { return workers_.size(); }
+
+private:
+  void
+  run(ndn::ptr_lib::shared_ptr<ndn::KeyChain> keyChain);
+
+  std::vector<std::thread> workers_;
+
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable done_;
+  bool stop_;
+
+  // the batch being signed
+  std::string path_;
+  int ver_;
+  std::vector<SignJob> *jobs_;
+  size_t next_;
+  size_t pending_;
+};
+
+namespace ndnfs {
+    extern SignPool *sign_pool;
+}
+
+#endif
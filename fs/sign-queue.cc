@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "sign-queue.h"
+#include "segment.h"
+#include "manifest.h"
+#include "signature-states.h"
+#include "dentry.h"
+
+#include <chrono>
+
+using namespace std;
+
+int queue_version(sqlite3_int64 ino, int ver)
+{
+  FILE_LOG(LOG_DEBUG) << "queue_version: ino=" << ino << ", ver=" << std::dec << ver << endl;
+
+  CachedStatement stmt;
+  stmt.prepare(db, "INSERT OR IGNORE INTO sign_queue (ino, version) VALUES (?, ?);");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  int res = sqlite3_step(stmt);
+  stmt.finalize();
+  if (res != SQLITE_DONE)
+  {
+    FILE_LOG(LOG_ERROR) << "queue_version: insert sign_queue error. " << res << endl;
+    return -EIO;
+  }
+
+  // A file that had a signed version keeps serving it until the new one is signed
+  stmt.prepare(db, "UPDATE file_system SET ready_signed = CASE WHEN signed_version IS NULL THEN ? ELSE ? END WHERE ino = ?;");
+  sqlite3_bind_int(stmt, 1, NOT_READY);
+  sqlite3_bind_int(stmt, 2, READY_OLD);
+  sqlite3_bind_int64(stmt, 3, ino);
+  sqlite3_step(stmt);
+  stmt.finalize();
+  return 0;
+}
+
+SignQueue::SignQueue(const char *db_path, int max_depth)
+  : dbPath_(db_path), db_(NULL), keyChain_(create_keychain()), maxDepth_(max_depth), depth_(0), stop_(false)
+{
+  if (sqlite3_open(dbPath_.c_str(), &db_) != SQLITE_OK)
+  {
+    FILE_LOG(LOG_ERROR) << "SignQueue: cannot connect to sqlite db " << dbPath_ << endl;
+    return;
+  }
+  sqlite3_busy_timeout(db_, 10000);
+
+  // Versions left over from an earlier mount
+  CachedStatement stmt;
+  stmt.prepare(db_, "SELECT COUNT(*) FROM sign_queue;");
+  if (sqlite3_step(stmt) == SQLITE_ROW)
+    depth_ = sqlite3_column_int(stmt, 0);
+  stmt.finalize();
+  FILE_LOG(LOG_DEBUG) << "SignQueue: " << depth_ << " versions waiting to be signed" << endl;
+
+  thread_ = thread(&SignQueue::run, this);
+}
+
+SignQueue::~SignQueue()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    stop_ = true;
+  }
+  work_.notify_all();
+  room_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+  drop_statement_cache(db_);
+  sqlite3_close(db_);
+}
+
+void SignQueue::notify()
+{
+  {
+    lock_guard<mutex> lock(mutex_);
+    depth_++;
+  }
+  work_.notify_one();
+}
+
+void SignQueue::waitForRoom()
+{
+  unique_lock<mutex> lock(mutex_);
+  if (depth_ > maxDepth_)
+  {
+    FILE_LOG(LOG_DEBUG) << "SignQueue::waitForRoom: " << depth_ << " versions waiting to be signed, throttling writer" << endl;
+  }
+  room_.wait(lock, [this] { return stop_ || depth_ <= maxDepth_; });
+}
+
+void SignQueue::run()
+{
+  while (true)
+  {
+    {
+      unique_lock<mutex> lock(mutex_);
+      // Wake up now and then even without notification, in case of rows queued by another process
+      work_.wait_for(lock, chrono::seconds(5), [this] { return stop_ || depth_ > 0; });
+      if (stop_)
+        return;
+    }
+
+    while (signNext())
+    {
+      {
+        lock_guard<mutex> lock(mutex_);
+        if (depth_ > 0)
+          depth_--;
+        if (stop_)
+          return;
+      }
+      room_.notify_all();
+    }
+
+    lock_guard<mutex> lock(mutex_);
+    depth_ = 0;
+  }
+}
+
+// Sign the oldest queued version; returns false when the queue is empty
+bool SignQueue::signNext()
+{
+  CachedStatement stmt;
+  stmt.prepare(db_, "SELECT ino, version FROM sign_queue ORDER BY rowid LIMIT 1;");
+  if (sqlite3_step(stmt) != SQLITE_ROW)
+  {
+    stmt.finalize();
+    return false;
+  }
+  sqlite3_int64 ino = sqlite3_column_int64(stmt, 0);
+  int ver = sqlite3_column_int(stmt, 1);
+  stmt.finalize();
+
+  // A newer version of the same file already waiting makes this one obsolete
+  stmt.prepare(db_, "SELECT 1 FROM sign_queue WHERE ino = ? AND version > ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  bool superseded = (sqlite3_step(stmt) == SQLITE_ROW);
+  stmt.finalize();
+
+  // Segments are named after the path the file has now; a file unlinked since has nothing left to sign
+  string path;
+  if (!superseded && ino_to_path(db_, ino, path) < 0)
+  {
+    FILE_LOG(LOG_DEBUG) << "SignQueue::signNext: skip version " << ver << " of unlinked inode " << ino << endl;
+    superseded = true;
+  }
+
+  if (superseded)
+  {
+    FILE_LOG(LOG_DEBUG) << "SignQueue::signNext: skip superseded version " << ver << " of inode " << ino << endl;
+  }
+  else if (sign_version(db_, ino, path.c_str(), ver) < 0 ||
+           (ndnfs::manifest_signing && sign_manifest(db_, *keyChain_, ino, path.c_str(), ver) < 0))
+  {
+    // Leave it queued, and try again later
+    FILE_LOG(LOG_ERROR) << "SignQueue::signNext: sign version error. path:" << path << " ver:" << ver << endl;
+    return false;
+  }
+
+  sqlite3_exec(db_, "BEGIN TRANSACTION;", NULL, NULL, NULL);
+  if (!superseded)
+  {
+    // The version just signed is either the current one, or newer than the one served so far
+    stmt.prepare(db_, "UPDATE file_system SET ready_signed = CASE WHEN current_version = ? THEN ? ELSE ? END, signed_version = ? \
+                             WHERE ino = ? AND (signed_version IS NULL OR signed_version < ?);");
+    sqlite3_bind_int(stmt, 1, ver);
+    sqlite3_bind_int(stmt, 2, READY);
+    sqlite3_bind_int(stmt, 3, READY_OLD);
+    sqlite3_bind_int(stmt, 4, ver);
+    sqlite3_bind_int64(stmt, 5, ino);
+    sqlite3_bind_int(stmt, 6, ver);
+    sqlite3_step(stmt);
+    stmt.finalize();
+  }
+
+  stmt.prepare(db_, "DELETE FROM sign_queue WHERE ino = ? AND version = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, ver);
+  sqlite3_step(stmt);
+  stmt.finalize();
+  sqlite3_exec(db_, "COMMIT;", NULL, NULL, NULL);
+  return true;
+}
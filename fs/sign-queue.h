@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_SIGN_QUEUE_H
+#define NDNFS_SIGN_QUEUE_H
+
+#include "ndnfs.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+/**
+ * Put a committed version into the persistent sign_queue table, and move the
+ * file's ready_signed state to NOT_READY or READY_OLD accordingly. Runs on the
+ * caller's connection, inside the caller's transaction.
+ */
+int queue_version(sqlite3_int64 ino, int ver);
+
+/**
+ * SignQueue drains the sign_queue table on a background thread with its own
+ * database connection, so that closing a file does not wait for RSA signing.
+ * Once every segment of a version is signed, the file becomes READY if that
+ * version is still current. Since the queue lives in the database, versions
+ * committed but not yet signed when ndnfs exits are signed on the next mount.
+ */
+class SignQueue
+{
+public:
+  SignQueue(const char *db_path, int max_depth);
+
+  ~SignQueue();
+
+  /**
+   * Tell the signer a version has been committed into the queue.
+   */
+  void
+  notify();
+
+  /**
+   * Backpressure for writers: block while more than max_depth versions wait to be signed.
+   */
+  void
+  waitForRoom();
+
+private:
+  void
+  run();
+
+  bool
+  signNext();
+
+  std::string dbPath_;
+  sqlite3 *db_;
+  // signs manifests; only used on the signer thread
+  ndn::ptr_lib::shared_ptr<ndn::KeyChain> keyChain_;
+  int maxDepth_;
+  int depth_;
+  bool stop_;
+
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable work_;
+  std::condition_variable room_;
+};
+
+namespace ndnfs {
+    extern SignQueue *sign_queue;
+    extern int sign_queue_depth;
+}
+
+#endif
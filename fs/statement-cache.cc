@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <sstream>
+#include <algorithm>
+#include <mutex>
+
+#include "statement-cache.h"
+#include "logger.h"
+
+using namespace std;
+
+static map<sqlite3 *, StatementCache *> caches;
+static mutex caches_mutex;
+
+StatementCache *statement_cache(sqlite3 *conn)
+{
+  lock_guard<mutex> lock(caches_mutex);
+  StatementCache *&cache = caches[conn];
+  if (cache == NULL)
+    cache = new StatementCache(conn);
+  return cache;
+}
+
+void drop_statement_cache(sqlite3 *conn)
+{
+  StatementCache *cache = NULL;
+  {
+    lock_guard<mutex> lock(caches_mutex);
+    map<sqlite3 *, StatementCache *>::iterator it = caches.find(conn);
+    if (it == caches.end())
+      return;
+    cache = it->second;
+    caches.erase(it);
+  }
+  delete cache;
+}
+
+StatementCache::StatementCache(sqlite3 *conn)
+  : conn_(conn)
+{
+}
+
+StatementCache::~StatementCache()
+{
+  if (!checkedOut_.empty())
+  {
+    FILE_LOG(LOG_ERROR) << "~StatementCache: " << checkedOut_.size() << " statements still checked out" << endl;
+  }
+
+  for (map<sqlite3_stmt *, Entry *>::iterator it = checkedOut_.begin(); it != checkedOut_.end(); ++it)
+    sqlite3_finalize(it->first);
+  for (map<string, Entry>::iterator it = entries_.begin(); it != entries_.end(); ++it)
+  {
+    for (size_t i = 0; i < it->second.idle.size(); i++)
+      sqlite3_finalize(it->second.idle[i]);
+  }
+}
+
+sqlite3_stmt *StatementCache::checkout(const char *sql)
+{
+  Entry &entry = entries_[sql];
+  sqlite3_stmt *stmt = NULL;
+  if (!entry.idle.empty())
+  {
+    stmt = entry.idle.back();
+    entry.idle.pop_back();
+  }
+  else
+  {
+    int res = sqlite3_prepare_v2(conn_, sql, -1, &stmt, 0);
+    if (res != SQLITE_OK)
+    {
+      FILE_LOG(LOG_ERROR) << "StatementCache::checkout: prepare error " << res << " (" << sqlite3_errmsg(conn_) << ") for " << sql << endl;
+      sqlite3_finalize(stmt);
+      return NULL;
+    }
+    entry.prepared++;
+  }
+
+  entry.executions++;
+  checkedOut_[stmt] = &entry;
+  return stmt;
+}
+
+void StatementCache::checkin(sqlite3_stmt *stmt)
+{
+  map<sqlite3_stmt *, Entry *>::iterator it = checkedOut_.find(stmt);
+  if (it == checkedOut_.end())
+    return;
+
+  // Reset right away, since a statement left mid-step keeps its read transaction open
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  it->second->idle.push_back(stmt);
+  checkedOut_.erase(it);
+}
+
+static bool by_executions(const pair<unsigned long, string> &a, const pair<unsigned long, string> &b)
+{
+  return a.first > b.first;
+}
+
+void StatementCache::report(ostream &os) const
+{
+  vector<pair<unsigned long, string> > counts;
+  for (map<string, Entry>::const_iterator it = entries_.begin(); it != entries_.end(); ++it)
+    counts.push_back(make_pair(it->second.executions, it->first));
+  sort(counts.begin(), counts.end(), by_executions);
+
+  for (size_t i = 0; i < counts.size(); i++)
+    os << counts[i].first << "\t" << counts[i].second << endl;
+}
+
+int CachedStatement::prepare(sqlite3 *conn, const char *sql)
+{
+  finalize();
+  cache_ = statement_cache(conn);
+  stmt_ = cache_->checkout(sql);
+  return stmt_ != NULL ? SQLITE_OK : sqlite3_errcode(conn);
+}
+
+void CachedStatement::finalize()
+{
+  if (stmt_ != NULL)
+    cache_->checkin(stmt_);
+  stmt_ = NULL;
+}
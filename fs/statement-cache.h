@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_STATEMENT_CACHE_H
+#define NDNFS_STATEMENT_CACHE_H
+
+#include <sqlite3.h>
+
+#include <map>
+#include <string>
+#include <vector>
+#include <ostream>
+
+/**
+ * StatementCache keeps the prepared statements of one db connection, so that the
+ * same SQL is parsed once per connection rather than on every FUSE op or Interest.
+ * Statements are keyed by their SQL text, which serves as the statement ID, and
+ * every checkout is counted as one execution of that statement.
+ *
+ * A cache belongs to its connection, and is used only by the thread owning that
+ * connection; statement_cache() finds or creates it. drop_statement_cache() has to
+ * be called before the connection is closed.
+ */
+class StatementCache
+{
+public:
+  StatementCache(sqlite3 *conn);
+
+  ~StatementCache();
+
+  /**
+   * Hand out a statement for sql, reset and with no bindings; a statement already
+   * checked out (e.g. still being stepped by a caller) is never handed out twice.
+   * @return NULL if sql does not compile
+   */
+  sqlite3_stmt *
+  checkout(const char *sql);
+
+  void
+  checkin(sqlite3_stmt *stmt);
+
+  /**
+   * Write the execution count of every statement, most executed first.
+   */
+  void
+  report(std::ostream &os) const;
+
+private:
+  struct Entry
+  {
+    std::vector<sqlite3_stmt *> idle;
+    unsigned long executions;
+    size_t prepared;
+
+    Entry() : executions(0), prepared(0) {}
+  };
+
+  sqlite3 *conn_;
+  std::map<std::string, Entry> entries_;
+  std::map<sqlite3_stmt *, Entry *> checkedOut_;
+};
+
+StatementCache *statement_cache(sqlite3 *conn);
+
+void drop_statement_cache(sqlite3 *conn);
+
+/**
+ * CachedStatement stands in for a sqlite3_stmt pointer: prepare() checks a statement
+ * out of the connection's cache instead of compiling it, and finalize() (or going out
+ * of scope) checks it back in instead of destroying it.
+ */
+class CachedStatement
+{
+public:
+  CachedStatement() : cache_(NULL), stmt_(NULL) {}
+
+  CachedStatement(sqlite3 *conn, const char *sql) : cache_(NULL), stmt_(NULL)
+  {
+    prepare(conn, sql);
+  }
+
+  ~CachedStatement() { finalize(); }
+
+  /**
+   * @return SQLITE_OK, or the error of sqlite3_prepare_v2
+   */
+  int
+  prepare(sqlite3 *conn, const char *sql);
+
+  void
+  finalize();
+
+  operator sqlite3_stmt *() const { return stmt_; }
+
+private:
+  CachedStatement(const CachedStatement &);
+  CachedStatement &operator=(const CachedStatement &);
+
+  StatementCache *cache_;
+  sqlite3_stmt *stmt_;
+};
+
+#endif
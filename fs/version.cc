@@ -41,81 +41,34 @@ int write_version(const char* path, int ver, const char *buf, size_t size, off_t
   return 0;
 }
 
-int truncate_version(const char* path, const int ver, off_t length)
+void remove_version(sqlite3_int64 ino, const int ver)
 {
-  FILE_LOG(LOG_DEBUG) << "truncate_version: path=" << path << std::dec << ", ver=" << ver << ", length=" << length << endl;
+  FILE_LOG(LOG_DEBUG) << "remove_version: ino=" << ino << ", ver=" << std::dec << ver << endl;
 
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2 (db, "SELECT * FROM file_versions WHERE path = ? AND version = ?;", -1, &stmt, 0);
-  sqlite3_bind_text (stmt, 1, path, -1, SQLITE_STATIC);
-  sqlite3_bind_int (stmt, 2, ver);
-
-  if (sqlite3_step (stmt) != SQLITE_ROW) {
-	// Should not happen
-	sqlite3_finalize (stmt);
-	return -1;
-  }
-  
-  int size = sqlite3_column_int (stmt, 2);
-  sqlite3_finalize (stmt);
-  
-  if ((size_t) length == size) {
-	return 0;
-  }
-  else if ((size_t) length < size) {
-	// Truncate to length
-	int seg_end = seek_segment (length);
-
-	sqlite3_prepare_v2 (db, "UPDATE file_versions SET size = ?, totalSegments = ? WHERE path = ? and version = ?;", -1, &stmt, 0);
-	sqlite3_bind_int (stmt, 1, (int) length);
-	sqlite3_bind_int (stmt, 2, seg_end);
-	sqlite3_bind_text (stmt, 3, path, -1, SQLITE_STATIC);
-	sqlite3_bind_int (stmt, 4, ver);
-	int res = sqlite3_step (stmt);
-	sqlite3_finalize (stmt);
-	if (res != SQLITE_OK && res != SQLITE_DONE)
-	  return -1;
-
-	// Update version size and segment list
-	int tail = length - segment_to_size (seg_end);
-	
-	truncate_segment (path, ver, seg_end, tail);
-	remove_segments (path, ver, seg_end + 1);
-	
-	return 0;
-  }
-  else {
-	// TODO: pad with zeros
-	return -1;
-  }
-}
-
-void remove_version(const char* path, const int ver)
-{
-  FILE_LOG(LOG_DEBUG) << "remove_version: path=" << path << ", ver=" << std::dec << ver << endl;
-
-  remove_segments(path, ver);
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "DELETE FROM file_versions WHERE path = ? and version = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  remove_segments(ino, ver);
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_versions WHERE ino = ? and version = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   sqlite3_bind_int(stmt, 2, ver);
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
 }
 
-void remove_file_entry(const char* path)
+void remove_file_entry(sqlite3_int64 ino)
 {
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(db, "DELETE FROM file_segments WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
-  int res = sqlite3_step(stmt);
-  if (res == SQLITE_OK)
-    FILE_LOG(LOG_DEBUG)<<"DELETE FS!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!!\n";
-  sqlite3_finalize(stmt);
-  
+  CachedStatement stmt;
+  stmt.prepare(db, "DELETE FROM file_segments WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_step(stmt);
+  stmt.finalize();
+
+  stmt.prepare(db, "DELETE FROM file_versions WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_step(stmt);
+  stmt.finalize();
 
-  sqlite3_prepare_v2(db, "DELETE FROM file_versions WHERE path = ?;", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path, -1, SQLITE_STATIC);
+  stmt.prepare(db, "DELETE FROM file_manifests WHERE ino = ?;");
+  sqlite3_bind_int64(stmt, 1, ino);
   sqlite3_step(stmt);
-  sqlite3_finalize(stmt);
+  stmt.finalize();
 }
@@ -28,15 +28,12 @@ int duplicate_version (const char *path, const int from_ver, const int to_ver);
 
 int write_version(const char* path, int ver, const char *buf, size_t size, off_t offset);
 
-int truncate_version(const char* path, const int ver, off_t length);
-
-void remove_version(const char* path, const int ver);
+void remove_version(sqlite3_int64 ino, const int ver);
 
 /**
- * Remove file entry removes the file entry from file_system table, 
- * but not from file_versions; Right now, whenever unlink is called, 
- * entries of the file in file_versions is not deleted.
+ * Remove file entry removes the versions, segments and manifests of an inode;
+ * its row in file_system and its name in file_entries are up to the caller.
  */
-void remove_file_entry(const char* path);
+void remove_file_entry(sqlite3_int64 ino);
 
 #endif
@@ -0,0 +1,224 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "write-buffer.h"
+
+using namespace std;
+
+WriteBuffer::WriteBuffer(sqlite3_int64 ino, int base_ver, int seg_size)
+  : ino_(ino), tempVersion_(new_temp_version()), baseVersion_(base_ver), segSize_(seg_size), dirtyBytes_(0), flushedBytes_(0), size_(-1), storedSize_(0), written_(false)
+{
+}
+
+WriteBuffer::~WriteBuffer()
+{
+  if (!dirty_.empty())
+  {
+    FILE_LOG(LOG_ERROR) << "~WriteBuffer: dropping " << dirty_.size() << " unflushed segments of inode " << ino_ << endl;
+  }
+}
+
+int WriteBuffer::write(const char *buf, size_t size, off_t offset)
+{
+  loadSize();
+  written_ = true;
+
+  if (offset > size_)
+    fill(NULL, offset - size_, size_);
+  fill(buf, size, offset);
+
+  if (dirtyBytes_ > ndnfs::write_buffer_cap)
+  {
+    FILE_LOG(LOG_DEBUG) << "WriteBuffer::write: buffer of inode " << ino_ << " over cap, spilling " << dirtyBytes_ << " bytes" << endl;
+    int ret = flush();
+    if (ret < 0)
+      return ret;
+  }
+  return size;
+}
+
+int WriteBuffer::flush()
+{
+  if (dirty_.empty())
+    return 0;
+
+  int ret = addtemp_segments(ino_, tempVersion_, dirty_);
+  if (ret < 0)
+    return ret;
+
+  if (flushedBytes_ + dirtyBytes_ <= ndnfs::write_buffer_cap)
+  {
+    for (map<int, string>::iterator it = dirty_.begin(); it != dirty_.end(); ++it)
+    {
+      string &content = flushed_[it->first];
+      flushedBytes_ += it->second.size() - content.size();
+      content.swap(it->second);
+    }
+  }
+  else
+  {
+    flushed_.clear();
+    flushedBytes_ = 0;
+  }
+
+  dirty_.clear();
+  dirtyBytes_ = 0;
+  storedSize_ = size_;
+  return 0;
+}
+
+int WriteBuffer::read(char *buf, size_t size, off_t offset)
+{
+  loadSize();
+  if (offset >= size_)
+    return 0;
+  size = min(size, (size_t)(size_ - offset));
+
+  string stored;
+  size_t done = 0;
+  while (done < size)
+  {
+    off_t pos = offset + done;
+    int seg = seek_segment(pos, segSize_);
+    size_t seg_offset = pos - segment_to_size(seg, segSize_);
+    size_t len = min(size - done, (size_t)segSize_ - seg_offset);
+
+    const string *content;
+    map<int, string>::const_iterator it = dirty_.find(seg);
+    if (it != dirty_.end() || (it = flushed_.find(seg)) != flushed_.end())
+    {
+      content = &it->second;
+    }
+    else
+    {
+      readtemp_segment(ino_, tempVersion_, baseVersion_, seg, segSize_, stored);
+      content = &stored;
+    }
+
+    // A segment shorter than the file around it ends in a hole, read as zeros
+    size_t copied = content->size() > seg_offset ? min(len, content->size() - seg_offset) : 0;
+    memcpy(buf + done, content->data() + seg_offset, copied);
+    memset(buf + done + copied, 0, len - copied);
+    done += len;
+  }
+  return size;
+}
+
+int WriteBuffer::truncate(off_t length, int base_ver)
+{
+  int ret = flush();
+  if (ret < 0)
+    return ret;
+  ret = cuttemp_segments(ino_, tempVersion_, length, segSize_);
+  if (ret < 0)
+    return ret;
+
+  // Flushed segments kept for the segment cache have to match the temp version
+  int last = length > 0 ? seek_segment(length - 1, segSize_) : -1;
+  map<int, string>::iterator it = flushed_.upper_bound(last);
+  while (it != flushed_.end())
+  {
+    flushedBytes_ -= it->second.size();
+    flushed_.erase(it++);
+  }
+  it = flushed_.find(last);
+  size_t keep = length - segment_to_size(last, segSize_);
+  if (it != flushed_.end() && it->second.size() > keep)
+  {
+    flushedBytes_ -= it->second.size() - keep;
+    it->second.resize(keep);
+  }
+
+  baseVersion_ = base_ver;
+  size_ = -1;
+  loadSize();
+  if (length > size_)
+  {
+    written_ = true;
+    fill(NULL, length - size_, size_);
+  }
+  return 0;
+}
+
+void WriteBuffer::takeFlushed(map<int, string> &segments)
+{
+  segments.swap(flushed_);
+  flushed_.clear();
+  flushedBytes_ = 0;
+}
+
+// Copy size bytes of buf (or zeros, if buf is NULL) to offset
+void WriteBuffer::fill(const char *buf, size_t size, off_t offset)
+{
+  size_t done = 0;
+  while (done < size)
+  {
+    off_t pos = offset + done;
+    int seg = seek_segment(pos, segSize_);
+    size_t seg_offset = pos - segment_to_size(seg, segSize_);
+    size_t len = min(size - done, (size_t)segSize_ - seg_offset);
+
+    string &content = segment(seg);
+    if (content.size() < seg_offset + len)
+    {
+      dirtyBytes_ += seg_offset + len - content.size();
+      content.resize(seg_offset + len, '\0');
+    }
+    if (buf != NULL)
+      memcpy(&content[seg_offset], buf + done, len);
+    else
+      memset(&content[seg_offset], 0, len);
+
+    done += len;
+  }
+
+  if (offset + (off_t)size > size_)
+    size_ = offset + size;
+}
+
+void WriteBuffer::loadSize()
+{
+  if (size_ >= 0)
+    return;
+  storedSize_ = tempsize_segment(ino_, tempVersion_, baseVersion_, segSize_);
+  size_ = storedSize_;
+}
+
+// Dirty copy of a segment, read from the temp or base version on first touch
+string& WriteBuffer::segment(int seg)
+{
+  map<int, string>::iterator it = dirty_.find(seg);
+  if (it != dirty_.end())
+    return it->second;
+
+  string &content = dirty_[seg];
+  it = flushed_.find(seg);
+  if (it != flushed_.end())
+  {
+    // Written again after a flush; no need to read it back from db
+    content.swap(it->second);
+    flushedBytes_ -= content.size();
+    dirtyBytes_ += content.size();
+    flushed_.erase(it);
+  }
+  else if (segment_to_size(seg, segSize_) < storedSize_)
+  {
+    readtemp_segment(ino_, tempVersion_, baseVersion_, seg, segSize_, content);
+    dirtyBytes_ += content.size();
+  }
+  return content;
+}
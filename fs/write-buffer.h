@@ -0,0 +1,117 @@
+/*
+ * Copyright (c) 2014 University of California, Los Angeles
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation;
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef NDNFS_WRITE_BUFFER_H
+#define NDNFS_WRITE_BUFFER_H
+
+#include "ndnfs.h"
+#include "segment.h"
+
+#include <map>
+#include <string>
+
+/**
+ * WriteBuffer holds the dirty segments of one file handle opened for writing.
+ * It is owned by the FileHandle that ndnfs_open hangs off fuse_file_info::fh. Writes are applied to whole
+ * segments in memory, so partial-segment writes are coalesced before they reach
+ * the temp version in file_segments. Segments not written keep living in the
+ * base version, and are shared with the new version on release. Dirty segments are written out by flush(),
+ * which is called on release/flush, or early once the buffer grows past
+ * ndnfs::write_buffer_cap bytes. Flushed segments are kept, as long as they fit
+ * under the same cap, so that release can hand them to the segment cache.
+ */
+class WriteBuffer
+{
+public:
+  WriteBuffer(sqlite3_int64 ino, int base_ver, int seg_size);
+
+  ~WriteBuffer();
+
+  /**
+   * Apply a write to the buffer; a write starting past the end of file zero-fills the gap.
+   * @return size on success, negative errno on failure
+   */
+  int
+  write(const char *buf, size_t size, off_t offset);
+
+  /**
+   * Read what the file holds as seen through this handle, its own writes included.
+   * @return bytes read, which stop at the end of file
+   */
+  int
+  read(char *buf, size_t size, off_t offset);
+
+  /**
+   * Write all dirty segments into the temp version in one transaction.
+   * @return 0 on success, negative errno on failure
+   */
+  int
+  flush();
+
+  /**
+   * Cut what the file holds as seen through this handle at length, or zero-fill it up to
+   * length. Dirty segments are flushed first, and the temp version is cut in db.
+   * @param base_ver version the handle builds on from now, which holds at most length bytes
+   * @return 0 on success, negative errno on failure
+   */
+  int
+  truncate(off_t length, int base_ver);
+
+  /**
+   * Move out the segments flushed since open that are still kept; call after the last flush.
+   */
+  void
+  takeFlushed(std::map<int, std::string> &segments);
+
+  int
+  tempVersion() const { return tempVersion_; }
+
+  size_t
+  dirtyBytes() const { return dirtyBytes_; }
+
+  /**
+   * Whether anything was written through this buffer since open, flushed or not.
+   */
+  bool
+  written() const { return written_; }
+
+private:
+  void
+  loadSize();
+
+  void
+  fill(const char *buf, size_t size, off_t offset);
+
+  std::string&
+  segment(int seg);
+
+  sqlite3_int64 ino_;
+  int tempVersion_;
+  int baseVersion_;
+  int segSize_;
+  std::map<int, std::string> dirty_;
+  size_t dirtyBytes_;
+  std::map<int, std::string> flushed_;
+  size_t flushedBytes_;
+  // size of the temp version, including dirty segments; -1 until first write
+  off_t size_;
+  // size of the temp version as stored in db
+  off_t storedSize_;
+  bool written_;
+};
+
+#endif
@@ -4,4 +4,5 @@ const std::string NdnfsNamespace::mimeComponentName_ = "mime_type";
 
 const std::string NdnfsNamespace::fileComponentName_ = "%C1.FS.file";
 const std::string NdnfsNamespace::dirComponentName_ = "%C1.FS.dir";
+const std::string NdnfsNamespace::manifestComponentName_ = "%C1.FS.manifest";
 const std::string NdnfsNamespace::contentMetaString_ = "_list";
\ No newline at end of file
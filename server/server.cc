@@ -36,11 +36,13 @@ string ndnfs::server::fs_path = "/tmp/ndnfs";
 string ndnfs::server::fs_prefix = "/ndn/broadcast/ndnfs";
 string ndnfs::server::logging_path = "";
 
+// File segments are cut into the seg_size of each file; this is the size of the other packets
 const int ndnfs::server::seg_size = 8192;
-const int ndnfs::server::seg_size_shift = 13;
 const int ndnfs::server::default_freshness_period = 5000;
 
 sqlite3 *ndnfs::server::db;
+// Read only; ndnfs appends segments next to the db it shares with the server
+ExtentStore *ndnfs::server::extent_store;
 ndn::ptr_lib::shared_ptr<ndn::KeyChain> ndnfs::server::keyChain;
 ndn::Name ndnfs::server::certificateName;
 
@@ -149,12 +151,16 @@ int main(int argc, char **argv) {
   
   if (sqlite3_open(ndnfs::server::db_name.c_str(), &ndnfs::server::db) == SQLITE_OK) {
     FILE_LOG(LOG_DEBUG) << "main: sqlite database open ok" << endl;
+    // ndnfs signs in the background and may hold write locks briefly
+    sqlite3_busy_timeout(ndnfs::server::db, 10000);
   } else {
 	FILE_LOG(LOG_DEBUG) << "main: cannot connect to sqlite db: " << ndnfs::server::db_name << ", quit" << endl;
 	sqlite3_close(ndnfs::server::db);
 	return -1;
   }
 
+  ndnfs::server::extent_store = new ExtentStore(ndnfs::server::db_name + ".extents", false);
+
   FILE_LOG(LOG_DEBUG) << "main: db file: " << ndnfs::server::db_name << endl;
   FILE_LOG(LOG_DEBUG) << "main: fs root path: " << ndnfs::server::fs_path << endl;
   
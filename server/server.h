@@ -21,11 +21,17 @@
 
 // logger and file-type headers are shared by server and fs;
 #include "logger.h"
+#include "statement-cache.h"
+#include "dentry.h"
+#include "extent-store.h"
+#include "compression.h"
 #include "file-type.h"
+#include "signature-states.h"
 
 namespace ndnfs {
   namespace server {
 	extern sqlite3 *db;
+	extern ExtentStore *extent_store;
 	extern ndn::ptr_lib::shared_ptr<ndn::KeyChain> keyChain;
 	extern ndn::Name certificateName;
 	
@@ -35,7 +41,6 @@ namespace ndnfs {
     extern std::string logging_path;
     
     extern const int seg_size;
-    extern const int seg_size_shift;
     extern const int default_freshness_period;
   }
 }
@@ -44,15 +44,34 @@
 using namespace std;
 using namespace ndn;
 
-void readFileSize(string path, int& file_size, int& total_seg)
+void readFileSize(string path, int version, int& file_size, int& total_seg, int& seg_size, bool& chunked)
 {
-  char file_path[PATH_MAX] = "";
-  abs_path(file_path, path.c_str());
-  
-  struct stat st;
-  stat(file_path, &st);
-  file_size = st.st_size;
-  total_seg = (file_size >> ndnfs::server::seg_size_shift) + 1;
+  file_size = 0;
+  seg_size = ndnfs::server::seg_size;
+  sqlite3_int64 ino = path_to_ino(ndnfs::server::db, path);
+  CachedStatement stmt;
+  // A file keeps the segment size it was created with, so it holds for every version
+  stmt.prepare(ndnfs::server::db, "SELECT v.size, f.seg_size FROM file_versions v LEFT JOIN file_system f ON f.ino = v.ino WHERE v.ino = ? AND v.version = ?");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, version);
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    file_size = sqlite3_column_int(stmt, 0);
+    if (sqlite3_column_type(stmt, 1) != SQLITE_NULL)
+      seg_size = sqlite3_column_int(stmt, 1);
+  }
+  stmt.finalize();
+  total_seg = file_size / seg_size + 1;
+
+  // Segments cut by content know where they start; how many there are is only known from the rows
+  chunked = false;
+  stmt.prepare(ndnfs::server::db, "SELECT COUNT(*) FROM file_segments WHERE ino = ? AND version = ? AND seg_offset IS NOT NULL");
+  sqlite3_bind_int64(stmt, 1, ino);
+  sqlite3_bind_int(stmt, 2, version);
+  if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) > 0) {
+    chunked = true;
+    total_seg = sqlite3_column_int(stmt, 0);
+  }
+  stmt.finalize();
   return;
 }
 
@@ -67,6 +86,7 @@ int parseName(const ndn::Name& name, int &version, int &seg, string &path)
   version = -1;
   seg = -1;
   int hasMeta = 0;
+  int hasManifest = 0;
   
   // this should be changed to using toVersion, not using the the octets directly in case
   // of future changes in naming conventions...
@@ -104,6 +124,7 @@ int parseName(const ndn::Name& name, int &version, int &seg, string &path)
         return -1;
       } else {
         hasMeta = 1;
+        hasManifest = (iter->toEscapedString() == NdnfsNamespace::manifestComponentName_);
       }
     }
     else {
@@ -128,8 +149,12 @@ int parseName(const ndn::Name& name, int &version, int &seg, string &path)
   if (path == "")
     path = string("/");
      
+  // has manifest component and <version>
+  if (version != -1 && hasManifest) {
+    ret = 4;
+  }
   // has <version>/<segment> 
-  if (version != -1 && seg != -1) {
+  else if (version != -1 && seg != -1) {
     ret = 3;
   }
   // has <version>, but not meta component
@@ -161,8 +186,15 @@ void onInterestCallback(const ndn::ptr_lib::shared_ptr<const ndn::Name>& prefix,
     FILE_LOG(LOG_ERROR) << "onInterest: child selectors, min/maxSuffixComponents or excludes are not supported in current implementation." << endl;
   }
   
+  // The client is asking for a segment of the manifest of a version.
+  if (ret == 4) {
+    ret = sendManifest(path, version, seg, face);
+    if (ret == -1) {
+      FILE_LOG(LOG_DEBUG) << "onInterest: no such manifest found in ndnfs. " << interest_name.toUri() << endl;
+    }
+  }
   // The client is asking for a segment of a file; selectors and excludes are ignored in this case.
-  if (ret == 3) {
+  else if (ret == 3) {
     ret = sendFileContent(interest_name, path, version, seg, face);
     if (ret == -1) {
       FILE_LOG(LOG_ERROR) << "onInterest: sendFileContent returned failure for interest name. " << interest_name.toUri() << endl;
@@ -172,19 +204,19 @@ void onInterestCallback(const ndn::ptr_lib::shared_ptr<const ndn::Name>& prefix,
   else if (ret == 2) {
     // even though client is only asking for a version of file, we still query if that file exists in file_system database,
     // and extracts mime-type and file-type from database.
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(ndnfs::server::db, "SELECT mime_type, type FROM file_system WHERE path = ?", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+    CachedStatement stmt;
+    stmt.prepare(ndnfs::server::db, "SELECT mime_type, type FROM file_system WHERE ino = ?");
+    sqlite3_bind_int64(stmt, 1, path_to_ino(ndnfs::server::db, path));
 
     if (sqlite3_step(stmt) != SQLITE_ROW) {
       FILE_LOG(LOG_DEBUG) << "onInterest: no such file found in ndnfs: " << path << endl;
-      sqlite3_finalize(stmt);
+      stmt.finalize();
       return;
     }
     
     string mimeType = string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)));
     enum FileType fileType = static_cast<FileType>(sqlite3_column_int(stmt, 1));
-    sqlite3_finalize(stmt);
+    stmt.finalize();
     
     // In order to make the behavior same as a content store, we should reply with the first piece of matching data; 
     // Since meta component "C1.FS.file" is not present.
@@ -204,12 +236,12 @@ void onInterestCallback(const ndn::ptr_lib::shared_ptr<const ndn::Name>& prefix,
   // Concerns: If implemented like this, the behavior may confuse nfd,
   //  since here child selectors and excludes doesn't have impact on the name of the content returned.
   else if (ret == 1) {
-    sqlite3_stmt *stmt;
-    sqlite3_prepare_v2(ndnfs::server::db, "SELECT current_version, mime_type, type FROM file_system WHERE path = ?", -1, &stmt, 0);
-    sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+    CachedStatement stmt;
+    stmt.prepare(ndnfs::server::db, "SELECT current_version, mime_type, type, ready_signed, signed_version FROM file_system WHERE ino = ?");
+    sqlite3_bind_int64(stmt, 1, path_to_ino(ndnfs::server::db, path));
     if (sqlite3_step(stmt) != SQLITE_ROW) {
       FILE_LOG(LOG_DEBUG) << "onInterest: no such file found in ndnfs: " << path << endl;
-      sqlite3_finalize(stmt);
+      stmt.finalize();
       
       // It may not be a file, but a folder instead, which is not stored in database
       ret = sendDirMetaBrowserFriendly(path, face);
@@ -217,12 +249,22 @@ void onInterestCallback(const ndn::ptr_lib::shared_ptr<const ndn::Name>& prefix,
     else {
       version = sqlite3_column_int(stmt, 0);
       string mimeType = "";
-      if (sqlite3_column_text(stmt, 3) != NULL) {
+      if (sqlite3_column_text(stmt, 1) != NULL) {
         mimeType = string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
       }
       enum FileType fileType = static_cast<FileType>(sqlite3_column_int(stmt, 2));
+      enum SignatureState signatureState = static_cast<SignatureState>(sqlite3_column_int(stmt, 3));
+      
+      // While the current version waits in the sign queue, the last signed version is published instead
+      if (signatureState == READY_OLD) {
+        version = sqlite3_column_int(stmt, 4);
+      }
+      stmt.finalize();
       
-      sqlite3_finalize(stmt);
+      if (fileType == REGULAR && signatureState == NOT_READY) {
+        FILE_LOG(LOG_DEBUG) << "onInterest: no signed version of file yet: " << path << endl;
+        return;
+      }
       ret = sendFileMeta(path, mimeType, version, fileType, face);
     }
     return;
@@ -239,34 +281,48 @@ int sendFileContent(Name interest_name, string path, int version, int seg, ndn::
     seg = 0;
   }
   
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(ndnfs::server::db, "SELECT path, version, segment, signature FROM file_segments WHERE path = ? AND version = ? AND segment = ?", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+  CachedStatement stmt;
+  stmt.prepare(ndnfs::server::db, "SELECT s.signature, s.content, s.extent, s.extent_offset, s.stored_size, s.encoding, s.size, v.manifest, v.encoding \
+                                         FROM segment_content s LEFT JOIN file_versions v ON v.ino = s.ino AND v.version = s.version \
+                                         WHERE s.ino = ? AND s.version = ? AND s.segment = ?");
+  sqlite3_bind_int64(stmt, 1, path_to_ino(ndnfs::server::db, path));
   sqlite3_bind_int(stmt, 2, version);
   sqlite3_bind_int(stmt, 3, seg);
   if(sqlite3_step(stmt) != SQLITE_ROW){
     FILE_LOG(LOG_DEBUG) << "sendFileContent: no such file/version/segment found in ndnfs: " << path << endl;
-    sqlite3_finalize(stmt);
+    stmt.finalize();
     return -1;
   }
 
-  const char * signatureBlob = (const char *)sqlite3_column_blob(stmt, 3);
-  int len = sqlite3_column_bytes(stmt, 3);
-  sqlite3_finalize(stmt);
-
-  // For now, the signature type is assumed to be Sha256withRSA; should read
-  // signature type from database, which is not yet implemented in the database
-  Sha256WithRsaSignature signature;
-  
-  signature.setSignature(Blob((const uint8_t *)signatureBlob, len));
+  const char * signatureBlob = (const char *)sqlite3_column_blob(stmt, 0);
+  int len = sqlite3_column_bytes(stmt, 0);
   
-  data.setSignature(signature);
+  // The segment belongs to a version the sign queue has not reached yet
+  if (len == 4 && memcmp(signatureBlob, "NONE", 4) == 0) {
+    FILE_LOG(LOG_DEBUG) << "sendFileContent: segment not signed yet: " << path << endl;
+    stmt.finalize();
+    return -1;
+  }
+
+  bool manifest = (sqlite3_column_int(stmt, 7) != 0);
+  // A version published compressed was signed as its segments are stored, and is sent that way
+  bool encoded = (sqlite3_column_int(stmt, 8) != PLAIN_SEGMENT);
+  if (!manifest) {
+    // Without a manifest, the signature is assumed to be Sha256withRSA
+    Sha256WithRsaSignature signature;
+    
+    signature.setSignature(Blob((const uint8_t *)signatureBlob, len));
+    
+    data.setSignature(signature);
+  }
 
   // When assembling the data packet, finalblockid should be put into each segment,
   // this means when reading each segment, file_version also needs to be consulted for the finalBlockId.
   int total_seg = 0;
   int file_size = 0;
-  readFileSize(path, file_size, total_seg);
+  int seg_size = 0;
+  bool chunked = false;
+  readFileSize(path, version, file_size, total_seg, seg_size, chunked);
 
   if (total_seg > 0) {
     // in the JS plugin, finalBlockId component is parsed with toSegment
@@ -276,30 +332,23 @@ int sendFileContent(Name interest_name, string path, int version, int seg, ndn::
     data.getMetaInfo().setFinalBlockId(finalBlockId);
   }
   
-  int fd;
-  char file_path[PATH_MAX] = "";
-  abs_path(file_path, path.c_str());
-  
-  fd = open(file_path, O_RDONLY);
-  
-  if (fd == -1) {
-    FILE_LOG(LOG_ERROR) << "sendFileContent: Open " << file_path << " failed." << endl;
-    return -1;
-  }
-  
-  char *output = new char[ndnfs::server::seg_size];
-  int actual_len = pread(fd, output, ndnfs::server::seg_size, seg << ndnfs::server::seg_size_shift);
-  
-  close(fd);
-  
-  if (actual_len == -1) {
-    FILE_LOG(LOG_ERROR) << "sendFileContent: Read from " << file_path << " failed." << endl;
+  // Content comes from the same row as the signature, so a newer version written
+  // in the meantime cannot end up under this version's signature
+  string content;
+  if (read_content(ndnfs::server::extent_store, stmt, 1, content, !encoded) < 0) {
+    FILE_LOG(LOG_ERROR) << "sendFileContent: cannot read segment content: " << path << endl;
+    stmt.finalize();
     return -1;
   }
+  int actual_len = content.size();
   
   if (actual_len > 0) {
-    data.setContent((uint8_t*)output, actual_len);
+    data.setContent((const uint8_t *)content.data(), actual_len);
     data.getMetaInfo().setFreshnessPeriod(ndnfs::server::default_freshness_period);
+    // The digest in file_segments is the one listed in the manifest; the packet itself is only digest-signed
+    if (manifest) {
+      ndnfs::server::keyChain->signWithSha256(data);
+    }
 
     face.putData(data);
     FILE_LOG(LOG_DEBUG) << "sendFileContent: Data returned with name: " << data.getName().toUri() << endl;
@@ -307,32 +356,62 @@ int sendFileContent(Name interest_name, string path, int version, int seg, ndn::
     FILE_LOG(LOG_DEBUG) << "sendFileContent: File is empty. Name: " << data.getName().toUri() << endl;
   }
   
-  delete[] output;
+  stmt.finalize();
   return actual_len;
 }
 
+int sendManifest(const string& path, int version, int seg, ndn::Face& face)
+{
+  if (seg == -1) {
+    seg = 0;
+  }
+  
+  CachedStatement stmt;
+  stmt.prepare(ndnfs::server::db, "SELECT data FROM file_manifests WHERE ino = ? AND version = ? AND segment = ?");
+  sqlite3_bind_int64(stmt, 1, path_to_ino(ndnfs::server::db, path));
+  sqlite3_bind_int(stmt, 2, version);
+  sqlite3_bind_int(stmt, 3, seg);
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    stmt.finalize();
+    return -1;
+  }
+  
+  // Manifest packets are signed by ndnfs, and sent as they are
+  Data data;
+  data.wireDecode((const uint8_t *)sqlite3_column_blob(stmt, 0), sqlite3_column_bytes(stmt, 0));
+  stmt.finalize();
+  
+  face.putData(data);
+  FILE_LOG(LOG_DEBUG) << "sendManifest: Data returned with name: " << data.getName().toUri() << endl;
+  return 0;
+}
+
 int sendFileMeta(const string& path, const string& mimeType, int version, FileType type, ndn::Face& face) 
 {
-  sqlite3_stmt *stmt;
-  sqlite3_prepare_v2(ndnfs::server::db, "SELECT * FROM file_versions WHERE path = ? AND version = ? ", -1, &stmt, 0);
-  sqlite3_bind_text(stmt, 1, path.c_str(), -1, SQLITE_STATIC);
+  CachedStatement stmt;
+  stmt.prepare(ndnfs::server::db, "SELECT manifest, encoding FROM file_versions WHERE ino = ? AND version = ? ");
+  sqlite3_bind_int64(stmt, 1, path_to_ino(ndnfs::server::db, path));
   sqlite3_bind_int(stmt, 2, version);
   if (sqlite3_step(stmt) != SQLITE_ROW){
-    sqlite3_finalize(stmt);
+    stmt.finalize();
     return -1;
   }
-  sqlite3_finalize(stmt);
+  bool manifest = (sqlite3_column_int(stmt, 0) != 0);
+  int encoding = sqlite3_column_int(stmt, 1);
+  stmt.finalize();
   
   Ndnfs::FileInfo infof;
   
   int total_seg = 0;
   int file_size = 0;
+  int seg_size = ndnfs::server::seg_size;
+  bool chunked = false;
   
   // only regular files will get size-read, 
   // types such as symlink would bring back a size of zero; 
   // TODO: right now, browser plugin still asks for the first segment, even if it's symlink
   if (type == REGULAR) {
-    readFileSize(path, file_size, total_seg);
+    readFileSize(path, version, file_size, total_seg, seg_size, chunked);
   } else {
   
   }
@@ -340,10 +419,20 @@ int sendFileMeta(const string& path, const string& mimeType, int version, FileTy
   infof.set_size(file_size);
   infof.set_totalseg(total_seg);
   infof.set_version(version);
+  infof.set_segsize(seg_size);
   
   if (mimeType != "") {
     infof.set_mimetype(mimeType);
   }
+  if (manifest) {
+    infof.set_manifest(true);
+  }
+  if (chunked) {
+    infof.set_chunked(true);
+  }
+  if (encoding != PLAIN_SEGMENT) {
+    infof.set_encoding(encoding_name(encoding));
+  }
   
   char *wireData = new char[infof.ByteSize()];
   infof.SerializeToArray(wireData, infof.ByteSize());
@@ -60,6 +60,8 @@ void onRegisterFailed(const ndn::ptr_lib::shared_ptr<const ndn::Name>& prefix);
  * <root>/<path>/<version>: 2, check if <path>/<version> exists in db, should it work only with file, or file/folder both?
  * <root>/<path>/<version>/<segment>: 3, check if <path>/<version>/<segment> exists as a segment of a file
  *   return name: same, content: actual file content assembled with signature
+ * <root>/<path>/C1.FS.MANIFEST/<version>/[segment]: 4, check if the manifest of <path>/<version> exists
+ *   return name: same, content: segment digests, as stored by ndnfs
  * 
  * Otherwise return -1, we received a name that does not fit in any of these patterns.
  *
@@ -73,13 +75,16 @@ int
 parseName(const ndn::Name& name, int &version, int &seg, std::string &path);
 
 /**
- * readFileSize reads a file from path, and extracts its size and number of segments.
+ * readFileSize looks up a version of a file in file_versions, and extracts its size, number of segments and segment size.
  * @param path String path to the file
+ * @param version The version whose size is read
  * @param file_size Overwritten with number of bytes of the file
  * @param total_seg Overwritten with number of segments of the file
+ * @param seg_size Overwritten with number of content bytes per segment of the file; for a version cut by content, the most a segment has
+ * @param chunked Overwritten with whether the version was cut by content, into segments of varying size
  */
 void 
-readFileSize(std::string path, int& file_size, int& total_seg);
+readFileSize(std::string path, int version, int& file_size, int& total_seg, int& seg_size, bool& chunked);
 
 /**
  * sendDirMeta tries to decide if path is a directory, if so, it reads the directory, 
@@ -103,8 +108,16 @@ sendFileMeta(const std::string& path, const std::string& mimeType, int version,
 
 /**
  * sendFileContent checks if entry exists in file_segments table, and returns the assembled data packet if so.
+ * Segments still waiting in the sign queue are not served. Segments of versions signed with a manifest
+ * get a DigestSha256 signature, computed as they are sent.
  */
 int 
 sendFileContent(ndn::Name interest_name, std::string path, int version, int seg, ndn::Face& face);
 
+/**
+ * sendManifest checks if entry exists in file_manifests table, and returns the stored data packet if so.
+ */
+int 
+sendManifest(const std::string& path, int version, int seg, ndn::Face& face);
+
 #endif // __SERVER_MODULE_H__
@@ -8,6 +8,9 @@
 #include <iostream>
 #include <fstream>
 
+#include <openssl/sha.h>
+#include <zstd.h>
+
 #include "namespace.h"
 
 using namespace ndn;
@@ -24,10 +27,17 @@ using namespace func_lib::placeholders;
 Handler::Handler(Face &face, KeyChain &keyChain, string nameStr, string fileName, bool fetchFile, bool doVerification) :
   face_(face), keyChain_(keyChain), nameStr_(nameStr), 
   fileName_(fileName), fetchFile_(fetchFile), doVerification_(doVerification),
-  done_(false), currentSegment_(0), totalSegment_(0)
+  done_(false), currentSegment_(0), totalSegment_(0), chunked_(false), fileSize_(0), receivedBytes_(0), encoded_(false), manifest_(false)
 {
 }
 
+static string digestContent(const Blob& content)
+{
+  uint8_t digest[SHA256_DIGEST_LENGTH];
+  SHA256(content.buf(), content.size(), digest);
+  return string((const char *)digest, sizeof(digest));
+}
+
 Handler::~Handler() {
 
 }
@@ -62,21 +72,49 @@ void Handler::onAttrData(const ptr_lib::shared_ptr<const Interest>& interest, co
       cout << "size:  " << infof.size() << endl;
       cout << "version:   " << infof.version() << endl;
       cout << "total segments: " << infof.totalseg() << endl;
+      if (infof.has_segsize()) {
+        cout << "segment size: " << infof.segsize() << endl;
+      }
+      if (infof.chunked()) {
+        cout << "segments: cut by content, of up to the segment size" << endl;
+      }
       if (infof.mimetype() != "") {
         cout << "mime type: " << infof.mimetype() << endl;
       }
+      if (infof.encoding() != "") {
+        cout << "segments: sent compressed, encoding " << infof.encoding() << endl;
+      }
     
       totalSegment_ = infof.totalseg();
+      chunked_ = infof.chunked();
+      encoded_ = (infof.encoding() == "zstd");
+      fileSize_ = infof.size();
+      receivedBytes_ = 0;
     
       if (fetchFile_) {
         Name fileName = data_name.getPrefix(data_name.size() - 2);
-        fileName.appendVersion((uint64_t)infof.version()).appendSegment(0);
+        fileName.appendVersion((uint64_t)infof.version());
+        fileDataName_ = fileName;
+        fileName.appendSegment(0);
   
-        Interest interest(fileName);
+        if (infof.manifest()) {
+          // The manifest comes first, since it is what the segments are verified against
+          manifest_ = true;
+          Name manifestName = data_name.getPrefix(data_name.size() - 2);
+          manifestName.append(Name::fromEscapedString(NdnfsNamespace::manifestComponentName_));
+          manifestName.appendVersion((uint64_t)infof.version()).appendSegment(0);
+          
+          Interest interest(manifestName);
+          face_.expressInterest
+            (interest, bind(&Handler::onManifestData, this, _1, _2), 
+             bind(&Handler::onTimeout, this, _1));
+        } else {
+          Interest interest(fileName);
 
-        face_.expressInterest
-          (interest, bind(&Handler::onFileData, this, _1, _2), 
-           bind(&Handler::onTimeout, this, _1));
+          face_.expressInterest
+            (interest, bind(&Handler::onFileData, this, _1, _2), 
+             bind(&Handler::onTimeout, this, _1));
+        }
       }
     }
     else{
@@ -125,10 +163,66 @@ void Handler::onAttrData(const ptr_lib::shared_ptr<const Interest>& interest, co
   done_ = true;
 }
 
+void Handler::onManifestData (const ptr_lib::shared_ptr<const Interest>& interest, const ptr_lib::shared_ptr<Data>& data) {
+  Name name = data->getName();
+  const Blob& content = data->getContent();
+  int seg = (int)(name.rbegin()->toSegment());
+  int finalSeg = (int)(data->getMetaInfo().getFinalBlockId().toSegment());
+  
+  if (seg == 0) {
+    if (doVerification_) {
+      keyChain_.verifyData
+        (data, bind(&Handler::onVerified, this, _1), 
+         (const OnVerifyFailed)bind(&Handler::onVerifyFailed, this, _1));
+    }
+  } else if (digestContent(content) != nextManifestDigest_) {
+    cout << "Manifest verification: FAILED at segment " << seg << endl;
+    done_ = true;
+    return;
+  }
+  
+  // All manifest segments but the last end with the digest of the next one
+  size_t digestsEnd = content.size();
+  if (seg != finalSeg) {
+    digestsEnd -= SHA256_DIGEST_LENGTH;
+    nextManifestDigest_ = string((const char *)content.buf() + digestsEnd, SHA256_DIGEST_LENGTH);
+  }
+  for (size_t i = 0; i + SHA256_DIGEST_LENGTH <= digestsEnd; i += SHA256_DIGEST_LENGTH) {
+    digests_.push_back(string((const char *)content.buf() + i, SHA256_DIGEST_LENGTH));
+  }
+  
+  Name nextName;
+  if (seg != finalSeg) {
+    nextName = name.getPrefix(name.size() - 1);
+    nextName.appendSegment((uint64_t)(seg + 1));
+    
+    Interest nextInterest(nextName);
+    face_.expressInterest
+      (nextInterest, bind(&Handler::onManifestData, this, _1, _2), 
+       bind(&Handler::onTimeout, this, _1));
+  } else {
+    cout << "Manifest received. Segment digests: " << digests_.size() << endl;
+    nextName = fileDataName_;
+    nextName.appendSegment(0);
+    
+    Interest nextInterest(nextName);
+    face_.expressInterest
+      (nextInterest, bind(&Handler::onFileData, this, _1, _2), 
+       bind(&Handler::onTimeout, this, _1));
+  }
+}
+
 void Handler::onFileData (const ptr_lib::shared_ptr<const Interest>& interest, const ptr_lib::shared_ptr<Data>& data) {
   Name name = data->getName();
   
-  if (doVerification_) {
+  if (manifest_) {
+    size_t seg = (size_t)(name.rbegin()->toSegment());
+    if (seg < digests_.size() && digestContent(data->getContent()) == digests_[seg]) {
+      cout << "Manifest digest verification: VERIFIED" << endl;
+    } else {
+      cout << "Manifest digest verification: FAILED" << endl;
+    }
+  } else if (doVerification_) {
     keyChain_.verifyData
       (data, bind(&Handler::onVerified, this, _1), 
        (const OnVerifyFailed)bind(&Handler::onVerifyFailed, this, _1));
@@ -136,13 +230,37 @@ void Handler::onFileData (const ptr_lib::shared_ptr<const Interest>& interest, c
     cout << "Verification skipped." << endl;
   }
 
+  Blob content = data->getContent();
+  if (encoded_) {
+    // Each segment is one zstd frame, which records the size of its content
+    unsigned long long length = ZSTD_getFrameContentSize(content.buf(), content.size());
+    string decoded;
+    if (length != ZSTD_CONTENTSIZE_ERROR && length != ZSTD_CONTENTSIZE_UNKNOWN) {
+      decoded.resize(length);
+      size_t res = ZSTD_decompress(&decoded[0], decoded.size(), content.buf(), content.size());
+      if (ZSTD_isError(res) || res != length) {
+        decoded.clear();
+        length = ZSTD_CONTENTSIZE_ERROR;
+      }
+    }
+    if (length == ZSTD_CONTENTSIZE_ERROR || length == ZSTD_CONTENTSIZE_UNKNOWN) {
+      cout << "onFileData: cannot decode segment " << name.toUri() << endl;
+    }
+    cout << "onFileData: Decoded " << content.size() << " bytes into " << decoded.size() << endl;
+    content = Blob((const uint8_t *)decoded.data(), decoded.size());
+  }
+
+  // Segments are fetched in order, so each one starts where the content received so far ends;
+  // segments cut by content do not start at segment * segment size
+  receivedBytes_ += content.size();
+
   if (fileName_ != "") {
     ofstream writeFile;
     // TODO: in case of out of order delivery, we should write to the file by offset.
     writeFile.open (fileName_, std::ofstream::out | std::ofstream::app);
-    cout << "onFileData: Received content. Size " << data->getContent().size() << endl;
-    for (size_t i = 0; i < data->getContent().size(); ++i) {
-      writeFile << (*data->getContent())[i];
+    cout << "onFileData: Received content. Size " << content.size() << endl;
+    for (size_t i = 0; i < content.size(); ++i) {
+      writeFile << content.buf()[i];
     }
     writeFile.close();
   } else {
@@ -153,6 +271,9 @@ void Handler::onFileData (const ptr_lib::shared_ptr<const Interest>& interest, c
   currentSegment_++;  // segments are zero-indexed
   if (currentSegment_ == totalSegment_) {
     cout << "Last segment received." << endl;
+    if ((chunked_ || encoded_) && receivedBytes_ != fileSize_) {
+      cout << "Received " << receivedBytes_ << " bytes, expecting " << fileSize_ << endl;
+    }
   } else {
     Name newInterestName(name.getPrefix(name.size() - 1));
     newInterestName.appendSegment((uint64_t)currentSegment_);
@@ -2,6 +2,7 @@
 #define HANDLER_H
 
 #include <unistd.h>
+#include <vector>
 
 #include <ndn-cpp/common.hpp>
 #include <ndn-cpp/data.hpp>
@@ -39,6 +40,13 @@ public:
   void 
   onFileData (const ndn::ptr_lib::shared_ptr<const ndn::Interest>& interest, const ndn::ptr_lib::shared_ptr<ndn::Data>& data);
   
+  /**
+   * onManifestData collects the segment digests of a version signed with a manifest;
+   * manifest segment 0 is verified by signature, and each following one by the digest chained in the previous.
+   */
+  void 
+  onManifestData (const ndn::ptr_lib::shared_ptr<const ndn::Interest>& interest, const ndn::ptr_lib::shared_ptr<ndn::Data>& data);
+  
   void 
   onTimeout(const ndn::ptr_lib::shared_ptr<const ndn::Interest>&);
   
@@ -57,6 +65,20 @@ private:
   int currentSegment_;
   int totalSegment_;
   
+  // Segments cut by content vary in size, so the content received tells where the next one goes
+  bool chunked_;
+  int fileSize_;
+  int receivedBytes_;
+  
+  // Segments of a version published compressed are verified as sent, and decoded after
+  bool encoded_;
+  
+  // Segment digests listed in the manifest, for versions signed with one
+  bool manifest_;
+  std::vector<std::string> digests_;
+  std::string nextManifestDigest_;
+  ndn::Name fileDataName_;
+  
   ndn::Face& face_;
   ndn::KeyChain& keyChain_;
 };